@@ -3,70 +3,330 @@
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 #define CONFIG_MAX_STRING 255
-#ifndef CONFIG_MAX_ENTRIES
-#define CONFIG_MAX_ENTRIES 32
-#endif
+
+// Entries are kept in the order set, and found through an open addressing index of their key hashes (at most half full,
+// so that probes stay short). Each key with numeric parts, such as "topic.3.level.2.after", is also recorded under an
+// array for each of them ("topic.#.level.2.after" with 3, "topic.3.level.#.after" with 2), so that the elements of an
+// array are enumerated directly rather than by probing every index or scanning every entry.
 
 typedef struct {
     char *key;
+    uint32_t hash;
     char *value;
 } config_entry_t;
 
-config_entry_t config_entries[CONFIG_MAX_ENTRIES];
-int config_entry_count = 0;
+typedef struct {
+    char *key; // The keys of its elements, with the index as '#'
+    uint32_t hash;
+    int *indices;
+    size_t count, capacity;
+    bool sorted;
+} config_array_t;
+
+typedef struct {
+    uint32_t *slots; // Item number + 1, 0 if free
+    size_t mask;
+} config_index_t;
+
+config_entry_t *config_entries = NULL;
+size_t config_entry_count = 0, config_entry_capacity = 0;
+config_index_t config_entry_index = {0};
+config_array_t *config_arrays = NULL;
+size_t config_array_count = 0, config_array_capacity = 0;
+config_index_t config_array_index = {0};
+const char *config_path = NULL; // File loaded from
+
+// The entries first loaded, set aside by the first config_reload, as modules configured at startup still hold their values
+config_entry_t *config_entries_initial = NULL;
+size_t config_entry_initial_count = 0;
+bool config_reloaded = false;
+
+// Items begin with their key and its hash, so that one index serves both entries and arrays
+typedef struct {
+    char *key;
+    uint32_t hash;
+} config_key_t;
+
+// The slot holding key, or the free slot where it would go
+size_t __config_index_slot(const config_index_t *index, const void *items, const size_t size, const char *key, const uint32_t hash) {
+    for (size_t slot = hash & index->mask;; slot = (slot + 1) & index->mask) {
+        const uint32_t item = index->slots[slot];
+        if (item == 0)
+            return slot;
+        const config_key_t *found = (const config_key_t *)(const void *)((const char *)items + (item - 1) * size);
+        if (found->hash == hash && strcmp(found->key, key) == 0)
+            return slot;
+    }
+}
+void *__config_index_find(const config_index_t *index, const void *items, const size_t size, const char *key, const uint32_t hash) {
+    if (index->slots == NULL)
+        return NULL;
+    const uint32_t item = index->slots[__config_index_slot(index, items, size, key, hash)];
+    return item == 0 ? NULL : (void *)(uintptr_t)((const char *)items + (item - 1) * size);
+}
+// Makes room for one more item, growing the items and rebuilding the index as needed
+bool __config_index_reserve(config_index_t *index, void **items, const size_t size, const size_t count, size_t *capacity) {
+    if (count == *capacity) {
+        const size_t grown = *capacity > 0 ? *capacity * 2 : 64;
+        void *resized = realloc(*items, grown * size);
+        if (resized == NULL)
+            return false;
+        *items = resized;
+        *capacity = grown;
+    }
+    if (index->slots != NULL && (count + 1) * 2 <= index->mask + 1)
+        return true;
+    const size_t slots = (index->mask + 1) * 2 > 128 ? (index->mask + 1) * 2 : 128;
+    uint32_t *resized = calloc(slots, sizeof(uint32_t));
+    if (resized == NULL)
+        return false;
+    free(index->slots);
+    index->slots = resized;
+    index->mask = slots - 1;
+    for (size_t i = 0; i < count; i++) {
+        const config_key_t *item = (const config_key_t *)(const void *)((const char *)*items + i * size);
+        index->slots[__config_index_slot(index, *items, size, item->key, item->hash)] = (uint32_t)(i + 1);
+    }
+    return true;
+}
+void __config_index_free(config_index_t *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->mask = 0;
+}
+
+// Records a new key under each array it is an element of
+void __config_array_add(const char *key) {
+    char name[CONFIG_MAX_STRING + 1];
+    const size_t length = strlen(key);
+    if (length >= sizeof(name))
+        return;
+    for (size_t start = 0; start < length;) {
+        size_t end = start;
+        while (end < length && key[end] != '.')
+            end++;
+        if (end > start && end - start < 10 && strspn(key + start, "0123456789") == end - start && start > 0 && end < length) {
+            memcpy(name, key, start);
+            name[start] = '#';
+            memcpy(name + start + 1, key + end, length - end + 1);
+            const uint32_t hash = hash_string(name, NULL);
+            config_array_t *array = __config_index_find(&config_array_index, config_arrays, sizeof(config_array_t), name, hash);
+            if (array == NULL) {
+                if (!__config_index_reserve(&config_array_index, (void **)&config_arrays, sizeof(config_array_t), config_array_count, &config_array_capacity))
+                    return;
+                array = &config_arrays[config_array_count];
+                *array = (config_array_t){.key = strdup(name), .hash = hash, .sorted = true};
+                if (array->key == NULL)
+                    return;
+                config_array_index.slots[__config_index_slot(&config_array_index, config_arrays, sizeof(config_array_t), name, hash)] = (uint32_t)++config_array_count;
+            }
+            if (array->count == array->capacity) {
+                const size_t capacity = array->capacity > 0 ? array->capacity * 2 : 8;
+                int *indices = realloc(array->indices, capacity * sizeof(int));
+                if (indices == NULL)
+                    return;
+                array->indices = indices;
+                array->capacity = capacity;
+            }
+            const int index = atoi(key + start);
+            if (array->count > 0 && array->indices[array->count - 1] > index)
+                array->sorted = false;
+            array->indices[array->count++] = index;
+        }
+        start = end + 1;
+    }
+}
 
 void __config_set_value(const char *key, const char *value) {
-    for (int i = 0; i < config_entry_count; i++)
-        if (strcmp(config_entries[i].key, key) == 0) {
-            free(config_entries[i].value);
-            config_entries[i].value = strdup(value);
+    const uint32_t hash = hash_string(key, NULL);
+    config_entry_t *entry = __config_index_find(&config_entry_index, config_entries, sizeof(config_entry_t), key, hash);
+    if (entry != NULL) {
+        char *copy = strdup(value);
+        if (copy == NULL) {
+            fprintf(stderr, "config: failed to allocate memory, ignoring %s=%s\n", key, value);
             return;
         }
-    if (config_entry_count < CONFIG_MAX_ENTRIES) {
-        config_entries[config_entry_count].key = strdup(key);
-        config_entries[config_entry_count].value = strdup(value);
-        config_entry_count++;
-    } else
-        fprintf(stderr, "config: too many entries, ignoring %s=%s\n", key, value);
+        free(entry->value);
+        entry->value = copy;
+        return;
+    }
+    if (!__config_index_reserve(&config_entry_index, (void **)&config_entries, sizeof(config_entry_t), config_entry_count, &config_entry_capacity)) {
+        fprintf(stderr, "config: failed to allocate memory, ignoring %s=%s\n", key, value);
+        return;
+    }
+    entry = &config_entries[config_entry_count];
+    entry->key = strdup(key);
+    entry->hash = hash;
+    entry->value = strdup(value);
+    if (entry->key == NULL || entry->value == NULL) {
+        fprintf(stderr, "config: failed to allocate memory, ignoring %s=%s\n", key, value);
+        free(entry->key);
+        free(entry->value);
+        return;
+    }
+    config_entry_index.slots[__config_index_slot(&config_entry_index, config_entries, sizeof(config_entry_t), key, hash)] = (uint32_t)++config_entry_count;
+    __config_array_add(key);
+}
+
+void __config_sources_free(void);
+void __config_free(void) {
+    __config_sources_free();
+    for (size_t i = 0; i < config_entry_count; i++) {
+        free(config_entries[i].key);
+        free(config_entries[i].value);
+    }
+    free(config_entries);
+    config_entries = NULL;
+    config_entry_count = config_entry_capacity = 0;
+    __config_index_free(&config_entry_index);
+    for (size_t i = 0; i < config_array_count; i++) {
+        free(config_arrays[i].key);
+        free(config_arrays[i].indices);
+    }
+    free(config_arrays);
+    config_arrays = NULL;
+    config_array_count = config_array_capacity = 0;
+    __config_index_free(&config_array_index);
 }
 
 const char *config_get_string(const char *key, const char *default_value) {
-    for (int i = 0; i < config_entry_count; i++)
-        if (strcmp(config_entries[i].key, key) == 0)
-            return config_entries[i].value;
-    return default_value;
+    const config_entry_t *entry = __config_index_find(&config_entry_index, config_entries, sizeof(config_entry_t), key, hash_string(key, NULL));
+    return entry != NULL ? entry->value : default_value;
 }
 
 int config_get_integer(const char *key, const int default_value) {
-    for (int i = 0; i < config_entry_count; i++)
-        if (strcmp(config_entries[i].key, key) == 0) {
-            char *endptr;
-            const long val = strtol(config_entries[i].value, &endptr, 0);
-            if (*endptr == '\0')
-                return (int)val;
-            else {
-                fprintf(stderr, "config: invalid integer value '%s' for key '%s', using default\n", config_entries[i].value, key);
-                return default_value;
-            }
-        }
+    const char *value = config_get_string(key, NULL);
+    if (value == NULL)
+        return default_value;
+    char *endptr;
+    const long val = strtol(value, &endptr, 0);
+    if (*endptr == '\0')
+        return (int)val;
+    fprintf(stderr, "config: invalid integer value '%s' for key '%s', using default\n", value, key);
+    return default_value;
+}
+
+double config_get_double(const char *key, const double default_value) {
+    const char *value = config_get_string(key, NULL);
+    if (value == NULL)
+        return default_value;
+    char *endptr;
+    const double number = strtod(value, &endptr);
+    if (endptr != value && *endptr == '\0')
+        return number;
+    fprintf(stderr, "config: invalid number value '%s' for key '%s', using default\n", value, key);
+    return default_value;
+}
+
+// Durations are seconds, optionally fractional or with an "s" suffix, or milliseconds with an "ms" suffix ("120", "0.5", "250ms")
+bool config_parse_duration_ms(const char *value, int64_t *result) {
+    char *endptr;
+    const double number = strtod(value, &endptr);
+    if (endptr == value || number < 0)
+        return false;
+    if (*endptr == '\0' || strcmp(endptr, "s") == 0)
+        *result = (int64_t)(number * 1000.0 + 0.5);
+    else if (strcmp(endptr, "ms") == 0)
+        *result = (int64_t)(number + 0.5);
+    else
+        return false;
+    return true;
+}
+
+int64_t config_get_duration_ms(const char *key, const int64_t default_value) {
+    const char *value = config_get_string(key, NULL);
+    int64_t result;
+    if (value == NULL)
+        return default_value;
+    if (config_parse_duration_ms(value, &result))
+        return result;
+    fprintf(stderr, "config: invalid duration value '%s' for key '%s', using default\n", value, key);
     return default_value;
 }
 
 bool config_get_bool(const char *key, const bool default_value) {
-    for (int i = 0; i < config_entry_count; i++)
-        if (strcmp(config_entries[i].key, key) == 0) {
-            if (strcasecmp(config_entries[i].value, "true") == 0 || strcmp(config_entries[i].value, "1") == 0)
-                return true;
-            else if (strcasecmp(config_entries[i].value, "false") == 0 || strcmp(config_entries[i].value, "0") == 0)
-                return false;
-            fprintf(stderr, "config: invalid boolean value '%s' for key '%s', using default\n", config_entries[i].value, key);
-        }
+    const char *value = config_get_string(key, NULL);
+    if (value == NULL)
+        return default_value;
+    if (strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0)
+        return true;
+    else if (strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0)
+        return false;
+    fprintf(stderr, "config: invalid boolean value '%s' for key '%s', using default\n", value, key);
     return default_value;
 }
 
+int __config_index_compare(const void *a, const void *b) {
+    const int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+// Gives the indices N for which "<prefix>.N.<suffix>" is set, in ascending order (valid until the configuration next changes)
+size_t config_get_array(const char *prefix, const char *suffix, const int **indices) {
+    char name[CONFIG_MAX_STRING + 1];
+    *indices = NULL;
+    if (snprintf(name, sizeof(name), "%s.#.%s", prefix, suffix) >= (int)sizeof(name))
+        return 0;
+    config_array_t *array = __config_index_find(&config_array_index, config_arrays, sizeof(config_array_t), name, hash_string(name, NULL));
+    if (array == NULL)
+        return 0;
+    if (!array->sorted) {
+        qsort(array->indices, array->count, sizeof(int), __config_index_compare);
+        array->sorted = true;
+    }
+    *indices = array->indices;
+    return array->count;
+}
+
+// A section is the keys under "<prefix>.N.", such as those of one element of an array, looked up by the rest of the key;
+// it composes the key prefix once, rather than for every key looked up under it. Sections nest: an element of an array
+// within a section is a section of its own.
+typedef struct {
+    char key[CONFIG_MAX_STRING + 1];
+    size_t length;
+} config_section_t;
+
+bool config_section(config_section_t *section, const config_section_t *parent, const char *prefix, const int index) {
+    const int length = snprintf(section->key, sizeof(section->key), "%.*s%s.%d.", parent != NULL ? (int)parent->length : 0, parent != NULL ? parent->key : "", prefix, index);
+    section->length = length > 0 && length < (int)sizeof(section->key) ? (size_t)length : 0;
+    section->key[section->length] = '\0';
+    return section->length > 0;
+}
+// The full key of name within the section, valid until the next lookup in it
+const char *config_section_key(config_section_t *section, const char *name) {
+    const size_t length = strlen(name);
+    if (section->length + length >= sizeof(section->key))
+        return "";
+    memcpy(section->key + section->length, name, length + 1);
+    return section->key;
+}
+const char *config_section_get_string(config_section_t *section, const char *name, const char *default_value) {
+    return config_get_string(config_section_key(section, name), default_value);
+}
+int config_section_get_integer(config_section_t *section, const char *name, const int default_value) {
+    return config_get_integer(config_section_key(section, name), default_value);
+}
+double config_section_get_double(config_section_t *section, const char *name, const double default_value) {
+    return config_get_double(config_section_key(section, name), default_value);
+}
+int64_t config_section_get_duration_ms(config_section_t *section, const char *name, const int64_t default_value) {
+    return config_get_duration_ms(config_section_key(section, name), default_value);
+}
+bool config_section_get_bool(config_section_t *section, const char *name, const bool default_value) {
+    return config_get_bool(config_section_key(section, name), default_value);
+}
+// The indices N for which "<section><prefix>.N.<suffix>" is set, as config_get_array
+size_t config_section_get_array(config_section_t *section, const char *prefix, const char *suffix, const int **indices) {
+    return config_get_array(config_section_key(section, prefix), suffix, indices);
+}
+
 bool is_empty_or_comment(const char *line) {
     if (*line == '\0')
         return true;
@@ -76,35 +336,246 @@ bool is_empty_or_comment(const char *line) {
     return false;
 }
 
-void __config_load_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "config: could not load '%s'\n", filename);
-        return;
+// A file may include others, "include = <file>", or every "*.cfg" file in a directory, "include-dir = <directory>", taken
+// in name order (bytewise, whatever the locale); relative paths are from the directory of the file including them. Each
+// is loaded where the directive appears, so what follows it overrides what it sets. Files are read whole and parsed in
+// place, so lines may be of any length. The files and directories loaded are recorded, with how long each took (a file
+// not counting what it includes, a directory counting all of its files), to report on and to watch for changes. A file or
+// directory that includes itself, directly or not, is an error; the depth limit is only a backstop.
+
+#define CONFIG_INCLUDE_DEPTH_MAX 8
+
+typedef struct {
+    char *path;
+    bool directory;
+    bool fragment; // Loaded as part of an included directory
+    size_t bytes, settings;
+    int64_t elapsed_us;
+} config_source_t;
+
+config_source_t *config_sources = NULL;
+size_t config_source_count = 0, config_source_capacity = 0;
+
+config_source_t *__config_source_add(const char *path, const bool directory, const bool fragment) {
+    if (config_source_count == config_source_capacity) {
+        const size_t capacity = config_source_capacity > 0 ? config_source_capacity * 2 : 16;
+        config_source_t *sources = realloc(config_sources, capacity * sizeof(config_source_t));
+        if (sources == NULL)
+            return NULL;
+        config_sources = sources;
+        config_source_capacity = capacity;
     }
-    char line[CONFIG_MAX_STRING];
-    while (fgets(line, sizeof(line), file)) {
-        if (is_empty_or_comment(line))
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return NULL;
+    config_source_t *source = &config_sources[config_source_count++];
+    *source = (config_source_t){.path = copy, .directory = directory, .fragment = fragment};
+    return source;
+}
+void __config_sources_free(void) {
+    for (size_t i = 0; i < config_source_count; i++)
+        free(config_sources[i].path);
+    free(config_sources);
+    config_sources = NULL;
+    config_source_count = config_source_capacity = 0;
+}
+
+// The files and directories being loaded, outermost first, by canonical path (NULL if it has none, as it cannot be read)
+char *config_include_chain[2 * (CONFIG_INCLUDE_DEPTH_MAX + 1)];
+size_t config_include_count = 0;
+
+// Puts the path on the chain, unless it is already there (an include cycle); each entry is taken off by __config_include_leave
+bool __config_include_enter(const char *path) {
+    char *canonical = realpath(path, NULL);
+    for (size_t i = 0; canonical != NULL && i < config_include_count; i++)
+        if (config_include_chain[i] != NULL && strcmp(config_include_chain[i], canonical) == 0) {
+            fprintf(stderr, "config: include cycle, '%s' is already being loaded\n", path);
+            free(canonical);
+            return false;
+        }
+    if (config_include_count == sizeof(config_include_chain) / sizeof(config_include_chain[0])) {
+        fprintf(stderr, "config: includes nested too deeply at '%s'\n", path);
+        free(canonical);
+        return false;
+    }
+    config_include_chain[config_include_count++] = canonical;
+    return true;
+}
+void __config_include_leave(void) { free(config_include_chain[--config_include_count]); }
+
+// The path named by an include directive in the file at from
+bool __config_include_path(char *path, const size_t size, const char *from, const char *name) {
+    const char *slash = strrchr(from, '/');
+    const int length = name[0] == '/' || slash == NULL ? snprintf(path, size, "%s", name) : snprintf(path, size, "%.*s/%s", (int)(slash - from), from, name);
+    if (length < 0 || length >= (int)size) {
+        fprintf(stderr, "config: include path too long '%s'\n", name);
+        return false;
+    }
+    return true;
+}
+
+char *__config_trim(char *start, char *end) {
+    while (start < end && isspace((unsigned char)*start))
+        start++;
+    while (end > start && isspace((unsigned char)end[-1]))
+        end--;
+    *end = '\0';
+    return start;
+}
+
+bool __config_load_file(const char *filename, const int depth, const bool fragment);
+bool __config_load_directory(const char *directory, const int depth);
+
+// Reads the file whole, with a terminating NUL, so that it can be parsed in place
+char *__config_read_file(const char *filename, size_t *size) {
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char *buffer = NULL;
+    if (fstat(fd, &st) != 0)
+        ;
+    else if (!S_ISREG(st.st_mode))
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    else if ((buffer = malloc((size_t)st.st_size + 1)) != NULL) {
+        size_t length = 0;
+        ssize_t got = 0;
+        while (length < (size_t)st.st_size && ((got = read(fd, buffer + length, (size_t)st.st_size - length)) > 0 || (got < 0 && errno == EINTR)))
+            length += got > 0 ? (size_t)got : 0;
+        if (got < 0) {
+            free(buffer);
+            buffer = NULL;
+        } else {
+            buffer[length] = '\0';
+            *size = length;
+        }
+    }
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return buffer;
+}
+
+bool __config_load_file(const char *filename, const int depth, const bool fragment) {
+    int64_t start = time_monotonic_us();
+    size_t size = 0, settings = 0;
+    if (!__config_include_enter(filename))
+        return false;
+    char *buffer = __config_read_file(filename, &size);
+    if (buffer == NULL) {
+        fprintf(stderr, "config: could not load '%s': %s\n", filename, strerror(errno));
+        __config_include_leave();
+        return false;
+    }
+    const size_t source = config_source_count;
+    if (__config_source_add(filename, false, fragment) == NULL) {
+        fprintf(stderr, "config: failed to allocate memory for '%s'\n", filename);
+        free(buffer);
+        __config_include_leave();
+        return false;
+    }
+    bool result = true;
+    for (char *line = buffer, *next; line < buffer + size; line = next) {
+        char *newline = memchr(line, '\n', (size_t)(buffer + size - line));
+        next = newline != NULL ? newline + 1 : buffer + size;
+        char *equals = memchr(line, '=', (size_t)(next - line));
+        while (line < next && isspace((unsigned char)*line))
+            line++;
+        if (equals == NULL || *line == '#')
+            continue;
+        const char *key = __config_trim(line, equals), *value = __config_trim(equals + 1, newline != NULL ? newline : buffer + size);
+        const bool directory = strcmp(key, "include-dir") == 0;
+        if (directory || strcmp(key, "include") == 0) {
+            char path[PATH_MAX];
+            const int64_t included = time_monotonic_us();
+            if (depth >= CONFIG_INCLUDE_DEPTH_MAX) {
+                fprintf(stderr, "config: includes nested too deeply at '%s' in '%s'\n", value, filename);
+                result = false;
+            } else if (!__config_include_path(path, sizeof(path), filename, value) ||
+                       !(directory ? __config_load_directory(path, depth + 1) : __config_load_file(path, depth + 1, false)))
+                result = false;
+            start += time_monotonic_us() - included;
+            continue;
+        }
+        __config_set_value(key, value);
+        settings++;
+    }
+    free(buffer);
+    __config_include_leave();
+    config_sources[source].bytes = size;
+    config_sources[source].settings = settings;
+    config_sources[source].elapsed_us = time_monotonic_us() - start;
+    return result;
+}
+
+int __config_fragment_filter(const struct dirent *entry) {
+    const size_t length = strlen(entry->d_name);
+    return entry->d_name[0] != '.' && length > 4 && strcmp(entry->d_name + length - 4, ".cfg") == 0;
+}
+int __config_fragment_compare(const struct dirent **a, const struct dirent **b) { return strcmp((*a)->d_name, (*b)->d_name); }
+
+bool __config_load_directory(const char *directory, const int depth) {
+    const int64_t start = time_monotonic_us();
+    struct dirent **entries;
+    if (!__config_include_enter(directory))
+        return false;
+    const int count = scandir(directory, &entries, __config_fragment_filter, __config_fragment_compare);
+    if (count < 0) {
+        fprintf(stderr, "config: could not list '%s': %s\n", directory, strerror(errno));
+        __config_include_leave();
+        return false;
+    }
+    const size_t source = config_source_count;
+    bool result = __config_source_add(directory, true, false) != NULL;
+    if (!result)
+        fprintf(stderr, "config: failed to allocate memory for '%s'\n", directory);
+    for (int i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        if (result && snprintf(path, sizeof(path), "%s/%s", directory, entries[i]->d_name) < (int)sizeof(path)) {
+            if (!__config_load_file(path, depth, true))
+                result = false;
+        } else if (result) {
+            fprintf(stderr, "config: path too long '%s/%s'\n", directory, entries[i]->d_name);
+            result = false;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    __config_include_leave();
+    if (source < config_source_count) {
+        for (size_t i = source + 1; i < config_source_count; i++)
+            if (config_sources[i].fragment) {
+                config_sources[source].bytes += config_sources[i].bytes;
+                config_sources[source].settings += config_sources[i].settings;
+            }
+        config_sources[source].elapsed_us = time_monotonic_us() - start;
+    }
+    return result;
+}
+
+// Reports the files loaded and how long they took: in total, and for the slowest, or each file with debug
+void config_report(const int64_t elapsed_us) {
+    size_t files = 0, directories = 0, bytes = 0, settings = 0;
+    const config_source_t *slowest = NULL;
+    const bool debug = config_get_bool("debug", false);
+    for (size_t i = 0; i < config_source_count; i++) {
+        const config_source_t *source = &config_sources[i];
+        if (debug)
+            printf("config: %s '%s', %zu bytes, %zu settings, %.3fms\n", source->directory ? "directory" : "file", source->path, source->bytes, source->settings,
+                   (double)source->elapsed_us / 1000.0);
+        if (source->directory) {
+            directories++;
             continue;
-        char *equals = strchr(line, '=');
-        if (equals) {
-            *equals = '\0';
-            char *key = line;
-            char *value = equals + 1;
-            while (*key && isspace(*key))
-                key++;
-            char *end = key + strlen(key) - 1;
-            while (end > key && isspace(*end))
-                *end-- = '\0';
-            while (*value && isspace(*value))
-                value++;
-            end = value + strlen(value) - 1;
-            while (end > value && isspace(*end))
-                *end-- = '\0';
-            __config_set_value(key, value);
         }
+        files++;
+        bytes += source->bytes;
+        settings += source->settings;
+        if (slowest == NULL || source->elapsed_us > slowest->elapsed_us)
+            slowest = source;
     }
-    fclose(file);
+    if (files > 1)
+        printf("config: loaded %zu files (%zu directories), %zu bytes, %zu settings, in %.3fms (slowest '%s', %.3fms)\n", files, directories, bytes, settings,
+               (double)elapsed_us / 1000.0, slowest->path, (double)slowest->elapsed_us / 1000.0);
 }
 
 bool config_load(const char *config_file, int argc, char *argv[], const struct option *options_long) {
@@ -118,7 +589,12 @@ bool config_load(const char *config_file, int argc, char *argv[], const struct o
                 break;
             }
     }
-    __config_load_file(config_file);
+    config_path = config_file;
+    __config_sources_free();
+    const int64_t start = time_monotonic_us();
+    // A missing configuration file leaves the defaults, as before includes; a missing include is an error
+    const bool loaded = __config_load_file(config_file, 0, false) || config_source_count == 0;
+    const int64_t elapsed = time_monotonic_us() - start;
     optind = 0;
     while ((c = getopt_long(argc, (char **)argv, "", options_long, &option_index)) != -1) {
         if (c == 0)
@@ -133,7 +609,33 @@ bool config_load(const char *config_file, int argc, char *argv[], const struct o
             printf(", %s='%s'", options_long[i].name, value);
     }
     printf("\n");
-    return true;
+    config_report(elapsed);
+    return loaded;
+}
+
+// Loads the configuration afresh, as config_load. Values returned from the first configuration loaded stay valid, but
+// those from any later one do not, so what is configured again on reload must copy the values it keeps.
+bool config_reload(const char *config_file, int argc, char *argv[], const struct option *options_long) {
+    if (!config_reloaded) {
+        config_entries_initial = config_entries;
+        config_entry_initial_count = config_entry_count;
+        config_entries = NULL;
+        config_entry_count = config_entry_capacity = 0;
+        config_reloaded = true;
+    }
+    __config_free();
+    return config_load(config_file, argc, argv, options_long);
+}
+
+void config_end(void) {
+    __config_free();
+    for (size_t i = 0; i < config_entry_initial_count; i++) {
+        free(config_entries_initial[i].key);
+        free(config_entries_initial[i].value);
+    }
+    free(config_entries_initial);
+    config_entries_initial = NULL;
+    config_entry_initial_count = 0;
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,282 @@
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include <pthread.h>
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// Bounded queue of jobs (such as alert notifications) carried out by a small pool of worker threads, so that submitting
+// never waits on the job itself. Each job is for a target, which names the handler and bounds how many of its jobs run at
+// once: a target limited to one runs its jobs in order, and a slow target holds up only its own jobs while workers remain.
+// A failed job goes back to its place in the queue to be retried after an exponentially growing backoff, holding back the
+// target's later jobs meanwhile, so that each target starts its jobs in the order submitted. A job is dropped, and
+// counted, when the queue is full or its attempts are used up. Jobs still queued at the end are attempted once more.
+
+#ifndef DISPATCH_BACKOFF_MAX_MS
+#define DISPATCH_BACKOFF_MAX_MS (10 * 60 * 1000)
+#endif
+
+// Carries out a job, within timeout_ms where it can block
+typedef bool (*dispatch_handler_t)(const void *context, const char *subject, const char *content, const int64_t timeout_ms);
+
+typedef struct {
+    size_t capacity;    // Jobs queued at most
+    size_t workers;     // Worker threads
+    int attempts;       // Attempts per job
+    int64_t timeout_ms; // Passed to each handler, unless the target has its own
+    int64_t backoff_ms; // Delay before the first retry, doubling per retry
+    bool debug;
+} DispatchConfig;
+
+typedef struct {
+    unsigned long completed, failed; // Attempts by outcome
+    size_t running;                  // Jobs running now
+    Pow2Histogram latency;           // Attempt durations (ms)
+} DispatchTargetStats;
+
+// Owned by the caller, and must outlive dispatch_end(); the stats are kept under the queue's lock
+typedef struct {
+    const char *name; // For logging and metrics
+    dispatch_handler_t handler;
+    const void *context; // Passed to the handler
+    size_t concurrency;  // Jobs running at once at most (0 = 1)
+    int64_t timeout_ms;  // Passed to the handler (0 = the queue's)
+    DispatchTargetStats stats;
+} DispatchTarget;
+
+typedef struct {
+    DispatchTarget *target;
+    char *subject;
+    char *content;
+    int attempt;            // Attempts made
+    int64_t not_until;      // Earliest time for the next attempt (CLOCK_MONOTONIC ms)
+    unsigned long sequence; // Order of submission, kept by the queue
+} DispatchJob;
+
+typedef struct {
+    unsigned long submitted, completed, retried, dropped_full, dropped_failed, dropped_stopped;
+} DispatchStats;
+
+DispatchConfig dispatch_config;
+DispatchJob *dispatch_jobs = NULL; // Ring of dispatch_config.capacity
+size_t dispatch_head = 0, dispatch_count = 0;
+unsigned long dispatch_sequence = 0;
+DispatchStats dispatch_stats = {0};
+pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dispatch_wake;
+pthread_t *dispatch_threads = NULL;
+size_t dispatch_thread_count = 0;
+bool dispatch_running = false;
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+void __dispatch_job_free(DispatchJob *job) {
+    free(job->subject);
+    free(job->content);
+    job->subject = job->content = NULL;
+}
+
+// Under dispatch_lock; takes ownership of the strings
+bool __dispatch_push(const DispatchJob *job) {
+    if (dispatch_count == dispatch_config.capacity)
+        return false;
+    dispatch_jobs[(dispatch_head + dispatch_count++) % dispatch_config.capacity] = *job;
+    pthread_cond_broadcast(&dispatch_wake);
+    return true;
+}
+
+// Under dispatch_lock; puts a job being retried back in submission order, ahead of the target's later jobs
+bool __dispatch_requeue(const DispatchJob *job) {
+    if (dispatch_count == dispatch_config.capacity)
+        return false;
+    size_t i = dispatch_count++;
+    for (; i > 0 && dispatch_jobs[(dispatch_head + i - 1) % dispatch_config.capacity].sequence > job->sequence; i--)
+        dispatch_jobs[(dispatch_head + i) % dispatch_config.capacity] = dispatch_jobs[(dispatch_head + i - 1) % dispatch_config.capacity];
+    dispatch_jobs[(dispatch_head + i) % dispatch_config.capacity] = *job;
+    pthread_cond_broadcast(&dispatch_wake);
+    return true;
+}
+
+// Under dispatch_lock; whether the target has a job queued ahead of index, which must be started first
+bool __dispatch_behind(const size_t index, const DispatchTarget *target) {
+    for (size_t i = 0; i < index; i++)
+        if (dispatch_jobs[(dispatch_head + i) % dispatch_config.capacity].target == target)
+            return true;
+    return false;
+}
+
+// Under dispatch_lock: takes the first job, in queue order, that is due, is its target's first and whose target has a slot
+// free; otherwise gives when the earliest such job falls due (0 if none is waiting on time alone)
+bool __dispatch_take(const int64_t now, DispatchJob *job, int64_t *not_until) {
+    *not_until = 0;
+    for (size_t i = 0; i < dispatch_count; i++) {
+        const DispatchJob *queued = &dispatch_jobs[(dispatch_head + i) % dispatch_config.capacity];
+        const DispatchTarget *target = queued->target;
+        if (target->stats.running >= (target->concurrency > 0 ? target->concurrency : 1) || __dispatch_behind(i, target))
+            continue;
+        if (queued->not_until > now) {
+            if (*not_until == 0 || queued->not_until < *not_until)
+                *not_until = queued->not_until;
+            continue;
+        }
+        *job = *queued;
+        for (size_t j = i; j + 1 < dispatch_count; j++)
+            dispatch_jobs[(dispatch_head + j) % dispatch_config.capacity] = dispatch_jobs[(dispatch_head + j + 1) % dispatch_config.capacity];
+        dispatch_count--;
+        return true;
+    }
+    return false;
+}
+
+void *__dispatch_thread(void *arg __attribute__((unused))) {
+    pthread_mutex_lock(&dispatch_lock);
+    while (dispatch_running || dispatch_count > 0) {
+        DispatchJob job;
+        int64_t not_until;
+        if (!__dispatch_take(dispatch_running ? time_monotonic_ms() : INT64_MAX, &job, &not_until)) {
+            if (not_until == 0)
+                pthread_cond_wait(&dispatch_wake, &dispatch_lock);
+            else {
+                const struct timespec ts = {.tv_sec = (time_t)(not_until / 1000), .tv_nsec = (long)(not_until % 1000) * 1000000};
+                pthread_cond_timedwait(&dispatch_wake, &dispatch_lock, &ts);
+            }
+            continue;
+        }
+        DispatchTarget *target = job.target;
+        target->stats.running++;
+        pthread_mutex_unlock(&dispatch_lock);
+        const int64_t started = time_monotonic_ms();
+        const bool result = target->handler(target->context, job.subject, job.content, target->timeout_ms > 0 ? target->timeout_ms : dispatch_config.timeout_ms);
+        const int64_t elapsed = time_monotonic_ms() - started;
+        job.attempt++;
+        pthread_mutex_lock(&dispatch_lock);
+        target->stats.running--;
+        if (result)
+            target->stats.completed++;
+        else
+            target->stats.failed++;
+        pow2_histogram_add(&target->stats.latency, (uint64_t)elapsed);
+        pthread_cond_broadcast(&dispatch_wake); // a slot of the target is free again
+        if (result) {
+            dispatch_stats.completed++;
+            __dispatch_job_free(&job);
+            continue;
+        }
+        if (job.attempt >= dispatch_config.attempts || !dispatch_running) {
+            dispatch_stats.dropped_failed++;
+            fprintf(stderr, "dispatch: %s '%s' dropped after %d attempts\n", target->name, job.subject, job.attempt);
+            __dispatch_job_free(&job);
+            continue;
+        }
+        int64_t backoff = dispatch_config.backoff_ms;
+        for (int i = 1; i < job.attempt && backoff < DISPATCH_BACKOFF_MAX_MS; i++)
+            backoff *= 2;
+        if (backoff > DISPATCH_BACKOFF_MAX_MS)
+            backoff = DISPATCH_BACKOFF_MAX_MS;
+        job.not_until = time_monotonic_ms() + backoff;
+        if (!__dispatch_requeue(&job)) {
+            dispatch_stats.dropped_full++;
+            fprintf(stderr, "dispatch: %s '%s' dropped, queue full for retry\n", target->name, job.subject);
+            __dispatch_job_free(&job);
+            continue;
+        }
+        dispatch_stats.retried++;
+        if (dispatch_config.debug)
+            printf("dispatch: %s '%s' failed, retrying in %gs (attempt %d of %d)\n", target->name, job.subject, (double)backoff / 1000.0, job.attempt + 1,
+                   dispatch_config.attempts);
+    }
+    pthread_mutex_unlock(&dispatch_lock);
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+bool dispatch_submit(DispatchTarget *target, const char *subject, const char *content) {
+    DispatchJob job = {.target = target, .subject = strdup(subject), .content = strdup(content), .attempt = 0, .not_until = 0};
+    if (job.subject == NULL || job.content == NULL) {
+        fprintf(stderr, "dispatch: failed to allocate memory for job\n");
+        __dispatch_job_free(&job);
+        return false;
+    }
+    pthread_mutex_lock(&dispatch_lock);
+    job.sequence = dispatch_sequence++;
+    const bool running = dispatch_running, result = running && __dispatch_push(&job);
+    if (result)
+        dispatch_stats.submitted++;
+    else if (running)
+        dispatch_stats.dropped_full++;
+    else
+        dispatch_stats.dropped_stopped++;
+    pthread_mutex_unlock(&dispatch_lock);
+    if (!result) {
+        fprintf(stderr, "dispatch: %s '%s' dropped, %s\n", target->name, subject, running ? "queue full" : "queue not running");
+        __dispatch_job_free(&job);
+    }
+    return result;
+}
+
+DispatchStats dispatch_stats_get(size_t *queued) {
+    pthread_mutex_lock(&dispatch_lock);
+    const DispatchStats stats = dispatch_stats;
+    if (queued)
+        *queued = dispatch_count;
+    pthread_mutex_unlock(&dispatch_lock);
+    return stats;
+}
+
+DispatchTargetStats dispatch_target_stats_get(const DispatchTarget *target) {
+    pthread_mutex_lock(&dispatch_lock);
+    const DispatchTargetStats stats = target->stats;
+    pthread_mutex_unlock(&dispatch_lock);
+    return stats;
+}
+
+bool dispatch_begin(const DispatchConfig *config) {
+    dispatch_config = *config;
+    if (dispatch_config.capacity == 0 || dispatch_config.workers == 0 || dispatch_config.attempts < 1) {
+        fprintf(stderr, "dispatch: invalid queue capacity, workers or attempts\n");
+        return false;
+    }
+    if ((dispatch_jobs = calloc(dispatch_config.capacity, sizeof(DispatchJob))) == NULL ||
+        (dispatch_threads = calloc(dispatch_config.workers, sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "dispatch: failed to allocate memory for %zu jobs\n", dispatch_config.capacity);
+        return false;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dispatch_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    dispatch_running = true;
+    for (; dispatch_thread_count < dispatch_config.workers; dispatch_thread_count++)
+        if (pthread_create(&dispatch_threads[dispatch_thread_count], NULL, __dispatch_thread, NULL) != 0) {
+            fprintf(stderr, "dispatch: failed to create thread\n");
+            return false;
+        }
+    return true;
+}
+
+// Stops taking jobs and carries out those still queued, each once and without waiting out a backoff (so bounded by their
+// timeouts), before the workers exit
+void dispatch_end(void) {
+    pthread_mutex_lock(&dispatch_lock);
+    dispatch_running = false;
+    pthread_cond_broadcast(&dispatch_wake);
+    pthread_mutex_unlock(&dispatch_lock);
+    for (; dispatch_thread_count > 0; dispatch_thread_count--)
+        pthread_join(dispatch_threads[dispatch_thread_count - 1], NULL);
+    free(dispatch_threads);
+    dispatch_threads = NULL;
+    if (dispatch_count > 0)
+        fprintf(stderr, "dispatch: %zu queued jobs dropped at exit, with no workers\n", dispatch_count);
+    for (; dispatch_count > 0; dispatch_count--, dispatch_head = (dispatch_head + 1) % dispatch_config.capacity)
+        __dispatch_job_free(&dispatch_jobs[dispatch_head]);
+    free(dispatch_jobs);
+    dispatch_jobs = NULL;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
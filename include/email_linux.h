@@ -2,7 +2,9 @@
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
+#include <ctype.h>
 #include <curl/curl.h>
+#include <pthread.h>
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -24,30 +26,90 @@ size_t __curl_payload_read_callback(char *buffer, size_t size, size_t nitems, vo
     return to_copy;
 }
 
+// One session is kept across sends: the easy handle, and with it libcurl's connection cache, lives from email_begin() to
+// email_end(), so successive messages to the same server go over the open (and already authenticated) connection instead
+// of paying the connect, TLS and AUTH round trips each time. A connection the server has since dropped is replaced with a
+// fresh one, once, before the send is counted as failed.
+
+#ifndef EMAIL_IDLE_MAX_S
+#define EMAIL_IDLE_MAX_S 240 // Idle connections older than this are not reused, as servers commonly close them at 300s
+#endif
+
+typedef struct {
+    unsigned long sent, failed, connects, reused;
+} EmailStats;
+
+CURL *email_curl = NULL;
+bool email_warm = false; // Last send succeeded, so a connection is likely open for reuse
+EmailStats email_stats = {0};
+pthread_mutex_t email_lock = PTHREAD_MUTEX_INITIALIZER;
+
+CURLcode __email_perform(bool fresh) {
+    curl_easy_setopt(email_curl, CURLOPT_FRESH_CONNECT, fresh ? 1L : 0L);
+    const CURLcode res = curl_easy_perform(email_curl);
+    long connects = 0;
+    if (curl_easy_getinfo(email_curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK && connects > 0)
+        email_stats.connects += (unsigned long)connects;
+    else if (res == CURLE_OK)
+        email_stats.reused++;
+    return res;
+}
+
+// Adds each address of a comma separated list as a recipient
+struct curl_slist *__email_recipients(const char *to) {
+    struct curl_slist *recipients = NULL, *appended;
+    while (*to != '\0') {
+        while (*to == ',' || isspace((unsigned char)*to))
+            to++;
+        size_t length = strcspn(to, ",");
+        char address[256];
+        while (length > 0 && isspace((unsigned char)to[length - 1]))
+            length--;
+        if (length > 0 && length < sizeof(address)) {
+            memcpy(address, to, length);
+            address[length] = '\0';
+            if ((appended = curl_slist_append(recipients, address)) == NULL) {
+                curl_slist_free_all(recipients);
+                return NULL;
+            }
+            recipients = appended;
+        }
+        to += strcspn(to, ",");
+    }
+    return recipients;
+}
+
+// Sends to each of a comma separated list of addresses in one transaction, giving up after timeout_ms in all (0 for no limit)
 bool email_send(const char *server, const char *username, const char *password, const bool use_ssl, const char *name, const char *from, const char *to, const char *subject,
-                const char *content) {
+                const char *content, const long timeout_ms) {
     bool result = false;
-    char payload[4096] = {0};
-    size_t payload_size = (size_t)snprintf(payload, sizeof(payload),
-                                           "From: %s <%s>\r\n"
-                                           "To: %s\r\n"
-                                           "Subject: %s\r\n"
-                                           "MIME-Version: 1.0\r\n"
-                                           "Content-Type: text/plain; charset=UTF-8\r\n"
-                                           "\r\n"
-                                           "%s\r\n",
-                                           name, from, to, subject, content);
-    if (payload_size >= sizeof(payload)) {
-        fprintf(stderr, "email_send: payload too large, sending truncated\n");
-        /* ignore */
+    StringBuffer payload = {0};
+    struct curl_slist *recipients = __email_recipients(to);
+    if (!string_buffer_printf(&payload,
+                              "From: %s <%s>\r\n"
+                              "To: %s\r\n"
+                              "Subject: %s\r\n"
+                              "MIME-Version: 1.0\r\n"
+                              "Content-Type: text/plain; charset=UTF-8\r\n"
+                              "\r\n"
+                              "%s\r\n",
+                              name, from, to, subject, content) ||
+        recipients == NULL) {
+        fprintf(stderr, "email_send: %s\n", recipients == NULL ? "no recipients" : "failed to allocate payload");
+        string_buffer_free(&payload);
+        curl_slist_free_all(recipients);
+        return false;
     }
-    struct UploadData upload_data = {.data = payload, .remaining_size = strlen(payload)};
-    CURL *curl = curl_easy_init();
-    if (!curl) {
+    pthread_mutex_lock(&email_lock);
+    if (!email_curl && !(email_curl = curl_easy_init())) {
+        pthread_mutex_unlock(&email_lock);
         fprintf(stderr, "email_send: failed to initialize curl\n");
+        string_buffer_free(&payload);
+        curl_slist_free_all(recipients);
         return false;
     }
-    struct curl_slist *recipients = curl_slist_append(NULL, to);
+    CURL *curl = email_curl;
+    curl_easy_reset(curl); // options only: the connection cache is kept
     curl_easy_setopt(curl, CURLOPT_URL, server);
     if (username && *username)
         curl_easy_setopt(curl, CURLOPT_USERNAME, username);
@@ -61,18 +123,54 @@ bool email_send(const char *server, const char *username, const char *password,
     curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from);
     curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
     curl_easy_setopt(curl, CURLOPT_READFUNCTION, __curl_payload_read_callback);
-    curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
     curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // timeouts must not use signals off the main thread
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, (long)EMAIL_IDLE_MAX_S);
     // curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK)
+    struct UploadData upload_data = {.data = payload.data, .remaining_size = payload.length};
+    curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
+    const unsigned long connects = email_stats.connects;
+    CURLcode res = __email_perform(false);
+    if (res != CURLE_OK && email_warm && email_stats.connects == connects && upload_data.remaining_size == payload.length) {
+        // Nothing was sent on a reused connection, which the server has most likely closed: try once over a new one
+        upload_data = (struct UploadData){.data = payload.data, .remaining_size = payload.length};
+        res = __email_perform(true);
+    }
+    if (res != CURLE_OK) {
+        email_stats.failed++;
+        email_warm = false;
         fprintf(stderr, "email_send: send failed: %s\n", curl_easy_strerror(res));
-    else
-        result = true;
+    } else {
+        email_stats.sent++;
+        email_warm = result = true;
+    }
+    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, NULL);
+    curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
+    pthread_mutex_unlock(&email_lock);
     curl_slist_free_all(recipients);
-    curl_easy_cleanup(curl);
+    string_buffer_free(&payload);
     return result;
 }
 
+EmailStats email_stats_get(void) {
+    pthread_mutex_lock(&email_lock);
+    const EmailStats stats = email_stats;
+    pthread_mutex_unlock(&email_lock);
+    return stats;
+}
+
+// Closes the session (and any open connection), before curl_global_cleanup()
+void email_end(void) {
+    pthread_mutex_lock(&email_lock);
+    if (email_curl) {
+        curl_easy_cleanup(email_curl);
+        email_curl = NULL;
+    }
+    email_warm = false;
+    pthread_mutex_unlock(&email_lock);
+}
+
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
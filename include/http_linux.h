@@ -0,0 +1,263 @@
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// Minimal HTTP/1.x server for local GET endpoints such as a metrics scrape: one thread polls non-blocking sockets, so a slow
+// or stalled client holds up nobody, and every request is answered and then closed. The handler renders the body into a
+// buffer that is kept and reused across requests.
+
+#ifndef HTTP_CONNECTIONS_MAX
+#define HTTP_CONNECTIONS_MAX 8
+#endif
+#ifndef HTTP_REQUEST_MAX
+#define HTTP_REQUEST_MAX 2048
+#endif
+#ifndef HTTP_TIMEOUT_MS
+#define HTTP_TIMEOUT_MS 5000
+#endif
+
+// Returns an HTTP status, having appended the body and set the content type (for 200)
+typedef int (*http_handler_t)(const char *path, StringBuffer *body, const char **content_type);
+
+typedef struct {
+    const char *address;
+    int port;
+    http_handler_t handler;
+    bool debug;
+} HttpConfig;
+
+typedef struct {
+    int fd;                         // Socket (-1 = unused)
+    char request[HTTP_REQUEST_MAX]; // Request received so far
+    size_t request_length;          //
+    StringBuffer response;          // Response, reused across connections in this slot
+    size_t response_offset;         // Response sent so far
+    bool responding;                // Request complete, response being sent
+    int64_t started;                // When accepted, for the timeout
+} HttpConnection;
+
+HttpConfig http_config;
+HttpConnection http_connections[HTTP_CONNECTIONS_MAX];
+StringBuffer http_body = {0};
+int http_listen_fd = -1, http_wake_fd = -1;
+pthread_t http_thread;
+volatile bool http_running = false;
+unsigned long http_requests = 0, http_rejected = 0;
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+const char *__http_status_text(const int status) {
+    switch (status) {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    default:
+        return "Internal Server Error";
+    }
+}
+
+void __http_close(HttpConnection *connection) {
+    close(connection->fd);
+    connection->fd = -1;
+}
+
+void __http_accept(void) {
+    int fd;
+    while ((fd = accept(http_listen_fd, NULL, NULL)) >= 0) {
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+            close(fd);
+            continue;
+        }
+        HttpConnection *connection = NULL;
+        for (int i = 0; i < HTTP_CONNECTIONS_MAX && connection == NULL; i++)
+            if (http_connections[i].fd < 0)
+                connection = &http_connections[i];
+        if (connection == NULL) {
+            http_rejected++;
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->request_length = 0;
+        connection->response_offset = 0;
+        connection->responding = false;
+        connection->started = time_monotonic_ms();
+        string_buffer_reset(&connection->response);
+    }
+}
+
+void __http_respond(HttpConnection *connection) {
+    char method[8] = "", path[256] = "";
+    int status = 400;
+    const char *content_type = "text/plain; charset=utf-8";
+    string_buffer_reset(&http_body);
+    if (sscanf(connection->request, "%7s %255s HTTP/", method, path) == 2) {
+        if (strcmp(method, "GET") != 0)
+            status = 405;
+        else
+            status = http_config.handler(path, &http_body, &content_type);
+    }
+    if (status != 200) {
+        string_buffer_reset(&http_body);
+        string_buffer_printf(&http_body, "%d %s\n", status, __http_status_text(status));
+        content_type = "text/plain; charset=utf-8";
+    }
+    string_buffer_reset(&connection->response);
+    if (!string_buffer_printf(&connection->response, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status,
+                              __http_status_text(status), content_type, http_body.length) ||
+        !string_buffer_append(&connection->response, http_body.data, http_body.length)) {
+        fprintf(stderr, "http: failed to allocate response\n");
+        __http_close(connection);
+        return;
+    }
+    connection->responding = true;
+    http_requests++;
+    if (http_config.debug)
+        printf("http: %s %s -> %d (%zu bytes)\n", method, path, status, http_body.length);
+}
+
+void __http_read(HttpConnection *connection) {
+    const ssize_t length = read(connection->fd, connection->request + connection->request_length, sizeof(connection->request) - 1 - connection->request_length);
+    if (length == 0 || (length < 0 && errno != EAGAIN && errno != EINTR)) {
+        __http_close(connection);
+        return;
+    }
+    if (length < 0)
+        return;
+    connection->request_length += (size_t)length;
+    connection->request[connection->request_length] = '\0';
+    if (strstr(connection->request, "\r\n\r\n") != NULL || strstr(connection->request, "\n\n") != NULL)
+        __http_respond(connection);
+    else if (connection->request_length == sizeof(connection->request) - 1)
+        __http_close(connection);
+}
+
+void __http_write(HttpConnection *connection) {
+    const ssize_t length = send(connection->fd, connection->response.data + connection->response_offset, connection->response.length - connection->response_offset,
+                                MSG_NOSIGNAL);
+    if (length < 0 && errno != EAGAIN && errno != EINTR) {
+        __http_close(connection);
+        return;
+    }
+    if (length > 0 && (connection->response_offset += (size_t)length) == connection->response.length)
+        __http_close(connection);
+}
+
+void *__http_thread(void *arg __attribute__((unused))) {
+    struct pollfd fds[HTTP_CONNECTIONS_MAX + 2];
+    HttpConnection *polled[HTTP_CONNECTIONS_MAX];
+    while (http_running) {
+        fds[0] = (struct pollfd){.fd = http_wake_fd, .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = http_listen_fd, .events = POLLIN};
+        nfds_t count = 2;
+        const int64_t now = time_monotonic_ms();
+        int64_t timeout = -1;
+        for (int i = 0; i < HTTP_CONNECTIONS_MAX; i++) {
+            HttpConnection *connection = &http_connections[i];
+            if (connection->fd < 0)
+                continue;
+            const int64_t remaining = connection->started + HTTP_TIMEOUT_MS - now;
+            if (remaining <= 0) {
+                __http_close(connection);
+                continue;
+            }
+            if (timeout < 0 || remaining < timeout)
+                timeout = remaining;
+            polled[count - 2] = connection;
+            fds[count++] = (struct pollfd){.fd = connection->fd, .events = connection->responding ? POLLOUT : POLLIN};
+        }
+        if (poll(fds, count, (int)timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "http: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            __http_accept();
+        for (nfds_t i = 2; i < count; i++) {
+            HttpConnection *connection = polled[i - 2];
+            if (fds[i].revents & (POLLERR | POLLNVAL))
+                __http_close(connection);
+            else if (fds[i].revents & (POLLIN | POLLHUP) && !connection->responding)
+                __http_read(connection);
+            else if (fds[i].revents & POLLOUT && connection->responding)
+                __http_write(connection);
+        }
+    }
+    return NULL;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+bool http_begin(const HttpConfig *config) {
+    http_config = *config;
+    for (int i = 0; i < HTTP_CONNECTIONS_MAX; i++)
+        http_connections[i].fd = -1;
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons((uint16_t)config->port)};
+    if (inet_pton(AF_INET, config->address, &address.sin_addr) != 1) {
+        fprintf(stderr, "http: invalid address '%s'\n", config->address);
+        return false;
+    }
+    const int reuse = 1;
+    if ((http_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(http_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(http_listen_fd, (const struct sockaddr *)&address, sizeof(address)) < 0 || listen(http_listen_fd, HTTP_CONNECTIONS_MAX) < 0) {
+        fprintf(stderr, "http: failed to listen on %s:%d: %s\n", config->address, config->port, strerror(errno));
+        return false;
+    }
+    if ((http_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "http: failed to create eventfd: %s\n", strerror(errno));
+        return false;
+    }
+    http_running = true;
+    if (pthread_create(&http_thread, NULL, __http_thread, NULL) != 0) {
+        fprintf(stderr, "http: failed to create thread\n");
+        http_running = false;
+        return false;
+    }
+    printf("http: listening on %s:%d\n", config->address, config->port);
+    return true;
+}
+
+void http_end(void) {
+    if (http_listen_fd < 0 && http_wake_fd < 0)
+        return;
+    if (http_running) {
+        http_running = false;
+        const uint64_t wake = 1;
+        if (write(http_wake_fd, &wake, sizeof(wake)) < 0)
+            fprintf(stderr, "http: failed to wake thread: %s\n", strerror(errno));
+        pthread_join(http_thread, NULL);
+    }
+    for (int i = 0; i < HTTP_CONNECTIONS_MAX; i++) {
+        if (http_connections[i].fd >= 0)
+            __http_close(&http_connections[i]);
+        string_buffer_free(&http_connections[i].response);
+    }
+    string_buffer_free(&http_body);
+    if (http_wake_fd >= 0)
+        close(http_wake_fd);
+    if (http_listen_fd >= 0)
+        close(http_listen_fd);
+    http_wake_fd = http_listen_fd = -1;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
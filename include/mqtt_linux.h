@@ -1,8 +1,9 @@
-
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
+#include <pthread.h>
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -10,13 +11,51 @@
 typedef struct {
     const char *server;
     const char *client;
+    bool external_loop;       // Caller drives the client from its own event loop (see mqtt_socket) rather than a library thread
+    const char *status_topic; // Retained "online" on connect, "offline" on exit or as the Last Will (can be NULL)
+    const char *share_group;  // Subscribe within this shared subscription group, "$share/<group>/<topic>", so that the broker
+                              // spreads messages across the group's clients rather than copying them to each (can be NULL)
+    bool v5;                  // Connect with MQTT v5 (falling back to 3.1.1 if the broker refuses it), for subscription identifiers
     bool debug;
 } MqttConfig;
 
+// The subscription identifier is that given to the subscription the message matched, with v5, or 0
 typedef struct {
-    void (*message_processor)(const char *);
+    void (*message_processor)(void *context, const char *topic, const char *payload, size_t length, uint32_t subscription);
+    void *context;
 } mqtt_callback_data;
 
+typedef struct {
+    char *topic;         // As subscribed, see mqtt_subscription_name
+    uint32_t identifier; // Given to the broker with v5, so that it tags matching messages with it (0 for none)
+    int mid;             // Of the last request, to match its acknowledgement
+} MqttSubscription;
+
+typedef struct {
+    unsigned long connects, disconnects; // Successful connects, and connections lost or closed
+    unsigned long messages, bytes;       // Received, of any subscription
+} MqttStats;
+
+// One client, of one broker: any number may run at once, each with its own connection, subscriptions and reconnects
+typedef struct {
+    const char *name; // For messages
+    MqttConfig config;
+    struct mosquitto *mosq;
+    mqtt_callback_data *callback_data;
+    // Subscriptions are recorded here and (re)applied from the connect callback so they
+    // survive reconnects and don't depend on the broker being reachable at startup. The list
+    // grows on demand and holds its own copies of the topics; the lock covers the connect
+    // callback walking it on the network thread.
+    MqttSubscription *subscriptions;
+    int subscription_count, subscription_capacity;
+    pthread_mutex_t subscriptions_lock;
+    volatile bool v5; // Configured for v5, and the broker has not refused it
+    volatile bool connected;
+    volatile unsigned long connects;
+    time_t last_attempt;
+    _Atomic(unsigned long) disconnects, messages, bytes;
+} MqttClient;
+
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
@@ -32,10 +71,8 @@ typedef struct {
 #ifndef MQTT_SUBSCRIBE_QOS
 #define MQTT_SUBSCRIBE_QOS 0
 #endif
+#define MQTT_SUBSCRIPTION_IDENTIFIER_MAX 268435455 // Variable byte integer
 
-#ifndef MQTT_MAX_SUBSCRIPTIONS
-#define MQTT_MAX_SUBSCRIPTIONS 64
-#endif
 #ifndef MQTT_RECONNECT_DELAY
 #define MQTT_RECONNECT_DELAY 2
 #endif
@@ -43,22 +80,35 @@ typedef struct {
 #define MQTT_RECONNECT_DELAY_MAX 30
 #endif
 
-bool mosq_debug = false;
-struct mosquitto *mosq = NULL;
-mqtt_callback_data *mosq_callback_data = NULL;
+static int mqtt_clients = 0; // Begun, for library initialization
 
-// Subscriptions are recorded here and (re)applied from the connect callback so they
-// survive reconnects and don't depend on the broker being reachable at startup.
-static const char *mqtt_subscriptions[MQTT_MAX_SUBSCRIPTIONS];
-static int mqtt_subscription_count = 0;
-static volatile bool mqtt_connected = false;
+// The subscription as made to the broker, allocated
+static char *mqtt_subscription_name(const MqttClient *client, const char *topic) {
+    if (client->config.share_group == NULL)
+        return strdup(topic);
+    const size_t length = strlen(client->config.share_group) + strlen(topic) + 9;
+    char *name = malloc(length);
+    if (name != NULL)
+        snprintf(name, length, "$share/%s/%s", client->config.share_group, topic);
+    return name;
+}
 
-static void mqtt_subscribe_apply(const char *topic) {
-    const int result = mosquitto_subscribe(mosq, NULL, topic, MQTT_SUBSCRIBE_QOS);
+// Under subscriptions_lock
+static void mqtt_subscribe_apply(MqttClient *client, MqttSubscription *subscription) {
+    int result;
+    if (client->v5 && subscription->identifier != 0) {
+        mosquitto_property *properties = NULL;
+        if ((result = mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, subscription->identifier)) == MOSQ_ERR_SUCCESS)
+            result = mosquitto_subscribe_v5(client->mosq, &subscription->mid, subscription->topic, MQTT_SUBSCRIBE_QOS, 0, properties);
+        mosquitto_property_free_all(&properties);
+    } else
+        result = mosquitto_subscribe(client->mosq, &subscription->mid, subscription->topic, MQTT_SUBSCRIBE_QOS);
     if (result != MOSQ_ERR_SUCCESS)
-        fprintf(stderr, "mqtt: subscribe failed '%s': %s\n", topic, mosquitto_strerror(result));
+        fprintf(stderr, "mqtt: subscribe failed '%s' (%s): %s\n", subscription->topic, client->name, mosquitto_strerror(result));
+    else if (client->v5 && subscription->identifier != 0)
+        printf("mqtt: subscribed '%s' (%s, QoS %d, identifier %" PRIu32 ")\n", subscription->topic, client->name, MQTT_SUBSCRIBE_QOS, subscription->identifier);
     else
-        printf("mqtt: subscribed '%s' (QoS %d)\n", topic, MQTT_SUBSCRIBE_QOS);
+        printf("mqtt: subscribed '%s' (%s, QoS %d)\n", subscription->topic, client->name, MQTT_SUBSCRIBE_QOS);
 }
 
 bool mqtt_parse(const char *string, char *host, const int length, int *port, bool *ssl) {
@@ -82,63 +132,142 @@ bool mqtt_parse(const char *string, char *host, const int length, int *port, boo
     return true;
 }
 
-void mqtt_connect_callback(struct mosquitto *m, void *o __attribute__((unused)), int r) {
-    if (m != mosq)
+bool mqtt_publish(MqttClient *client, const char *topic, const char *message, const size_t length, const bool retain) {
+    if (!client->mosq)
+        return false;
+    const int result = mosquitto_publish(client->mosq, NULL, topic, (int)length, message, MQTT_PUBLISH_QOS, retain);
+    if (result != MOSQ_ERR_SUCCESS) {
+        if (client->config.debug)
+            fprintf(stderr, "mqtt: publish error '%s' (%s): %s\n", topic, client->name, mosquitto_strerror(result));
+        return false;
+    }
+    return true;
+}
+
+void mqtt_connect_callback(struct mosquitto *m, void *o, int r) {
+    MqttClient *client = (MqttClient *)o;
+    if (client == NULL || m != client->mosq)
         return;
     if (r != 0) {
-        fprintf(stderr, "mqtt: connect failed: %s\n", mosquitto_connack_string(r));
+        fprintf(stderr, "mqtt: connect failed (%s): %s\n", client->name, client->v5 && r >= 0x80 ? mosquitto_reason_string(r) : mosquitto_connack_string(r));
+        // A 3.1.1 broker refuses the protocol version (in its own terms); the next attempt is made without v5
+        if (client->v5 && (r == CONNACK_REFUSED_PROTOCOL_VERSION || r == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION)) {
+            client->v5 = false;
+            mosquitto_int_option(client->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V311);
+            fprintf(stderr, "mqtt: broker does not support v5 (%s), falling back to 3.1.1\n", client->name);
+        }
         return;
     }
-    mqtt_connected = true;
-    printf("mqtt: connected\n");
+    client->connected = true;
+    client->connects++;
+    printf("mqtt: connected (%s)\n", client->name);
+    if (client->config.status_topic)
+        mqtt_publish(client, client->config.status_topic, "online", 6, true);
     // (Re)subscribe on every successful connect so monitoring resumes after reconnects.
-    for (int i = 0; i < mqtt_subscription_count; i++)
-        mqtt_subscribe_apply(mqtt_subscriptions[i]);
+    pthread_mutex_lock(&client->subscriptions_lock);
+    for (int i = 0; i < client->subscription_count; i++)
+        mqtt_subscribe_apply(client, &client->subscriptions[i]);
+    pthread_mutex_unlock(&client->subscriptions_lock);
+}
+void mqtt_connect_v5_callback(struct mosquitto *m, void *o, int r, int flags __attribute__((unused)), const mosquitto_property *properties __attribute__((unused))) {
+    mqtt_connect_callback(m, o, r);
+}
+
+// With v5, a broker closing the connection gives a reason code (from 0x80), anything else is the library's own error
+void mqtt_disconnect_callback(struct mosquitto *m, void *o, int rc) {
+    MqttClient *client = (MqttClient *)o;
+    if (client == NULL || m != client->mosq)
+        return;
+    client->connected = false;
+    atomic_fetch_add_explicit(&client->disconnects, 1, memory_order_relaxed);
+    if (client->v5 && rc >= 0x80)
+        fprintf(stderr, "mqtt: disconnected by broker (%s): %s\n", client->name, mosquitto_reason_string(rc));
+    else if (client->config.debug)
+        printf("mqtt: disconnected (%s, rc=%d)\n", client->name, rc);
+}
+void mqtt_disconnect_v5_callback(struct mosquitto *m, void *o, int rc, const mosquitto_property *properties __attribute__((unused))) {
+    mqtt_disconnect_callback(m, o, rc);
 }
 
-void mqtt_disconnect_callback(struct mosquitto *m, void *o __attribute__((unused)), int rc) {
-    if (m != mosq)
+// Each granted QoS, or with a failure code (from 0x80) a refusal, which with v5 gives the reason
+void mqtt_subscribe_callback(struct mosquitto *m, void *obj, int mid, int qos_count, const int *qos_granted) {
+    MqttClient *client = (MqttClient *)obj;
+    if (client == NULL || m != client->mosq)
         return;
-    mqtt_connected = false;
-    if (mosq_debug)
-        printf("mqtt: disconnected (rc=%d)\n", rc);
+    for (int q = 0; q < qos_count; q++)
+        if (qos_granted[q] >= 0x80) {
+            const char *topic = "?";
+            pthread_mutex_lock(&client->subscriptions_lock);
+            for (int i = 0; i < client->subscription_count; i++)
+                if (client->subscriptions[i].mid == mid)
+                    topic = client->subscriptions[i].topic;
+            fprintf(stderr, "mqtt: subscribe refused '%s' (%s): %s\n", topic, client->name,
+                    client->v5 ? mosquitto_reason_string(qos_granted[q]) : "failure");
+            pthread_mutex_unlock(&client->subscriptions_lock);
+        }
+    if (client->config.debug)
+        printf("mqtt: subscribed (%s, mid=%d)\n", client->name, mid);
+}
+void mqtt_subscribe_v5_callback(struct mosquitto *m, void *obj, int mid, int qos_count, const int *qos_granted,
+                                const mosquitto_property *properties __attribute__((unused))) {
+    mqtt_subscribe_callback(m, obj, mid, qos_count, qos_granted);
 }
 
-bool mqtt_begin(const MqttConfig *config) {
+bool mqtt_begin(MqttClient *client, const char *name, const MqttConfig *config) {
     char host[CONFIG_MAX_STRING];
     int port;
     bool ssl;
-    mosq_debug = config->debug;
+    memset(client, 0, sizeof(MqttClient));
+    client->name = name;
+    client->config = *config;
+    client->v5 = config->v5;
+    pthread_mutex_init(&client->subscriptions_lock, NULL);
+    if (mqtt_clients++ == 0)
+        mosquitto_lib_init();
     if (!mqtt_parse(config->server, host, sizeof(host), &port, &ssl)) {
         fprintf(stderr, "mqtt: error parsing details in '%s'\n", config->server);
         return false;
     }
-    printf("mqtt: connecting (host='%s', port=%d, ssl=%s, client='%s')\n", host, port, ssl ? "true" : "false", config->client);
+    printf("mqtt: connecting %s (host='%s', port=%d, ssl=%s, client='%s', protocol=%s)\n", name, host, port, ssl ? "true" : "false", config->client,
+           config->v5 ? "5" : "3.1.1");
     char client_id[24];
-    sprintf(client_id, "%s-%06X", config->client ? config->client : "mqtt-linux", rand() & 0xFFFFFF);
+    snprintf(client_id, sizeof(client_id), "%.15s-%06X", config->client ? config->client : "mqtt-linux", (unsigned)rand() & 0xFFFFFF);
     int result;
-    mosquitto_lib_init();
-    mosq = mosquitto_new(client_id, true, NULL);
-    if (!mosq) {
-        fprintf(stderr, "mqtt: error creating client instance\n");
+    client->mosq = mosquitto_new(client_id, true, client);
+    if (!client->mosq) {
+        fprintf(stderr, "mqtt: error creating client instance (%s)\n", name);
         return false;
     }
     if (ssl)
-        mosquitto_tls_insecure_set(mosq, true); // Skip certificate validation
-    mosquitto_connect_callback_set(mosq, mqtt_connect_callback);
-    mosquitto_disconnect_callback_set(mosq, mqtt_disconnect_callback);
-    mosquitto_reconnect_delay_set(mosq, MQTT_RECONNECT_DELAY, MQTT_RECONNECT_DELAY_MAX, true);
+        mosquitto_tls_insecure_set(client->mosq, true); // Skip certificate validation
+    // The v5 callbacks run for 3.1.1 connections too, so they stay set across a fallback
+    if (config->v5) {
+        mosquitto_int_option(client->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+        mosquitto_connect_v5_callback_set(client->mosq, mqtt_connect_v5_callback);
+        mosquitto_disconnect_v5_callback_set(client->mosq, mqtt_disconnect_v5_callback);
+        mosquitto_subscribe_v5_callback_set(client->mosq, mqtt_subscribe_v5_callback);
+    } else {
+        mosquitto_connect_callback_set(client->mosq, mqtt_connect_callback);
+        mosquitto_disconnect_callback_set(client->mosq, mqtt_disconnect_callback);
+        mosquitto_subscribe_callback_set(client->mosq, mqtt_subscribe_callback);
+    }
+    mosquitto_reconnect_delay_set(client->mosq, MQTT_RECONNECT_DELAY, MQTT_RECONNECT_DELAY_MAX, true);
+    // The broker publishes the will if the connection is lost without a clean disconnect, so a dead client is visible
+    if (config->status_topic && (result = mosquitto_will_set(client->mosq, config->status_topic, 7, "offline", MQTT_PUBLISH_QOS, true)) != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "mqtt: error setting will (%s): %s\n", name, mosquitto_strerror(result));
     // A failed DNS lookup or unreachable broker at startup must NOT abort the process
     // (e.g. the monitored host may simply be down). connect_async still resolves the
     // address up front, so a failure here is non-fatal: keep going and let mqtt_poll()
     // retry until the broker appears. connect_async stores host/port for the retries.
-    if ((result = mosquitto_connect_async(mosq, host, port, MQTT_CONNECT_TIMEOUT)) != MOSQ_ERR_SUCCESS)
-        fprintf(stderr, "mqtt: broker not reachable yet (%s); will keep retrying\n", mosquitto_strerror(result));
-    if ((result = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "mqtt: error starting loop: %s\n", mosquitto_strerror(result));
-        mosquitto_disconnect(mosq);
-        mosquitto_destroy(mosq);
-        mosq = NULL;
+    if ((result = mosquitto_connect_async(client->mosq, host, port, MQTT_CONNECT_TIMEOUT)) != MOSQ_ERR_SUCCESS)
+        fprintf(stderr, "mqtt: broker %s not reachable yet (%s); will keep retrying\n", name, mosquitto_strerror(result));
+    if (config->external_loop)
+        return true;
+    if ((result = mosquitto_loop_start(client->mosq)) != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "mqtt: error starting loop (%s): %s\n", name, mosquitto_strerror(result));
+        mosquitto_disconnect(client->mosq);
+        mosquitto_destroy(client->mosq);
+        client->mosq = NULL;
         return false;
     }
     return true;
@@ -146,114 +275,215 @@ bool mqtt_begin(const MqttConfig *config) {
 
 // Call periodically from the main loop. While disconnected, trigger a (non-blocking)
 // reconnection attempt, self-throttled so a persistently-down broker doesn't spin.
-void mqtt_poll(void) {
-    static time_t last_attempt = 0;
-    if (!mosq || mqtt_connected)
+void mqtt_poll(MqttClient *client) {
+    if (!client->mosq || client->connected)
         return;
     const time_t now = time(NULL);
-    if (last_attempt != 0 && (now - last_attempt) < MQTT_RECONNECT_DELAY_MAX)
+    if (client->last_attempt != 0 && (now - client->last_attempt) < MQTT_RECONNECT_DELAY_MAX)
         return;
-    last_attempt = now;
-    const int result = mosquitto_reconnect_async(mosq);
-    if (result != MOSQ_ERR_SUCCESS && mosq_debug)
-        fprintf(stderr, "mqtt: reconnect attempt failed (%s); will retry\n", mosquitto_strerror(result));
+    client->last_attempt = now;
+    const int result = mosquitto_reconnect_async(client->mosq);
+    if (result != MOSQ_ERR_SUCCESS && client->config.debug)
+        fprintf(stderr, "mqtt: reconnect attempt failed (%s: %s); will retry\n", client->name, mosquitto_strerror(result));
 }
 
-void mqtt_end(void) {
-    if (mosq_callback_data) {
-        free(mosq_callback_data);
-        mosq_callback_data = NULL;
+// Safe on a client whose mqtt_begin failed, or was never called (if zeroed)
+void mqtt_end(MqttClient *client) {
+    if (client->callback_data) {
+        free(client->callback_data);
+        client->callback_data = NULL;
     }
-    if (mosq) {
-        mosquitto_loop_stop(mosq, true);
-        mosquitto_disconnect(mosq);
-        mosquitto_destroy(mosq);
-        mosq = NULL;
+    if (client->mosq) {
+        // A clean disconnect suppresses the will, so say "offline" explicitly, and let the loop flush it before stopping
+        if (client->connected && client->config.status_topic) {
+            mqtt_publish(client, client->config.status_topic, "offline", 7, true);
+            mosquitto_disconnect(client->mosq);
+            if (client->config.external_loop)
+                mosquitto_loop_write(client->mosq, 1);
+            else
+                mosquitto_loop_stop(client->mosq, false);
+        } else {
+            if (!client->config.external_loop)
+                mosquitto_loop_stop(client->mosq, true);
+            mosquitto_disconnect(client->mosq);
+        }
+        mosquitto_destroy(client->mosq);
+        client->mosq = NULL;
+    }
+    client->connected = false;
+    for (int i = 0; i < client->subscription_count; i++)
+        free(client->subscriptions[i].topic);
+    free(client->subscriptions);
+    client->subscriptions = NULL;
+    client->subscription_count = client->subscription_capacity = 0;
+    if (client->name != NULL) {
+        pthread_mutex_destroy(&client->subscriptions_lock);
+        client->name = NULL;
+        if (--mqtt_clients == 0)
+            mosquitto_lib_cleanup();
     }
-    mqtt_connected = false;
-    mqtt_subscription_count = 0;
-    mosquitto_lib_cleanup();
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-void mqtt_send(const char *topic, const char *message, const int length) {
-    if (!mosq)
-        return;
-    const int result = mosquitto_publish(mosq, NULL, topic, length, message, MQTT_PUBLISH_QOS, MQTT_PUBLISH_RETAIN);
-    if (result != MOSQ_ERR_SUCCESS)
-        fprintf(stderr, "mqtt: publish error: %s\n", mosquitto_strerror(result));
+// With an external loop, the caller waits on mqtt_socket() (which changes across reconnects, and is -1 while disconnected),
+// for writability too while mqtt_want_write(), calls mqtt_loop_read/write as it becomes ready, and mqtt_loop_misc at least
+// every mqtt_loop_timeout_ms() for keepalives; callbacks then run on the caller's thread.
+// Changes on every successful (re)connect, for callers to republish what the broker may have missed while disconnected
+unsigned long mqtt_connect_generation(const MqttClient *client) { return client->connects; }
+bool mqtt_is_connected(const MqttClient *client) { return client->connected; }
+
+MqttStats mqtt_stats_get(const MqttClient *client) {
+    return (MqttStats){.connects = client->connects,
+                       .disconnects = atomic_load_explicit(&client->disconnects, memory_order_relaxed),
+                       .messages = atomic_load_explicit(&client->messages, memory_order_relaxed),
+                       .bytes = atomic_load_explicit(&client->bytes, memory_order_relaxed)};
+}
+
+int mqtt_socket(const MqttClient *client) { return client->mosq ? mosquitto_socket(client->mosq) : -1; }
+bool mqtt_want_write(const MqttClient *client) { return client->mosq && mosquitto_want_write(client->mosq); }
+int64_t mqtt_loop_timeout_ms(const MqttClient *client) {
+    return client->connected ? (int64_t)MQTT_CONNECT_TIMEOUT * 1000 / 4 : (int64_t)MQTT_RECONNECT_DELAY * 1000;
+}
+
+void mqtt_loop_read(MqttClient *client) {
+    const int result = mosquitto_loop_read(client->mosq, 1);
+    if (result != MOSQ_ERR_SUCCESS && client->config.debug)
+        fprintf(stderr, "mqtt: read failed (%s: %s)\n", client->name, mosquitto_strerror(result));
+}
+void mqtt_loop_write(MqttClient *client) {
+    const int result = mosquitto_loop_write(client->mosq, 1);
+    if (result != MOSQ_ERR_SUCCESS && client->config.debug)
+        fprintf(stderr, "mqtt: write failed (%s: %s)\n", client->name, mosquitto_strerror(result));
+}
+void mqtt_loop_misc(MqttClient *client) {
+    if (client->mosq)
+        mosquitto_loop_misc(client->mosq);
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-void mqtt_message_callback(struct mosquitto *m, void *obj, const struct mosquitto_message *message) {
-    if (m != mosq)
-        return;
-    const mqtt_callback_data *callback_data = (mqtt_callback_data *)obj;
-    if (callback_data && callback_data->message_processor)
-        callback_data->message_processor(message->topic);
+void mqtt_send(MqttClient *client, const char *topic, const char *message, const int length) {
+    mqtt_publish(client, topic, message, (size_t)length, MQTT_PUBLISH_RETAIN);
 }
 
-void mqtt_subscribe_callback(struct mosquitto *m, void *obj __attribute__((unused)), int mid, int qos_count __attribute__((unused)),
-                             const int *qos_granted __attribute__((unused))) {
-    if (m != mosq)
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// Each client running on a library thread delivers on its own thread, so a message processor shared between clients is
+// called concurrently and must be thread safe
+static void mqtt_message_deliver(struct mosquitto *m, void *obj, const struct mosquitto_message *message, const uint32_t subscription) {
+    MqttClient *client = (MqttClient *)obj;
+    if (client == NULL || m != client->mosq)
+        return;
+    const size_t length = message->payloadlen > 0 ? (size_t)message->payloadlen : 0;
+    atomic_fetch_add_explicit(&client->messages, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&client->bytes, length, memory_order_relaxed);
+    const mqtt_callback_data *callback_data = client->callback_data;
+    if (callback_data == NULL || callback_data->message_processor == NULL)
         return;
-    if (mosq_debug)
-        printf("mqtt: subscribed (mid=%d)\n", mid);
+    callback_data->message_processor(callback_data->context, message->topic, (const char *)message->payload, length, subscription);
+}
+void mqtt_message_callback(struct mosquitto *m, void *obj, const struct mosquitto_message *message) { mqtt_message_deliver(m, obj, message, 0); }
+// A message matching overlapping subscriptions may carry several identifiers; the first is given
+void mqtt_message_v5_callback(struct mosquitto *m, void *obj, const struct mosquitto_message *message, const mosquitto_property *properties) {
+    uint32_t subscription = 0;
+    mosquitto_property_read_varint(properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &subscription, false);
+    mqtt_message_deliver(m, obj, message, subscription);
 }
 
-bool mqtt_subscribe(const char *topic) {
-    if (!mosq)
-        return false;
-    if (mqtt_subscription_count >= MQTT_MAX_SUBSCRIPTIONS) {
-        fprintf(stderr, "mqtt: too many subscriptions (max %d)\n", MQTT_MAX_SUBSCRIPTIONS);
+// The identifier (from 1, up to 268435455; else 0) tags the messages it matches, once connected with v5
+bool mqtt_subscribe(MqttClient *client, const char *topic, const uint32_t identifier) {
+    if (!client->mosq)
         return false;
-    }
     // Record it; the connect callback (re)applies all recorded subscriptions. If we are
     // already connected, apply it now too so late subscriptions take effect immediately.
-    mqtt_subscriptions[mqtt_subscription_count++] = topic;
-    if (mqtt_connected)
-        mqtt_subscribe_apply(topic);
+    char *copy = mqtt_subscription_name(client, topic);
+    if (!copy) {
+        fprintf(stderr, "mqtt: failed to allocate memory for subscriptions\n");
+        return false;
+    }
+    pthread_mutex_lock(&client->subscriptions_lock);
+    if (client->subscription_count >= client->subscription_capacity) {
+        const int capacity = client->subscription_capacity ? client->subscription_capacity * 2 : 16;
+        MqttSubscription *subscriptions = realloc(client->subscriptions, (size_t)capacity * sizeof(MqttSubscription));
+        if (!subscriptions) {
+            pthread_mutex_unlock(&client->subscriptions_lock);
+            fprintf(stderr, "mqtt: failed to allocate memory for subscriptions\n");
+            free(copy);
+            return false;
+        }
+        client->subscriptions = subscriptions;
+        client->subscription_capacity = capacity;
+    }
+    MqttSubscription *subscription = &client->subscriptions[client->subscription_count++];
+    *subscription = (MqttSubscription){.topic = copy, .identifier = identifier, .mid = 0};
+    if (client->connected)
+        mqtt_subscribe_apply(client, subscription);
+    pthread_mutex_unlock(&client->subscriptions_lock);
     return true;
 }
 
-bool mqtt_unsubscribe(const char *topic) {
-    if (!mosq)
+// Removes it from the recorded subscriptions too, so that it is not reapplied on reconnect
+bool mqtt_unsubscribe(MqttClient *client, const char *topic) {
+    char *name;
+    if (!client->mosq || (name = mqtt_subscription_name(client, topic)) == NULL)
         return false;
-    mosquitto_unsubscribe(mosq, NULL, topic);
+    pthread_mutex_lock(&client->subscriptions_lock);
+    for (int i = 0; i < client->subscription_count; i++)
+        if (strcmp(client->subscriptions[i].topic, name) == 0) {
+            free(client->subscriptions[i].topic);
+            client->subscriptions[i] = client->subscriptions[--client->subscription_count];
+            break;
+        }
+    if (client->connected) {
+        const int result = mosquitto_unsubscribe(client->mosq, NULL, name);
+        if (result != MOSQ_ERR_SUCCESS)
+            fprintf(stderr, "mqtt: unsubscribe failed '%s' (%s): %s\n", name, client->name, mosquitto_strerror(result));
+        else if (client->config.debug)
+            printf("mqtt: unsubscribed '%s' (%s)\n", name, client->name);
+    }
+    pthread_mutex_unlock(&client->subscriptions_lock);
+    free(name);
     return true;
 }
 
-bool mqtt_message_callback_register(void (*message_processor)(const char *)) {
-    if (!mosq)
+static void mqtt_message_callback_set(MqttClient *client, const bool set) {
+    if (client->config.v5)
+        mosquitto_message_v5_callback_set(client->mosq, set ? mqtt_message_v5_callback : NULL);
+    else
+        mosquitto_message_callback_set(client->mosq, set ? mqtt_message_callback : NULL);
+}
+// Messages are passed to message_processor along with context
+bool mqtt_message_callback_register(MqttClient *client, void (*message_processor)(void *, const char *, const char *, size_t, uint32_t), void *context) {
+    if (!client->mosq)
         return false;
-    if (mosq_callback_data)
-        free(mosq_callback_data);
-    mosq_callback_data = malloc(sizeof(mqtt_callback_data));
-    if (!mosq_callback_data) {
+    mqtt_callback_data *callback_data = malloc(sizeof(mqtt_callback_data));
+    if (!callback_data) {
         fprintf(stderr, "mqtt: failed to allocate memory for callback data\n");
         return false;
     }
-    mosq_callback_data->message_processor = message_processor;
-    mosquitto_user_data_set(mosq, mosq_callback_data);
-    mosquitto_message_callback_set(mosq, mqtt_message_callback);
-    mosquitto_subscribe_callback_set(mosq, mqtt_subscribe_callback);
+    callback_data->message_processor = message_processor;
+    callback_data->context = context;
+    mqtt_message_callback_set(client, false); // so that none runs with the data being replaced
+    free(client->callback_data);
+    client->callback_data = callback_data;
+    mqtt_message_callback_set(client, true);
     return true;
 }
 
-void mqtt_message_callback_cancel(void) {
-    if (!mosq)
+// The library runs callbacks under the lock that setting them takes, so once this returns no message callback is running
+// or will run until one is registered again (and the callback data can be freed)
+void mqtt_message_callback_cancel(MqttClient *client) {
+    if (!client->mosq)
         return;
-    mosquitto_user_data_set(mosq, NULL);
-    if (mosq_callback_data) {
-        free(mosq_callback_data);
-        mosq_callback_data = NULL;
+    mqtt_message_callback_set(client, false);
+    if (client->callback_data) {
+        free(client->callback_data);
+        client->callback_data = NULL;
     }
-    mosquitto_message_callback_set(mosq, NULL);
-    mosquitto_subscribe_callback_set(mosq, NULL);
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
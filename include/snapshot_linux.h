@@ -0,0 +1,101 @@
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// State file mapped shared into memory, so that state kept in it is saved by plain stores as it changes, with no
+// serialization: the kernel writes dirty pages back in its own time, and they survive the process crashing (though not the
+// machine, short of snapshot_sync). A new snapshot is built in a temporary file and renamed over the previous one, which
+// stays readable until then, so a restart always finds one complete file or the other.
+
+typedef struct {
+    void *data;
+    size_t size;
+} Snapshot;
+
+// Maps an existing snapshot read only, for restoring from; false (quietly, if there is none) when it cannot be
+bool snapshot_open(Snapshot *snapshot, const char *path) {
+    snapshot->data = NULL;
+    snapshot->size = 0;
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "snapshot: failed to open '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "snapshot: failed to map '%s'\n", path);
+        return false;
+    }
+    snapshot->data = data;
+    snapshot->size = (size_t)st.st_size;
+    return true;
+}
+
+// Creates '<path>.new' of the given size, zeroed, and maps it writable; its blocks are reserved up front, as a store to a
+// page the filesystem then has no room for would fault (SIGBUS) in whichever thread made it
+bool snapshot_create(Snapshot *snapshot, const char *path, const size_t size) {
+    char temporary[PATH_MAX];
+    snapshot->data = NULL;
+    snapshot->size = 0;
+    if (snprintf(temporary, sizeof(temporary), "%s.new", path) >= (int)sizeof(temporary)) {
+        fprintf(stderr, "snapshot: path too long '%s'\n", path);
+        return false;
+    }
+    const int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "snapshot: failed to create '%s': %s\n", temporary, strerror(errno));
+        return false;
+    }
+    void *data = MAP_FAILED;
+    const int error = posix_fallocate(fd, 0, (off_t)size);
+    if (error == 0)
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    else
+        fprintf(stderr, "snapshot: failed to allocate '%s': %s\n", temporary, strerror(error));
+    close(fd);
+    if (data == MAP_FAILED) {
+        unlink(temporary);
+        return false;
+    }
+    snapshot->data = data;
+    snapshot->size = size;
+    return true;
+}
+
+// Replaces the snapshot at path with the one created for it, once filled in
+bool snapshot_commit(const char *path) {
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.new", path);
+    if (rename(temporary, path) != 0) {
+        fprintf(stderr, "snapshot: failed to replace '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void snapshot_sync(const Snapshot *snapshot) {
+    if (snapshot->data != NULL && msync(snapshot->data, snapshot->size, MS_SYNC) != 0)
+        fprintf(stderr, "snapshot: failed to sync: %s\n", strerror(errno));
+}
+
+void snapshot_close(Snapshot *snapshot) {
+    if (snapshot->data != NULL)
+        munmap(snapshot->data, snapshot->size);
+    snapshot->data = NULL;
+    snapshot->size = 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
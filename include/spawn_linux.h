@@ -0,0 +1,77 @@
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// Runs a command to completion with a timeout, for use off the main thread. The child gets stdin from /dev/null, the
+// default signal mask and dispositions (not those of a caller that blocks signals for signalfd), and its own process group,
+// so that on timeout it is killed together with anything it started.
+
+#ifndef SPAWN_POLL_MAX_MS
+#define SPAWN_POLL_MAX_MS 50
+#endif
+
+// Returns whether it exited with status 0, describing the outcome in detail otherwise
+bool spawn_run(const char *const argv[], const int64_t timeout_ms, char *detail, const size_t detail_size) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigfillset(&defaults);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    pid_t pid;
+    const int error = posix_spawnp(&pid, argv[0], &actions, &attr, (char *const *)(uintptr_t)argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0) {
+        snprintf(detail, detail_size, "spawn failed: %s", strerror(error));
+        return false;
+    }
+    const int64_t deadline = time_monotonic_ms() + timeout_ms;
+    int64_t interval = 1;
+    int status;
+    pid_t waited;
+    while ((waited = waitpid(pid, &status, WNOHANG)) == 0 || (waited < 0 && errno == EINTR)) {
+        const int64_t remaining = deadline - time_monotonic_ms();
+        if (remaining <= 0) {
+            kill(-pid, SIGKILL);
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            snprintf(detail, detail_size, "timed out after %gs", (double)timeout_ms / 1000.0);
+            return false;
+        }
+        const int64_t sleep_ms = interval < remaining ? interval : remaining;
+        const struct timespec ts = {.tv_sec = (time_t)(sleep_ms / 1000), .tv_nsec = (long)(sleep_ms % 1000) * 1000000};
+        nanosleep(&ts, NULL);
+        if (interval < SPAWN_POLL_MAX_MS)
+            interval *= 2;
+    }
+    if (waited < 0) {
+        snprintf(detail, detail_size, "wait failed: %s", strerror(errno));
+        return false;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        return true;
+    if (WIFEXITED(status))
+        snprintf(detail, detail_size, "exited with status %d", WEXITSTATUS(status));
+    else
+        snprintf(detail, detail_size, "killed by signal %d", WTERMSIG(status));
+    return false;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
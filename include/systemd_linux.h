@@ -1,4 +1,3 @@
-
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
@@ -7,35 +6,245 @@
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-bool systemd_service_restart(const char *service_name) {
-    sd_bus *bus = NULL;
-    int r = sd_bus_open_system(&bus);
+// Restarts run asynchronously over one persistent system bus connection, which the caller drives from its own loop
+// (waiting on systemd_fd() for systemd_events(), until no later than systemd_next_deadline(), then calling systemd_process).
+// Each restart first reads the unit's ActiveState, leaving alone a unit that is already changing state, then issues
+// RestartUnit and follows the job it returns through to JobRemoved, so what is reported is the job's result (or a
+// timeout) rather than just its having been queued. Nothing here blocks on systemd, other than (re)connecting to the bus.
+
+#ifndef SYSTEMD_JOBS_MAX
+#define SYSTEMD_JOBS_MAX 64
+#endif
+
+typedef enum { SYSTEMD_RESTART_DONE, SYSTEMD_RESTART_FAILED, SYSTEMD_RESTART_TIMEOUT, SYSTEMD_RESTART_SKIPPED } systemd_restart_result_t;
+#define SYSTEMD_RESTART_RESULTS 4
+
+// Told the outcome of each restart, with detail such as the job result or the state that caused it to be skipped
+typedef void (*systemd_restart_handler_t)(const char *unit, systemd_restart_result_t result, const char *detail);
+
+typedef struct {
+    int64_t timeout_ms;                // From request to JobRemoved
+    systemd_restart_handler_t handler; //
+    bool debug;
+} SystemdConfig;
+
+typedef enum { SYSTEMD_JOB_FREE, SYSTEMD_JOB_STATE, SYSTEMD_JOB_RESTART, SYSTEMD_JOB_RUNNING } systemd_job_state_t;
+
+typedef struct {
+    systemd_job_state_t state;
+    char unit[256];
+    char *job;         // Job object path, once RestartUnit has replied
+    sd_bus_slot *slot; // Call in progress
+    int64_t deadline;  // CLOCK_MONOTONIC ms
+} SystemdJob;
+
+SystemdConfig systemd_config;
+sd_bus *systemd_bus = NULL;
+sd_bus_slot *systemd_job_removed = NULL;
+SystemdJob systemd_jobs[SYSTEMD_JOBS_MAX];
+
+const char *systemd_restart_result_names[SYSTEMD_RESTART_RESULTS] = {"done", "failed", "timeout", "skipped"};
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+void __systemd_finish(SystemdJob *job, const systemd_restart_result_t result, const char *detail) {
+    job->slot = sd_bus_slot_unref(job->slot);
+    free(job->job);
+    job->job = NULL;
+    job->state = SYSTEMD_JOB_FREE;
+    if (systemd_config.handler)
+        systemd_config.handler(job->unit, result, detail);
+}
+
+void __systemd_close(void) {
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++)
+        if (systemd_jobs[i].state != SYSTEMD_JOB_FREE)
+            __systemd_finish(&systemd_jobs[i], SYSTEMD_RESTART_FAILED, "bus connection lost");
+    systemd_job_removed = sd_bus_slot_unref(systemd_job_removed);
+    systemd_bus = sd_bus_flush_close_unref(systemd_bus);
+}
+
+const char *__systemd_error(sd_bus_message *m, const sd_bus_error *error) {
+    const sd_bus_error *reply = sd_bus_message_get_error(m);
+    if (reply != NULL && reply->message != NULL)
+        return reply->message;
+    return error != NULL && error->message != NULL ? error->message : "unknown error";
+}
+
+int __systemd_on_job_removed(sd_bus_message *m, void *userdata __attribute__((unused)), sd_bus_error *error __attribute__((unused))) {
+    uint32_t id;
+    const char *path, *unit, *result;
+    if (sd_bus_message_read(m, "uoss", &id, &path, &unit, &result) < 0)
+        return 0;
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++) {
+        SystemdJob *job = &systemd_jobs[i];
+        if (job->state == SYSTEMD_JOB_RUNNING && strcmp(job->job, path) == 0) {
+            __systemd_finish(job, strcmp(result, "done") == 0 ? SYSTEMD_RESTART_DONE : SYSTEMD_RESTART_FAILED, result);
+            break;
+        }
+    }
+    return 0;
+}
+
+int __systemd_on_restart(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+    SystemdJob *job = (SystemdJob *)userdata;
+    const char *path;
+    job->slot = sd_bus_slot_unref(job->slot);
+    if (sd_bus_message_is_method_error(m, NULL)) {
+        __systemd_finish(job, SYSTEMD_RESTART_FAILED, __systemd_error(m, error));
+        return 0;
+    }
+    if (sd_bus_message_read(m, "o", &path) < 0 || (job->job = strdup(path)) == NULL) {
+        __systemd_finish(job, SYSTEMD_RESTART_FAILED, "invalid RestartUnit reply");
+        return 0;
+    }
+    job->state = SYSTEMD_JOB_RUNNING;
+    if (systemd_config.debug)
+        printf("systemd: restart of '%s' queued as %s\n", job->unit, job->job);
+    return 0;
+}
+
+int __systemd_on_state(sd_bus_message *m, void *userdata, sd_bus_error *error) {
+    SystemdJob *job = (SystemdJob *)userdata;
+    const char *state;
+    job->slot = sd_bus_slot_unref(job->slot);
+    if (sd_bus_message_is_method_error(m, NULL)) {
+        __systemd_finish(job, SYSTEMD_RESTART_FAILED, __systemd_error(m, error));
+        return 0;
+    }
+    if (sd_bus_message_read(m, "v", "s", &state) < 0) {
+        __systemd_finish(job, SYSTEMD_RESTART_FAILED, "invalid ActiveState reply");
+        return 0;
+    }
+    // A job is already under way for the unit, which a restart would only replace
+    if (strcmp(state, "activating") == 0 || strcmp(state, "deactivating") == 0 || strcmp(state, "reloading") == 0) {
+        __systemd_finish(job, SYSTEMD_RESTART_SKIPPED, state);
+        return 0;
+    }
+    const int r = sd_bus_call_method_async(systemd_bus, &job->slot, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager",
+                                           "RestartUnit", __systemd_on_restart, job, "ss", job->unit, "replace");
     if (r < 0) {
-        fprintf(stderr, "systemd_service_restart: system bus connection failed: %s\n", strerror(-r));
+        __systemd_finish(job, SYSTEMD_RESTART_FAILED, strerror(-r));
+        return 0;
+    }
+    job->state = SYSTEMD_JOB_RESTART;
+    return 0;
+}
+
+bool __systemd_open(void) {
+    int r;
+    if ((r = sd_bus_open_system(&systemd_bus)) < 0) {
+        fprintf(stderr, "systemd: system bus connection failed: %s\n", strerror(-r));
+        systemd_bus = NULL;
+        return false;
+    }
+    // Manager signals are only sent to clients that have subscribed
+    if ((r = sd_bus_match_signal(systemd_bus, &systemd_job_removed, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager",
+                                 "JobRemoved", __systemd_on_job_removed, NULL)) < 0 ||
+        (r = sd_bus_call_method_async(systemd_bus, NULL, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager", "Subscribe",
+                                      NULL, NULL, "")) < 0) {
+        fprintf(stderr, "systemd: failed to subscribe to job signals: %s\n", strerror(-r));
+        __systemd_close();
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// Returns once the restart is under way, its outcome going later to the handler; a restart of a unit that already has one
+// in progress is folded into that one
+bool systemd_service_restart(const char *service_name) {
+    SystemdJob *job = NULL;
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++) {
+        if (systemd_jobs[i].state != SYSTEMD_JOB_FREE && strcmp(systemd_jobs[i].unit, service_name) == 0) {
+            if (systemd_config.debug)
+                printf("systemd: restart of '%s' already in progress\n", service_name);
+            return true;
+        }
+        if (systemd_jobs[i].state == SYSTEMD_JOB_FREE && job == NULL)
+            job = &systemd_jobs[i];
+    }
+    if (job == NULL) {
+        fprintf(stderr, "systemd: restart '%s' failed: too many restarts in progress\n", service_name);
         return false;
     }
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *m = NULL;
-    r = sd_bus_call_method(bus,
-                           "org.freedesktop.systemd1",         // Service
-                           "/org/freedesktop/systemd1",        // Object path
-                           "org.freedesktop.systemd1.Manager", // Interface
-                           "RestartUnit",                      // Method
-                           &error,                             // Error
-                           &m,                                 // Response message
-                           "ss",                               // Signature (string, string)
-                           service_name,                       // Unit name
-                           "replace");                         // Mode
+    if (strlen(service_name) >= sizeof(job->unit)) {
+        fprintf(stderr, "systemd: restart '%s' failed: name too long\n", service_name);
+        return false;
+    }
+    if (systemd_bus == NULL && !__systemd_open())
+        return false;
+    char *path = NULL;
+    int r = sd_bus_path_encode("/org/freedesktop/systemd1/unit", service_name, &path);
+    if (r >= 0)
+        r = sd_bus_call_method_async(systemd_bus, &job->slot, "org.freedesktop.systemd1", path, "org.freedesktop.DBus.Properties", "Get", __systemd_on_state, job,
+                                     "ss", "org.freedesktop.systemd1.Unit", "ActiveState");
+    free(path);
     if (r < 0) {
-        fprintf(stderr, "systemd_service_restart: restart service '%s' failed: %s\n", service_name, error.message);
-        sd_bus_error_free(&error);
-        sd_bus_unref(bus);
+        fprintf(stderr, "systemd: restart '%s' failed: %s\n", service_name, strerror(-r));
         return false;
     }
-    sd_bus_message_unref(m);
-    sd_bus_unref(bus);
+    strcpy(job->unit, service_name);
+    job->state = SYSTEMD_JOB_STATE;
+    job->deadline = time_monotonic_ms() + systemd_config.timeout_ms;
     return true;
 }
 
+// Dispatches whatever the bus has ready, and times out restarts that have run too long
+void systemd_process(void) {
+    if (systemd_bus != NULL) {
+        int r;
+        while ((r = sd_bus_process(systemd_bus, NULL)) > 0)
+            ;
+        if (r < 0) {
+            fprintf(stderr, "systemd: bus processing failed: %s\n", strerror(-r));
+            __systemd_close(); // reopened by the next restart
+        }
+    }
+    const int64_t now = time_monotonic_ms();
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++)
+        if (systemd_jobs[i].state != SYSTEMD_JOB_FREE && systemd_jobs[i].deadline <= now)
+            __systemd_finish(&systemd_jobs[i], SYSTEMD_RESTART_TIMEOUT, systemd_jobs[i].state == SYSTEMD_JOB_RUNNING ? "job did not complete" : "no reply");
+}
+
+// The bus socket (-1 if not connected), and the poll events it is waiting for
+int systemd_fd(void) { return systemd_bus != NULL ? sd_bus_get_fd(systemd_bus) : -1; }
+int systemd_events(void) { return systemd_bus != NULL ? sd_bus_get_events(systemd_bus) : 0; }
+
+bool systemd_next_deadline(int64_t *deadline) {
+    bool result = false;
+    uint64_t timeout_usec;
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++)
+        if (systemd_jobs[i].state != SYSTEMD_JOB_FREE && (!result || systemd_jobs[i].deadline < *deadline))
+            *deadline = systemd_jobs[i].deadline, result = true;
+    if (systemd_bus != NULL && sd_bus_get_timeout(systemd_bus, &timeout_usec) >= 0 && timeout_usec != UINT64_MAX &&
+        (!result || (int64_t)(timeout_usec / 1000) < *deadline))
+        *deadline = (int64_t)(timeout_usec / 1000), result = true;
+    return result;
+}
+
+size_t systemd_restarts_in_progress(void) {
+    size_t count = 0;
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++)
+        if (systemd_jobs[i].state != SYSTEMD_JOB_FREE)
+            count++;
+    return count;
+}
+
+// Connecting now is only to find problems early: a bus that is unavailable is retried by each restart
+bool systemd_begin(const SystemdConfig *config) {
+    systemd_config = *config;
+    for (int i = 0; i < SYSTEMD_JOBS_MAX; i++)
+        systemd_jobs[i] = (SystemdJob){.state = SYSTEMD_JOB_FREE};
+    if (!__systemd_open())
+        fprintf(stderr, "systemd: bus not available yet, will retry on restart\n");
+    return true;
+}
+
+void systemd_end(void) { __systemd_close(); }
+
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -4,6 +4,11 @@
 
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -20,6 +25,257 @@ float __unpack_f(const uint8_t *x) {
     return u.f;
 }
 
+// FNV-1a over a NUL terminated string, yielding the length from the same pass so callers need not strlen() separately
+uint32_t hash_string(const char *string, size_t *length) {
+    uint32_t hash = 2166136261u;
+    const char *p = string;
+    while (*p != '\0') {
+        hash ^= (uint8_t)*p++;
+        hash *= 16777619u;
+    }
+    if (length)
+        *length = (size_t)(p - string);
+    return hash;
+}
+uint32_t hash_bytes(const char *data, const size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Growable string, for output of unbounded size; keep and reset it between uses so that it only allocates while growing
+typedef struct {
+    char *data;
+    size_t length, capacity;
+} StringBuffer;
+
+bool string_buffer_reserve(StringBuffer *buffer, const size_t extra) {
+    if (buffer->length + extra < buffer->capacity)
+        return true;
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 1024;
+    while (capacity <= buffer->length + extra)
+        capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+        return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+bool string_buffer_append(StringBuffer *buffer, const char *data, const size_t length) {
+    if (!string_buffer_reserve(buffer, length))
+        return false;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+    return true;
+}
+bool string_buffer_printf(StringBuffer *buffer, const char *format, ...) __attribute__((format(printf, 2, 3)));
+bool string_buffer_printf(StringBuffer *buffer, const char *format, ...) {
+    if (!string_buffer_reserve(buffer, 0))
+        return false;
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, args);
+    va_end(args);
+    if (length < 0)
+        return false;
+    if (buffer->length + (size_t)length >= buffer->capacity) {
+        if (!string_buffer_reserve(buffer, (size_t)length))
+            return false;
+        va_start(args, format);
+        vsnprintf(buffer->data + buffer->length, buffer->capacity - buffer->length, format, args);
+        va_end(args);
+    }
+    buffer->length += (size_t)length;
+    return true;
+}
+// Appends value as a quoted JSON string
+bool string_buffer_json_string(StringBuffer *buffer, const char *value) {
+    if (!string_buffer_append(buffer, "\"", 1))
+        return false;
+    for (const unsigned char *p = (const unsigned char *)value; *p != '\0'; p++) {
+        size_t length = 0;
+        while (p[length] != '\0' && p[length] != '"' && p[length] != '\\' && p[length] >= 0x20)
+            length++;
+        if (!string_buffer_append(buffer, (const char *)p, length))
+            return false;
+        if (p[length] == '\0')
+            break;
+        p += length;
+        const char *escape = *p == '"' ? "\\\"" : *p == '\\' ? "\\\\" : *p == '\n' ? "\\n" : *p == '\t' ? "\\t" : NULL;
+        if (!(escape != NULL ? string_buffer_append(buffer, escape, 2) : string_buffer_printf(buffer, "\\u%04x", *p)))
+            return false;
+    }
+    return string_buffer_append(buffer, "\"", 1);
+}
+void string_buffer_reset(StringBuffer *buffer) {
+    buffer->length = 0;
+    if (buffer->data != NULL)
+        buffer->data[0] = '\0';
+}
+void string_buffer_free(StringBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = buffer->capacity = 0;
+}
+
+#define CACHE_LINE_SIZE 64
+
+// Zeroed allocation aligned to, and padded out to, a cache line so arrays written by one thread and read by another share
+// no line with unrelated data
+void *cache_aligned_calloc(const size_t count, const size_t size) {
+    const size_t bytes = (count * size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    void *memory = aligned_alloc(CACHE_LINE_SIZE, bytes > 0 ? bytes : CACHE_LINE_SIZE);
+    if (memory != NULL)
+        memset(memory, 0, bytes > 0 ? bytes : CACHE_LINE_SIZE);
+    return memory;
+}
+
+// Reader-writer lock for state read on every message by a fixed set of threads, and changed rarely: each reader has a
+// slot of its own, a flag on its own cache line, so taking the lock to read writes no line that another thread writes. A
+// writer raises its flag, then waits for every reader slot to clear; readers finding the flag raised stand aside, and
+// wait on the writer's mutex until it is done. A reader must leave before writing (or it would wait on itself).
+typedef struct {
+    _Atomic(bool) active;
+    char padding[CACHE_LINE_SIZE - sizeof(_Atomic(bool))];
+} __ReaderSlot;
+typedef struct {
+    __ReaderSlot *slots;
+    size_t count;
+    _Atomic(bool) writing;
+    pthread_mutex_t writer;
+} ReaderSlotLock;
+
+bool reader_slot_lock_begin(ReaderSlotLock *lock, const size_t count) {
+    if ((lock->slots = cache_aligned_calloc(count, sizeof(__ReaderSlot))) == NULL)
+        return false;
+    lock->count = count;
+    atomic_store_explicit(&lock->writing, false, memory_order_relaxed);
+    pthread_mutex_init(&lock->writer, NULL);
+    return true;
+}
+// Both sides use sequentially consistent flag accesses, so that a reader and a writer arriving together cannot both miss
+// the other's flag
+void reader_slot_enter(ReaderSlotLock *lock, const size_t slot) {
+    _Atomic(bool) *active = &lock->slots[slot].active;
+    for (;;) {
+        atomic_store(active, true);
+        if (!atomic_load(&lock->writing))
+            return;
+        atomic_store_explicit(active, false, memory_order_release);
+        pthread_mutex_lock(&lock->writer);
+        pthread_mutex_unlock(&lock->writer);
+    }
+}
+void reader_slot_leave(ReaderSlotLock *lock, const size_t slot) { atomic_store_explicit(&lock->slots[slot].active, false, memory_order_release); }
+void reader_slot_write_enter(ReaderSlotLock *lock) {
+    pthread_mutex_lock(&lock->writer);
+    atomic_store(&lock->writing, true);
+    for (size_t i = 0; i < lock->count; i++)
+        while (atomic_load(&lock->slots[i].active))
+            sched_yield();
+}
+void reader_slot_write_leave(ReaderSlotLock *lock) {
+    atomic_store_explicit(&lock->writing, false, memory_order_release);
+    pthread_mutex_unlock(&lock->writer);
+}
+void reader_slot_lock_end(ReaderSlotLock *lock) {
+    if (lock->slots == NULL)
+        return;
+    free(lock->slots);
+    lock->slots = NULL;
+    lock->count = 0;
+    pthread_mutex_destroy(&lock->writer);
+}
+
+int64_t time_realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+int64_t time_monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+int64_t time_monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Indexed binary min-heap of deadlines: items are small integers (0 .. capacity-1) each holding at most one deadline,
+// which can be set, moved in either direction or removed in O(log n), and the earliest found in O(1)
+typedef struct {
+    uint32_t *heap;     // Item at each heap position
+    uint32_t *position; // Heap position of each item + 1, 0 when not queued
+    int64_t *deadline;  // Deadline of each item
+    size_t count;
+} DeadlineQueue;
+
+bool deadline_queue_begin(DeadlineQueue *queue, const size_t capacity) {
+    queue->heap = malloc((capacity > 0 ? capacity : 1) * sizeof(uint32_t));
+    queue->position = calloc(capacity > 0 ? capacity : 1, sizeof(uint32_t));
+    queue->deadline = malloc((capacity > 0 ? capacity : 1) * sizeof(int64_t));
+    queue->count = 0;
+    return queue->heap != NULL && queue->position != NULL && queue->deadline != NULL;
+}
+void __deadline_queue_place(DeadlineQueue *queue, const size_t index, const uint32_t item) {
+    queue->heap[index] = item;
+    queue->position[item] = (uint32_t)index + 1;
+}
+void __deadline_queue_sift(DeadlineQueue *queue, size_t index) {
+    const uint32_t item = queue->heap[index];
+    const int64_t deadline = queue->deadline[item];
+    while (index > 0 && queue->deadline[queue->heap[(index - 1) / 2]] > deadline) {
+        __deadline_queue_place(queue, index, queue->heap[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+    for (size_t child; (child = index * 2 + 1) < queue->count; index = child) {
+        if (child + 1 < queue->count && queue->deadline[queue->heap[child + 1]] < queue->deadline[queue->heap[child]])
+            child++;
+        if (queue->deadline[queue->heap[child]] >= deadline)
+            break;
+        __deadline_queue_place(queue, index, queue->heap[child]);
+    }
+    __deadline_queue_place(queue, index, item);
+}
+void deadline_queue_set(DeadlineQueue *queue, const uint32_t item, const int64_t deadline) {
+    queue->deadline[item] = deadline;
+    if (queue->position[item] == 0)
+        __deadline_queue_place(queue, queue->count++, item);
+    __deadline_queue_sift(queue, queue->position[item] - 1);
+}
+void deadline_queue_remove(DeadlineQueue *queue, const uint32_t item) {
+    if (queue->position[item] == 0)
+        return;
+    const size_t index = queue->position[item] - 1;
+    queue->position[item] = 0;
+    if (index != --queue->count) {
+        __deadline_queue_place(queue, index, queue->heap[queue->count]);
+        __deadline_queue_sift(queue, index);
+    }
+}
+bool deadline_queue_peek(const DeadlineQueue *queue, uint32_t *item, int64_t *deadline) {
+    if (queue->count == 0)
+        return false;
+    *item = queue->heap[0];
+    *deadline = queue->deadline[*item];
+    return true;
+}
+void deadline_queue_end(DeadlineQueue *queue) {
+    free(queue->heap);
+    free(queue->position);
+    free(queue->deadline);
+    queue->heap = queue->position = NULL;
+    queue->deadline = NULL;
+    queue->count = 0;
+}
+
 time_t intervalable(const time_t interval, time_t *last) {
     time_t now = time(NULL);
     if (*last == 0) {
@@ -70,9 +326,266 @@ bool is_reasonable_json(const unsigned char *packet, const int length) {
     return true;
 }
 
-#define EMA_ALPHA 0.2f
-void ema_update(unsigned char value, unsigned char *value_ema, unsigned long *value_cnt) {
-    *value_ema = (*value_cnt)++ == 0 ? value : (unsigned char)((EMA_ALPHA * (float)value) + ((1.0f - EMA_ALPHA) * (*value_ema)));
+// Single pass, allocation free scan of a JSON document for a handful of fields named by dotted paths ("status.code"),
+// reporting each field's type and the span of its value within the document (the contents, for a string). Keys are
+// compared as they appear, without unescaping, and array elements are not addressable. The scan stops early once every
+// field has been found, so only the prefix of the document up to that point is checked to be well formed.
+#ifndef JSON_SCAN_DEPTH
+#define JSON_SCAN_DEPTH 16
+#endif
+
+typedef enum { JSON_NONE = 0, JSON_STRING, JSON_NUMBER, JSON_TRUE, JSON_FALSE, JSON_NULL, JSON_OBJECT, JSON_ARRAY } json_type_t;
+
+typedef struct {
+    const char *path;  // Dotted path of the field
+    json_type_t type;  // Type found, JSON_NONE if absent
+    const char *value; // Start of value within the document
+    size_t length;     // Length of value
+} JsonField;
+
+typedef struct {
+    const char *p, *end;
+    const char *keys[JSON_SCAN_DEPTH]; // Key at each depth, NULL within an array
+    size_t key_lengths[JSON_SCAN_DEPTH];
+    int depth;
+    JsonField *fields;
+    size_t count, found;
+} __json_scanner_t;
+
+void __json_skip_whitespace(__json_scanner_t *scanner) {
+    while (scanner->p < scanner->end && (*scanner->p == ' ' || *scanner->p == '\t' || *scanner->p == '\n' || *scanner->p == '\r'))
+        scanner->p++;
+}
+bool __json_scan_string(__json_scanner_t *scanner, const char **value, size_t *length) {
+    if (scanner->p >= scanner->end || *scanner->p != '"')
+        return false;
+    const char *start = ++scanner->p;
+    while (scanner->p < scanner->end && *scanner->p != '"')
+        scanner->p += (*scanner->p == '\\') ? 2 : 1;
+    if (scanner->p >= scanner->end)
+        return false;
+    *value = start;
+    *length = (size_t)(scanner->p++ - start);
+    return true;
+}
+bool __json_path_matches(const __json_scanner_t *scanner, const char *path) {
+    for (int depth = 0; depth < scanner->depth; depth++) {
+        if (path == NULL || scanner->keys[depth] == NULL)
+            return false;
+        const char *dot = strchr(path, '.');
+        const size_t length = dot ? (size_t)(dot - path) : strlen(path);
+        if (length != scanner->key_lengths[depth] || memcmp(path, scanner->keys[depth], length) != 0)
+            return false;
+        path = dot ? dot + 1 : NULL;
+    }
+    return path == NULL;
+}
+void __json_match(__json_scanner_t *scanner, const json_type_t type, const char *value, const size_t length) {
+    for (size_t i = 0; i < scanner->count; i++) {
+        JsonField *field = &scanner->fields[i];
+        if (field->type == JSON_NONE && __json_path_matches(scanner, field->path)) {
+            field->type = type;
+            field->value = value;
+            field->length = length;
+            scanner->found++;
+        }
+    }
+}
+bool __json_scan_literal(__json_scanner_t *scanner, const char *literal, const size_t length) {
+    if ((size_t)(scanner->end - scanner->p) < length || memcmp(scanner->p, literal, length) != 0)
+        return false;
+    scanner->p += length;
+    return true;
+}
+bool __json_scan_value(__json_scanner_t *scanner) {
+    __json_skip_whitespace(scanner);
+    if (scanner->p >= scanner->end)
+        return false;
+    const char *start = scanner->p;
+    const char *value = start;
+    size_t length = 0;
+    json_type_t type;
+    switch (*scanner->p) {
+    case '{':
+    case '[': {
+        const bool object = *scanner->p == '{';
+        const char close = object ? '}' : ']';
+        type = object ? JSON_OBJECT : JSON_ARRAY;
+        if (scanner->depth >= JSON_SCAN_DEPTH)
+            return false;
+        scanner->p++;
+        __json_skip_whitespace(scanner);
+        if (scanner->p < scanner->end && *scanner->p == close)
+            scanner->p++;
+        else
+            for (;;) {
+                scanner->keys[scanner->depth] = NULL;
+                if (object) {
+                    __json_skip_whitespace(scanner);
+                    if (!__json_scan_string(scanner, &scanner->keys[scanner->depth], &scanner->key_lengths[scanner->depth]))
+                        return false;
+                    __json_skip_whitespace(scanner);
+                    if (scanner->p >= scanner->end || *scanner->p++ != ':')
+                        return false;
+                }
+                scanner->depth++;
+                const bool result = __json_scan_value(scanner);
+                scanner->depth--;
+                if (!result)
+                    return false;
+                if (scanner->found == scanner->count)
+                    return true;
+                __json_skip_whitespace(scanner);
+                if (scanner->p >= scanner->end)
+                    return false;
+                if (*scanner->p == close) {
+                    scanner->p++;
+                    break;
+                }
+                if (*scanner->p++ != ',')
+                    return false;
+            }
+        length = (size_t)(scanner->p - start);
+        break;
+    }
+    case '"':
+        type = JSON_STRING;
+        if (!__json_scan_string(scanner, &value, &length))
+            return false;
+        break;
+    case 't':
+        type = JSON_TRUE;
+        if (!__json_scan_literal(scanner, "true", 4))
+            return false;
+        length = 4;
+        break;
+    case 'f':
+        type = JSON_FALSE;
+        if (!__json_scan_literal(scanner, "false", 5))
+            return false;
+        length = 5;
+        break;
+    case 'n':
+        type = JSON_NULL;
+        if (!__json_scan_literal(scanner, "null", 4))
+            return false;
+        length = 4;
+        break;
+    default:
+        type = JSON_NUMBER;
+        while (scanner->p < scanner->end && *scanner->p != '\0' && strchr("+-0123456789.eE", *scanner->p) != NULL)
+            scanner->p++;
+        if (scanner->p == start)
+            return false;
+        length = (size_t)(scanner->p - start);
+        break;
+    }
+    if (scanner->depth > 0)
+        __json_match(scanner, type, value, length);
+    return true;
+}
+// Returns false if the document is malformed before every field was found; fields not found are left as JSON_NONE
+bool json_scan_fields(const char *json, const size_t length, JsonField *fields, const size_t count) {
+    __json_scanner_t scanner = {.p = json, .end = json + length, .depth = 0, .fields = fields, .count = count, .found = 0};
+    for (size_t i = 0; i < count; i++)
+        fields[i].type = JSON_NONE;
+    return __json_scan_value(&scanner);
+}
+// Numbers are converted through a small stack copy, since the value is not NUL terminated within the document
+bool json_number(const char *value, const size_t length, double *number) {
+    char buffer[64];
+    if (length == 0 || length >= sizeof(buffer))
+        return false;
+    memcpy(buffer, value, length);
+    buffer[length] = '\0';
+    char *endptr;
+    *number = strtod(buffer, &endptr);
+    return *endptr == '\0';
+}
+
+// Time-decayed event rate: each event adds 1/window and the sum decays by e^(-elapsed/window), so it tracks events per second
+// over roughly the last window however irregular the arrivals. Reading it at elapsed_since_start corrects the bias from
+// starting at zero, so estimates are usable (if noisy) well before a full window has passed.
+double rate_ewma_event(const double rate, const int64_t elapsed_ms, const int64_t window_ms) {
+    return rate * exp(-(double)elapsed_ms / (double)window_ms) + 1000.0 / (double)window_ms;
+}
+double rate_ewma_read(const double rate, const int64_t elapsed_ms, const int64_t elapsed_since_start_ms, const int64_t window_ms) {
+    const double coverage = 1.0 - exp(-(double)elapsed_since_start_ms / (double)window_ms);
+    return coverage > 0.0 ? rate * exp(-(double)elapsed_ms / (double)window_ms) / coverage : 0.0;
+}
+
+// Cumulative histogram with power of two bucket bounds (bucket i holds values up to 2^i, the last everything larger), for
+// export: unlike LogHistogram it never decays, as scrapers expect counters to only grow. Any number of writers.
+#define POW2_HISTOGRAM_BUCKETS 25
+typedef struct {
+    _Atomic(uint32_t) counts[POW2_HISTOGRAM_BUCKETS];
+    _Atomic(uint64_t) sum;
+} Pow2Histogram;
+
+void pow2_histogram_reset(Pow2Histogram *histogram) {
+    for (size_t i = 0; i < POW2_HISTOGRAM_BUCKETS; i++)
+        atomic_store_explicit(&histogram->counts[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->sum, 0, memory_order_relaxed);
+}
+void pow2_histogram_add(Pow2Histogram *histogram, const uint64_t value) {
+    size_t bucket = value <= 1 ? 0 : (size_t)(64 - __builtin_clzll(value - 1));
+    if (bucket >= POW2_HISTOGRAM_BUCKETS)
+        bucket = POW2_HISTOGRAM_BUCKETS - 1;
+    atomic_fetch_add_explicit(&histogram->counts[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+}
+
+// Fixed size log-bucketed histogram (two buckets per power of two, so within 50%, from 1 to 2^32) for streaming quantiles.
+// All counts are halved every LOG_HISTOGRAM_DECAY samples, weighting it to recent history and bounding every count. Any
+// number of threads may add, and others read quantiles at any time; a sample added while the counts are being halved may
+// escape the halving, which only weights it a little more.
+#define LOG_HISTOGRAM_BUCKETS 64
+#define LOG_HISTOGRAM_DECAY 1024
+typedef struct {
+    _Atomic(uint16_t) counts[LOG_HISTOGRAM_BUCKETS];
+    _Atomic(uint32_t) samples; // Samples since the last halving
+} LogHistogram;
+
+size_t log_histogram_bucket(const uint64_t value) {
+    if (value < 2)
+        return 0;
+    const int octave = 63 - __builtin_clzll(value);
+    const size_t bucket = (size_t)octave * 2 + ((value >> (octave - 1)) & 1);
+    return bucket < LOG_HISTOGRAM_BUCKETS ? bucket : LOG_HISTOGRAM_BUCKETS - 1;
+}
+// Exclusive upper bound of the values in a bucket
+uint64_t log_histogram_bucket_upper(const size_t bucket) { return bucket < 2 ? 2 : (uint64_t)(3 + (bucket & 1)) << (bucket / 2 - 1); }
+void log_histogram_reset(LogHistogram *histogram) {
+    for (size_t i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+        atomic_store_explicit(&histogram->counts[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&histogram->samples, 0, memory_order_relaxed);
+}
+// Only the adder reaching the decay count halves, so halvings never overlap
+void log_histogram_add(LogHistogram *histogram, const uint64_t value) {
+    if (atomic_fetch_add_explicit(&histogram->samples, 1, memory_order_relaxed) + 1 == LOG_HISTOGRAM_DECAY) {
+        for (size_t i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+            atomic_store_explicit(&histogram->counts[i], (uint16_t)(atomic_load_explicit(&histogram->counts[i], memory_order_relaxed) / 2), memory_order_relaxed);
+        atomic_fetch_sub_explicit(&histogram->samples, LOG_HISTOGRAM_DECAY, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&histogram->counts[log_histogram_bucket(value)], 1, memory_order_relaxed);
+}
+uint32_t log_histogram_count(const LogHistogram *histogram) {
+    uint32_t count = 0;
+    for (size_t i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+        count += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    return count;
+}
+// Upper bound of the bucket holding the quantile, so it errs high; 0 if empty
+uint64_t log_histogram_quantile(const LogHistogram *histogram, const double quantile) {
+    const uint32_t count = log_histogram_count(histogram);
+    if (count == 0)
+        return 0;
+    const double target = quantile * (double)count;
+    uint32_t cumulative = 0;
+    for (size_t i = 0; i < LOG_HISTOGRAM_BUCKETS; i++)
+        if ((double)(cumulative += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed)) >= target && cumulative > 0)
+            return log_histogram_bucket_upper(i);
+    return log_histogram_bucket_upper(LOG_HISTOGRAM_BUCKETS - 1);
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
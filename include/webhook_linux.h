@@ -0,0 +1,48 @@
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include <curl/curl.h>
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// HTTP POST of a small body to a (typically local) webhook, for use off the main thread; any 2xx response is success.
+// Each call has its own handle, so calls for several webhooks may run at once.
+
+size_t __webhook_discard(char *data __attribute__((unused)), size_t size, size_t nmemb, void *userdata __attribute__((unused))) { return size * nmemb; }
+
+// Returns whether it was accepted, describing the outcome in detail otherwise
+bool webhook_post(const char *url, const char *content_type, const char *body, const size_t length, const int64_t timeout_ms, char *detail, const size_t detail_size) {
+    char header[128];
+    CURL *curl = curl_easy_init();
+    if (curl == NULL) {
+        snprintf(detail, detail_size, "failed to initialize curl");
+        return false;
+    }
+    snprintf(header, sizeof(header), "Content-Type: %s", content_type);
+    struct curl_slist *headers = curl_slist_append(NULL, header);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)length);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, __webhook_discard);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // timeouts must not use signals off the main thread
+    const CURLcode res = curl_easy_perform(curl);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK) {
+        snprintf(detail, detail_size, "%s", curl_easy_strerror(res));
+        return false;
+    }
+    if (status < 200 || status > 299) {
+        snprintf(detail, detail_size, "HTTP status %ld", status);
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
@@ -2,12 +2,20 @@
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
+#include <pthread.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -20,6 +28,10 @@
 
 #define MQTT_CLIENT_DEFAULT "mqtt-watchdog"
 #define MQTT_SERVER_DEFAULT "mqtt://localhost"
+#define MQTT_BROKER_DEFAULT "default"
+#define MQTT_PROTOCOL_DEFAULT "3.1.1"
+#define MQTT_INGEST_WORKERS_DEFAULT 1
+#define MQTT_INGEST_WORKERS_MAX 64
 
 #define EMAIL_SMTP_DEFAULT "smtp://localhost:25"
 #define EMAIL_USERNAME_DEFAULT ""
@@ -30,18 +42,51 @@
 #define EMAIL_TO_DEFAULT ""
 #define EMAIL_SUBJECT_DEFAULT "MQTT Watchdog Alert"
 
+#define ALERT_QUEUE_DEFAULT 64
+#define ALERT_WORKERS_DEFAULT 4
+#define ALERT_ATTEMPTS_DEFAULT 3
+#define ALERT_TIMEOUT_DEFAULT 30
+#define ALERT_BACKOFF_DEFAULT 10
+#define ALERT_DIGEST_DEFAULT 0
+#define EMAIL_RATE_LIMIT_DEFAULT 0
+#define EMAIL_RATE_PERIOD_DEFAULT 3600
+
 #define TOPIC_TIMEOUT_LEVEL1_DEFAULT 60
 #define TOPIC_TIMEOUT_LEVEL2_DEFAULT 300
+#define TOPIC_DISCOVER_MAX_DEFAULT 1024
+#define TOPIC_RATE_WINDOW_DEFAULT 60
+#define TOPIC_ADAPTIVE_QUANTILE_DEFAULT 0.99
+#define TOPIC_ADAPTIVE_FACTOR_DEFAULT 3.0
+#define TOPIC_ADAPTIVE_FLOOR_DEFAULT 1
+#define TOPIC_ADAPTIVE_WARMUP_DEFAULT 32
+#define BROKER_ALERT_DEFAULT 60
+#define BROKER_GRACE_DEFAULT 30
+#define PROBE_INTERVAL_DEFAULT 0
+#define PROBE_TOPIC_DEFAULT "mqtt-watchdog/probe"
+#define PROBE_LEVELS_DEFAULT "5,30"
+#define PROBE_STRETCH_DEFAULT true
+
+#define ACTION_CONCURRENCY_DEFAULT 1
 
 #define SERVICE_NAME_DEFAULT ""
+#define SYSTEMD_TIMEOUT_DEFAULT 120
+
+#define STATE_FILE_DEFAULT ""
 
 #define REPORT_PERIOD_DEFAULT 300
 
+#define CONFIG_WATCH_DEFAULT false
+
+#define EVENT_LOOP_DEFAULT false
+
+#define STATUS_PREFIX_DEFAULT ""
+
+#define METRICS_ADDRESS_DEFAULT "127.0.0.1"
+#define METRICS_PORT_DEFAULT 0
+
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-#define CONFIG_MAX_ENTRIES 128
-
 #include "include/config_linux.h"
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -52,14 +97,230 @@
 
 #include "include/mqtt_linux.h"
 
+// Settings shared by every broker's client
 MqttConfig mqttConfig;
+char mqtt_status_topic[CONFIG_MAX_STRING + 8];
+
+// Brokers are listed as "broker.N.name" and "broker.N.server" (and optionally "broker.N.client", by default
+// 'mqtt-client', and "broker.N.protocol", by default 'mqtt-protocol'), or if none are, there is the one broker
+// "mqtt-server". Each has its own client, connection and subscriptions; topics and publish actions name theirs with
+// "topic.N.broker" and "action.N.broker", by default the first. Brokers are set up once, and keep their startup
+// configuration across reloads.
+typedef struct {
+    const char *name;
+    const char *server;
+    const char *client;
+    bool v5;
+} MqttBroker;
+MqttBroker *mqtt_brokers = NULL;
+size_t mqtt_broker_count = 0;
+
+// Each broker is received from by "ingest-workers" clients (1), each a connection with its own network thread. With more
+// than one, they subscribe as members of the shared subscription group "ingest-group" ("$share/<group>/<topic>"), so the
+// broker spreads messages across them rather than copying them to each, and messages are processed on as many threads at
+// once. The group is by default the broker's client id: another watchdog in the same group would take a share of the
+// messages, and alert on topics that are alive, so it must be unique to each watchdog. A broker's first client also publishes, and its connection is the one that counts as the broker's. Workers need
+// the library's threads, so with "event-loop" there is one per broker.
+typedef struct {
+    MqttClient mqtt;
+    int broker;    // Index in mqtt_brokers
+    char name[64]; // For messages
+} MqttWorker;
+MqttWorker *mqtt_workers = NULL; // Those of broker b from mqtt_workers[b * mqtt_ingest_workers]
+size_t mqtt_worker_count = 0, mqtt_ingest_workers = MQTT_INGEST_WORKERS_DEFAULT;
+const char *mqtt_ingest_group = NULL;
+
+MqttClient *mqtt_broker_client(const int broker) { return &mqtt_workers[(size_t)broker * mqtt_ingest_workers].mqtt; }
+const char *mqtt_broker_share_group(const MqttBroker *broker) { return mqtt_ingest_group != NULL ? mqtt_ingest_group : broker->client; }
+
+// The broker named, or the first if name is NULL; -1 if there is no such broker
+int mqtt_broker_find(const char *name) {
+    if (name == NULL)
+        return mqtt_broker_count > 0 ? 0 : -1;
+    for (size_t i = 0; i < mqtt_broker_count; i++)
+        if (strcmp(mqtt_brokers[i].name, name) == 0)
+            return (int)i;
+    return -1;
+}
 
+// "5" or "3.1.1" (or its alias "3"), into v5
+bool mqtt_protocol_parse(const char *protocol, bool *v5) {
+    if (strcmp(protocol, "5") == 0)
+        *v5 = true;
+    else if (strcmp(protocol, "3.1.1") == 0 || strcmp(protocol, "3") == 0)
+        *v5 = false;
+    else
+        return false;
+    return true;
+}
 bool mqtt_config(void) {
-    mqttConfig.server = config_get_string("mqtt-server", MQTT_SERVER_DEFAULT);
+    config_section_t section;
     mqttConfig.client = config_get_string("mqtt-client", MQTT_CLIENT_DEFAULT);
+    const char *protocol = config_get_string("mqtt-protocol", MQTT_PROTOCOL_DEFAULT);
+    if (!mqtt_protocol_parse(protocol, &mqttConfig.v5)) {
+        fprintf(stderr, "mqtt: invalid mqtt-protocol '%s' (5 or 3.1.1)\n", protocol);
+        return false;
+    }
+    mqttConfig.external_loop = config_get_bool("event-loop", EVENT_LOOP_DEFAULT);
+    const char *status_prefix = config_get_string("status-prefix", STATUS_PREFIX_DEFAULT);
+    if (status_prefix != NULL && status_prefix[0] != '\0') {
+        snprintf(mqtt_status_topic, sizeof(mqtt_status_topic), "%s/status", status_prefix);
+        mqttConfig.status_topic = mqtt_status_topic;
+    }
     mqttConfig.debug = config_get_bool("debug", false);
+    const int workers = config_get_integer("ingest-workers", MQTT_INGEST_WORKERS_DEFAULT);
+    mqtt_ingest_workers = workers < 1 ? 1 : workers > MQTT_INGEST_WORKERS_MAX ? MQTT_INGEST_WORKERS_MAX : (size_t)workers;
+    if (mqtt_ingest_workers > 1 && mqttConfig.external_loop) {
+        fprintf(stderr, "mqtt: ingest-workers needs library threads, so is ignored with event-loop\n");
+        mqtt_ingest_workers = 1;
+    }
+    mqtt_ingest_group = config_get_string("ingest-group", NULL);
+    const int *indices;
+    const size_t count = config_get_array("broker", "name", &indices);
+    if ((mqtt_brokers = calloc(count > 0 ? count : 1, sizeof(MqttBroker))) == NULL) {
+        fprintf(stderr, "mqtt: failed to allocate memory for %zu brokers\n", count);
+        return false;
+    }
+    if (count == 0) {
+        mqtt_brokers[0] =
+            (MqttBroker){.name = MQTT_BROKER_DEFAULT, .server = config_get_string("mqtt-server", MQTT_SERVER_DEFAULT), .client = mqttConfig.client, .v5 = mqttConfig.v5};
+        mqtt_broker_count = 1;
+    }
+    for (size_t n = 0; n < count; n++) {
+        const int i = indices[n];
+        config_section(&section, NULL, "broker", i);
+        const char *name = config_section_get_string(&section, "name", "");
+        const char *server = config_section_get_string(&section, "server", "");
+        if (name[0] == '\0' || strcspn(name, "\"\\\n") != strlen(name) || mqtt_broker_find(name) >= 0 || server[0] == '\0') {
+            fprintf(stderr, "mqtt: invalid or duplicate broker name '%s', or no server (broker.%d)\n", name, i);
+            return false;
+        }
+        MqttBroker *broker = &mqtt_brokers[mqtt_broker_count++];
+        *broker = (MqttBroker){.name = name, .server = server, .client = config_section_get_string(&section, "client", mqttConfig.client)};
+        const char *broker_protocol = config_section_get_string(&section, "protocol", protocol);
+        if (!mqtt_protocol_parse(broker_protocol, &broker->v5)) {
+            fprintf(stderr, "mqtt: invalid protocol '%s' (broker.%d; 5 or 3.1.1)\n", broker_protocol, i);
+            return false;
+        }
+        printf("mqtt: broker '%s' (server=%s, client=%s, protocol=%s)\n", name, server, broker->client, broker->v5 ? "5" : "3.1.1");
+    }
+    for (size_t b = 0; b < mqtt_broker_count && mqtt_ingest_workers > 1; b++) {
+        const char *group = mqtt_broker_share_group(&mqtt_brokers[b]);
+        if (group[0] == '\0' || strpbrk(group, "/+#") != NULL) {
+            fprintf(stderr, "mqtt: invalid ingest-group '%s' for broker '%s' (no '/', '+' or '#')\n", group, mqtt_brokers[b].name);
+            return false;
+        }
+    }
+    mqtt_worker_count = mqtt_broker_count * mqtt_ingest_workers;
+    if ((mqtt_workers = calloc(mqtt_worker_count, sizeof(MqttWorker))) == NULL) {
+        fprintf(stderr, "mqtt: failed to allocate memory for %zu clients\n", mqtt_worker_count);
+        return false;
+    }
+    for (size_t w = 0; w < mqtt_worker_count; w++) {
+        MqttWorker *worker = &mqtt_workers[w];
+        worker->broker = (int)(w / mqtt_ingest_workers);
+        if (mqtt_ingest_workers == 1)
+            snprintf(worker->name, sizeof(worker->name), "%s", mqtt_brokers[worker->broker].name);
+        else
+            snprintf(worker->name, sizeof(worker->name), "%s/%zu", mqtt_brokers[worker->broker].name, w % mqtt_ingest_workers);
+    }
+    if (mqtt_ingest_workers > 1)
+        printf("mqtt: ingest-workers=%zu per broker, ingest-group=%s\n", mqtt_ingest_workers, mqtt_ingest_group != NULL ? mqtt_ingest_group : "(client id)");
+    return true;
+}
+// Only a broker's first client has the status topic, as the Last Will of another would say the watchdog is offline when it is not
+bool mqtt_begin_all(void) {
+    for (size_t w = 0; w < mqtt_worker_count; w++) {
+        MqttWorker *worker = &mqtt_workers[w];
+        const MqttBroker *broker = &mqtt_brokers[worker->broker];
+        MqttConfig config = mqttConfig;
+        config.server = broker->server;
+        config.client = broker->client;
+        config.v5 = broker->v5;
+        if (w % mqtt_ingest_workers != 0)
+            config.status_topic = NULL;
+        if (mqtt_ingest_workers > 1)
+            config.share_group = mqtt_broker_share_group(broker);
+        if (!mqtt_begin(&worker->mqtt, worker->name, &config))
+            return false;
+    }
+    return true;
+}
+void mqtt_poll_all(void) {
+    for (size_t w = 0; w < mqtt_worker_count; w++)
+        mqtt_poll(&mqtt_workers[w].mqtt);
+}
+void mqtt_end_all(void) {
+    for (size_t w = 0; w < mqtt_worker_count; w++)
+        mqtt_end(&mqtt_workers[w].mqtt);
+    free(mqtt_workers);
+    mqtt_workers = NULL;
+    mqtt_worker_count = 0;
+    free(mqtt_brokers);
+    mqtt_brokers = NULL;
+    mqtt_broker_count = 0;
+}
+// Subscriptions are made on each of the broker's clients, for the broker to share out
+bool mqtt_broker_subscribe(const int broker, const char *topic, const uint32_t identifier) {
+    bool result = true;
+    for (size_t k = 0; k < mqtt_ingest_workers; k++)
+        result = mqtt_subscribe(&mqtt_workers[(size_t)broker * mqtt_ingest_workers + k].mqtt, topic, identifier) && result;
+    return result;
+}
+bool mqtt_broker_unsubscribe(const int broker, const char *topic) {
+    bool result = true;
+    for (size_t k = 0; k < mqtt_ingest_workers; k++)
+        result = mqtt_unsubscribe(&mqtt_workers[(size_t)broker * mqtt_ingest_workers + k].mqtt, topic) && result;
+    return result;
+}
+// Received, summed over the broker's clients
+MqttStats mqtt_broker_stats(const int broker) {
+    MqttStats total = mqtt_stats_get(mqtt_broker_client(broker));
+    for (size_t k = 1; k < mqtt_ingest_workers; k++) {
+        const MqttStats stats = mqtt_stats_get(&mqtt_workers[(size_t)broker * mqtt_ingest_workers + k].mqtt);
+        total.messages += stats.messages;
+        total.bytes += stats.bytes;
+    }
+    return total;
+}
+// Messages taken by each of a broker's clients, to show how evenly the broker shares them out
+bool mqtt_workers_stats_to_string(StringBuffer *buffer) {
+    bool result = true;
+    for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+        result = string_buffer_printf(buffer, "%s%s=[", b > 0 ? ", " : "", mqtt_brokers[b].name);
+        for (size_t k = 0; k < mqtt_ingest_workers && result; k++)
+            result = string_buffer_printf(buffer, "%s%lu", k > 0 ? "," : "", mqtt_stats_get(&mqtt_workers[b * mqtt_ingest_workers + k].mqtt).messages);
+        result = result && string_buffer_printf(buffer, "]");
+    }
+    return result;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include "include/dispatch_linux.h"
+
+// Alerts and actions are queued for a pool of workers so that a slow or unreachable mail server or backend delays only
+// its own notifications, never detection
+DispatchConfig alertConfig;
+int64_t alert_digest_ms;
+
+bool alert_config(void) {
+    const int queue = config_get_integer("alert-queue", ALERT_QUEUE_DEFAULT);
+    alertConfig.capacity = queue > 0 ? (size_t)queue : 0;
+    const int workers = config_get_integer("alert-workers", ALERT_WORKERS_DEFAULT);
+    alertConfig.workers = workers > 0 ? (size_t)workers : 0;
+    alertConfig.attempts = config_get_integer("alert-attempts", ALERT_ATTEMPTS_DEFAULT);
+    alertConfig.timeout_ms = config_get_duration_ms("alert-timeout", ALERT_TIMEOUT_DEFAULT * 1000);
+    alertConfig.backoff_ms = config_get_duration_ms("alert-backoff", ALERT_BACKOFF_DEFAULT * 1000);
+    alertConfig.debug = config_get_bool("debug", false);
+    alert_digest_ms = config_get_duration_ms("alert-digest", ALERT_DIGEST_DEFAULT * 1000);
+    printf("alert: queue=%zu, workers=%zu, attempts=%d, timeout=%gs, backoff=%gs, digest=%gs\n", alertConfig.capacity, alertConfig.workers, alertConfig.attempts,
+           (double)alertConfig.timeout_ms / 1000.0, (double)alertConfig.backoff_ms / 1000.0, (double)alert_digest_ms / 1000.0);
     return true;
 }
+bool alert_begin(void) { return dispatch_begin(&alertConfig); }
+void alert_end(void) { dispatch_end(); }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
@@ -75,20 +336,135 @@ typedef struct {
     const char *from;
     const char *to;
     const char *subject;
+    int rate_limit;         // Notifications per recipient per rate_period_ms (0 for no limit)
+    int64_t rate_period_ms; //
 } EmailConfig;
 
 EmailConfig emailConfig;
 
-bool action_email_notification(const char *topic, const char *content) {
-    if (strlen(emailConfig.to) == 0 || strlen(emailConfig.smtp) == 0)
-        return true;
+// Rate limiting is a token bucket per recipient, touched only by the alert worker; a recipient left out of notifications
+// is told how many were withheld in the next one it does get
+typedef struct {
+    char *address;
+    double tokens;            // Notifications that may be sent now
+    int64_t refilled;         // When tokens were last topped up
+    unsigned long withheld;   // Notifications withheld since the last one sent
+    bool selected;            // In the notification being sent
+} EmailRecipient;
+
+EmailRecipient *email_recipients = NULL;
+int email_recipients_count = 0;
+volatile unsigned long email_withheld = 0;
+StringBuffer email_limited_to = {0}, email_limited_content = {0};
+
+// Alerts raised within alert_digest_ms of the first are sent together, one line each, when the window closes
+#define ALERT_DIGEST_LINES_MAX 100
+
+StringBuffer alert_digest = {0};
+char alert_digest_subject[256]; // Of the first alert, which is sent as is if it turns out to be the only one
+size_t alert_digest_count = 0;
+int64_t alert_digest_until = 0;
+
+bool action_email_send_to(const char *to, const char *topic, const char *content, const int64_t timeout_ms) {
     char subject[256];
     snprintf(subject, sizeof(subject), "%s: %s", emailConfig.subject, topic);
-    if (!email_send(emailConfig.smtp, emailConfig.username, emailConfig.password, emailConfig.use_ssl, emailConfig.name, emailConfig.from, emailConfig.to, subject, content))
+    if (!email_send(emailConfig.smtp, emailConfig.username, emailConfig.password, emailConfig.use_ssl, emailConfig.name, emailConfig.from, to, subject, content,
+                    (long)timeout_ms))
+        return false;
+    printf("email: send notification issued, to '%s'\n", to);
+    return true;
+}
+bool action_email_send(const char *topic, const char *content, const int64_t timeout_ms) {
+    if (strlen(emailConfig.to) == 0 || strlen(emailConfig.smtp) == 0)
+        return true;
+    return action_email_send_to(emailConfig.to, topic, content, timeout_ms);
+}
+// Dispatch handler for alerts: sends to the recipients within their rate limit
+bool action_email_send_limited(const void *context __attribute__((unused)), const char *topic, const char *content, const int64_t timeout_ms) {
+    if (emailConfig.rate_limit <= 0)
+        return action_email_send(topic, content, timeout_ms);
+    const int64_t now = time_monotonic_ms();
+    const double limit = (double)emailConfig.rate_limit;
+    string_buffer_reset(&email_limited_to);
+    string_buffer_reset(&email_limited_content);
+    bool result = string_buffer_printf(&email_limited_content, "%s", content);
+    for (int i = 0; i < email_recipients_count; i++) {
+        EmailRecipient *recipient = &email_recipients[i];
+        recipient->tokens += (double)(now - recipient->refilled) * limit / (double)emailConfig.rate_period_ms;
+        if (recipient->tokens > limit)
+            recipient->tokens = limit;
+        recipient->refilled = now;
+        if (!(recipient->selected = recipient->tokens >= 1.0)) {
+            recipient->withheld++;
+            email_withheld++;
+            continue;
+        }
+        result = result && string_buffer_printf(&email_limited_to, "%s%s", email_limited_to.length > 0 ? ", " : "", recipient->address);
+        if (recipient->withheld > 0)
+            result = result && string_buffer_printf(&email_limited_content, "\n(%lu earlier notifications to %s were withheld by the rate limit)", recipient->withheld,
+                                                    recipient->address);
+    }
+    if (!result) {
+        fprintf(stderr, "email: failed to allocate notification\n");
+        return false;
+    }
+    if (email_limited_to.length == 0) {
+        if (alertConfig.debug)
+            printf("email: notification withheld by rate limit, '%s'\n", topic);
+        return true;
+    }
+    if (!action_email_send_to(email_limited_to.data, topic, email_limited_content.data, timeout_ms))
         return false;
-    printf("email: send notification issued, to '%s'\n", emailConfig.to);
+    for (int i = 0; i < email_recipients_count; i++)
+        if (email_recipients[i].selected) {
+            email_recipients[i].tokens -= 1.0;
+            email_recipients[i].withheld = 0;
+        }
+    return true;
+}
+// One at a time, in order: the session and the rate limit state are not shared between sends
+DispatchTarget action_email_target = {.name = "email", .handler = action_email_send_limited, .concurrency = 1};
+
+bool action_email_notification(const char *topic, const char *content) { return action_email_send(topic, content, alertConfig.timeout_ms); }
+bool action_email_alert(const char *topic, const char *content) {
+    if (strlen(emailConfig.to) == 0 || strlen(emailConfig.smtp) == 0)
+        return true;
+    return dispatch_submit(&action_email_target, topic, content);
+}
+// Sends the digest once its window has closed (or regardless, at exit)
+void action_email_digest_flush(const int64_t now, const bool force) {
+    if (alert_digest_count == 0 || (now < alert_digest_until && !force))
+        return;
+    if (alert_digest_count == 1)
+        action_email_alert(alert_digest_subject, "");
+    else {
+        char subject[64];
+        snprintf(subject, sizeof(subject), "Alert digest (%zu alerts)", alert_digest_count);
+        if (alert_digest_count > ALERT_DIGEST_LINES_MAX)
+            string_buffer_printf(&alert_digest, "... and %zu more\n", alert_digest_count - ALERT_DIGEST_LINES_MAX);
+        action_email_alert(subject, alert_digest.data);
+    }
+    string_buffer_reset(&alert_digest);
+    alert_digest_count = 0;
+}
+bool action_email_digest_deadline(int64_t *deadline) {
+    if (alert_digest_count == 0)
+        return false;
+    *deadline = alert_digest_until;
     return true;
 }
+void action_email_digest(const char *subject, const char *line, const int64_t now) {
+    if (alert_digest_ms <= 0) {
+        action_email_alert(subject, "");
+        return;
+    }
+    if (alert_digest_count == 0) {
+        snprintf(alert_digest_subject, sizeof(alert_digest_subject), "%s", subject);
+        alert_digest_until = now + alert_digest_ms;
+    }
+    if (alert_digest_count++ < ALERT_DIGEST_LINES_MAX && !string_buffer_printf(&alert_digest, "%s\n", line))
+        fprintf(stderr, "email: failed to allocate digest\n");
+}
 bool action_email_config(void) {
     emailConfig.smtp = config_get_string("email-smtp", EMAIL_SMTP_DEFAULT);
     emailConfig.username = config_get_string("email-username", EMAIL_USERNAME_DEFAULT);
@@ -98,266 +474,3011 @@ bool action_email_config(void) {
     emailConfig.from = config_get_string("email-from", EMAIL_NAME_DEFAULT);
     emailConfig.to = config_get_string("email-to", EMAIL_TO_DEFAULT);
     emailConfig.subject = config_get_string("email-subject", EMAIL_SUBJECT_DEFAULT);
+    emailConfig.rate_limit = config_get_integer("email-rate-limit", EMAIL_RATE_LIMIT_DEFAULT);
+    emailConfig.rate_period_ms = config_get_duration_ms("email-rate-period", EMAIL_RATE_PERIOD_DEFAULT * 1000);
+    if (emailConfig.rate_limit > 0 && emailConfig.rate_period_ms <= 0) {
+        fprintf(stderr, "email: invalid rate period\n");
+        return false;
+    }
+    if (emailConfig.rate_limit > 0)
+        printf("email: rate limit %d per %gs per recipient\n", emailConfig.rate_limit, (double)emailConfig.rate_period_ms / 1000.0);
+    return true;
+}
+bool action_email_begin(void) {
+    if (emailConfig.rate_limit <= 0)
+        return true;
+    const int64_t now = time_monotonic_ms();
+    for (const char *to = emailConfig.to; *to != '\0';) {
+        while (*to == ',' || isspace((unsigned char)*to))
+            to++;
+        size_t length = strcspn(to, ",");
+        const char *next = to + length;
+        while (length > 0 && isspace((unsigned char)to[length - 1]))
+            length--;
+        if (length > 0) {
+            EmailRecipient *recipients = realloc(email_recipients, (size_t)(email_recipients_count + 1) * sizeof(EmailRecipient));
+            if (recipients != NULL)
+                email_recipients = recipients;
+            char *address = strndup(to, length);
+            if (recipients == NULL || address == NULL) {
+                fprintf(stderr, "email: failed to allocate recipients\n");
+                free(address);
+                return false;
+            }
+            email_recipients[email_recipients_count++] = (EmailRecipient){.address = address, .tokens = (double)emailConfig.rate_limit, .refilled = now};
+        }
+        to = next;
+    }
     return true;
 }
-bool action_email_begin(void) { return true; }
-void action_email_end(void) {}
+void action_email_end(void) {
+    email_end();
+    for (int i = 0; i < email_recipients_count; i++)
+        free(email_recipients[i].address);
+    free(email_recipients);
+    email_recipients = NULL;
+    email_recipients_count = 0;
+    string_buffer_free(&email_limited_to);
+    string_buffer_free(&email_limited_content);
+    string_buffer_free(&alert_digest);
+}
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
 #include "include/systemd_linux.h"
 
+SystemdConfig systemdConfig;
+volatile unsigned long action_systemd_results[SYSTEMD_RESTART_RESULTS] = {0};
+
+// A restart that did not happen is alerted on, as the alert sent with it said it would
+void action_systemd_service_restarted(const char *service_name, const systemd_restart_result_t result, const char *detail) {
+    char subject[384];
+    action_systemd_results[result]++;
+    switch (result) {
+    case SYSTEMD_RESTART_DONE:
+        printf("systemd: service restarted, for '%s'\n", service_name);
+        break;
+    case SYSTEMD_RESTART_SKIPPED:
+        printf("systemd: service restart skipped, for '%s' (already %s)\n", service_name, detail);
+        break;
+    default:
+        fprintf(stderr, "systemd: service restart %s, for '%s' (%s)\n", systemd_restart_result_names[result], service_name, detail);
+        snprintf(subject, sizeof(subject), "Alert service '%s' restart %s (%s)", service_name, systemd_restart_result_names[result], detail);
+        action_email_alert(subject, "");
+        break;
+    }
+}
 bool action_systemd_service_restart(const char *service_name) {
     if (strlen(service_name) == 0)
         return true;
     if (!systemd_service_restart(service_name))
         return false;
-    printf("systemd: service restarted, for '%s'\n", service_name);
+    if (systemdConfig.debug)
+        printf("systemd: service restart requested, for '%s'\n", service_name);
+    return true;
+}
+bool action_systemd_config(void) {
+    systemdConfig.timeout_ms = config_get_duration_ms("systemd-timeout", SYSTEMD_TIMEOUT_DEFAULT * 1000);
+    systemdConfig.handler = action_systemd_service_restarted;
+    systemdConfig.debug = config_get_bool("debug", false);
     return true;
 }
-bool action_systemd_config(void) { return true; }
-bool action_systemd_begin(void) { return true; }
-void action_systemd_end(void) {}
+bool action_systemd_begin(void) { return systemd_begin(&systemdConfig); }
+void action_systemd_end(void) { systemd_end(); }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-#define MAX_TOPICS 32
+#include "include/spawn_linux.h"
+#include "include/webhook_linux.h"
+
+// Action backends ("action.N.name" and "action.N.type") are named, and run by escalation levels alongside notify and
+// restart, e.g. 'topic.0.level.2.actions=notify+page'. They run on the alert workers, at most "action.N.concurrency" at a
+// time each, given "action.N.timeout" (default 'alert-timeout'), and are retried like alerts when they fail:
+//   exec     "action.N.command", run by /bin/sh with the alert's subject and detail as $1 and $2
+//   publish  to "action.N.topic" (retained if "action.N.retain") on "action.N.broker", a JSON object of action, subject and detail
+//   webhook  POST of the same JSON to "action.N.url"
+typedef enum { ACTION_BACKEND_EXEC, ACTION_BACKEND_PUBLISH, ACTION_BACKEND_WEBHOOK, ACTION_BACKEND_TYPES } action_backend_type_t;
+const char *action_backend_type_names[ACTION_BACKEND_TYPES] = {"exec", "publish", "webhook"};
+const char *action_backend_arguments[ACTION_BACKEND_TYPES] = {"command", "topic", "url"};
+
 typedef struct {
-    const char *topic;             // MQTT topic to monitor
-    const char *service_name;      // Systemd service name (can be NULL)
-    time_t warning_seconds;        // Level 1 (notification) threshold in seconds
-    time_t restart_seconds;        // Level 2 (restart) threshold in seconds
-    time_t last_message;           // Timestamp of last received message
-    bool warned;                   // Flag to track if warning has been sent
-    bool restarted;                // Flag to track if service has been restarted
-                                   //
-    unsigned long level1_timeouts; // Level 1 timeout count
-    unsigned long level2_timeouts; // Level 2 timeout count
-    time_t level1_timelast;        // Level 1 timestamp last
-    time_t level2_timelast;        // Level 2 timestamp last
-} TopicMonitor;
-TopicMonitor topic_monitors[MAX_TOPICS];
-int topic_monitor_count = 0;
-bool topic_debug = false;
-unsigned long topic_level1_timeouts = 0, topic_level2_timeouts = 0;
+    const char *name;
+    action_backend_type_t type;
+    const char *argument; // Command, topic or URL
+    bool retain;          // Publish retained
+    MqttClient *mqtt;     // Publish to
+    DispatchTarget target;
+} ActionBackend;
 
-void topic_receive_message(const char *topic) {
-    for (int i = 0; i < topic_monitor_count; i++) {
-        TopicMonitor *monitor = &topic_monitors[i];
-        if (strcmp(monitor->topic, topic) == 0) {
-            monitor->last_message = time(NULL);
-            if (topic_debug)
-                printf("topic: message received for '%s'\n", topic);
-            break;
-        }
+ActionBackend *action_backends = NULL;
+size_t action_backend_count = 0;
+
+bool action_backend_handler(const void *context, const char *subject, const char *content, const int64_t timeout_ms) {
+    const ActionBackend *backend = (const ActionBackend *)context;
+    char detail[256] = "";
+    bool result;
+    if (backend->type == ACTION_BACKEND_EXEC) {
+        const char *argv[] = {"/bin/sh", "-c", backend->argument, "mqtt-watchdog", subject, content, NULL};
+        result = spawn_run(argv, timeout_ms, detail, sizeof(detail));
+    } else {
+        StringBuffer body = {0};
+        result = string_buffer_printf(&body, "{\"action\":") && string_buffer_json_string(&body, backend->name) && string_buffer_printf(&body, ",\"subject\":") &&
+                 string_buffer_json_string(&body, subject) && string_buffer_printf(&body, ",\"detail\":") && string_buffer_json_string(&body, content) &&
+                 string_buffer_printf(&body, "}");
+        if (!result)
+            snprintf(detail, sizeof(detail), "failed to allocate body");
+        else if (backend->type == ACTION_BACKEND_PUBLISH) {
+            if (!(result = mqtt_publish(backend->mqtt, backend->argument, body.data, body.length, backend->retain)))
+                snprintf(detail, sizeof(detail), "publish failed");
+        } else
+            result = webhook_post(backend->argument, "application/json", body.data, body.length, timeout_ms, detail, sizeof(detail));
+        string_buffer_free(&body);
     }
+    if (result)
+        printf("action: %s '%s' done, for '%s'\n", action_backend_type_names[backend->type], backend->name, subject);
+    else
+        fprintf(stderr, "action: %s '%s' failed, for '%s' (%s)\n", action_backend_type_names[backend->type], backend->name, subject, detail);
+    return result;
 }
-bool topic_process(void) {
-    char subject[256];
-    const time_t now = time(NULL);
-    for (int i = 0; i < topic_monitor_count; i++) {
-        TopicMonitor *monitor = &topic_monitors[i];
-        const time_t seconds_since_last = now - monitor->last_message;
-        // Level 2
-        if (seconds_since_last >= monitor->restart_seconds && !monitor->restarted) {
-            printf("topic: restart threshold exceeded for '%s' (%ld seconds)\n", monitor->topic, seconds_since_last);
-            snprintf(subject, sizeof(subject), "Alert '%s' level-2 timeout (%ld seconds) [notify+restart]", monitor->topic, seconds_since_last);
-            action_email_notification(subject, "");
-            action_systemd_service_restart(monitor->service_name);
-            monitor->warned = true;
-            monitor->restarted = true;
-            monitor->level2_timeouts++;
-            monitor->level2_timelast = now;
-            topic_level2_timeouts++;
-        }
-        // Level 1
-        else if (seconds_since_last >= monitor->warning_seconds && !monitor->warned) {
-            printf("topic: warning threshold exceeded for '%s' (%ld seconds)\n", monitor->topic, seconds_since_last);
-            snprintf(subject, sizeof(subject), "Alert '%s' level-1 timeout (%ld seconds) [notify]", monitor->topic, seconds_since_last);
-            action_email_notification(subject, "");
-            monitor->warned = true;
-            monitor->level1_timeouts++;
-            monitor->level1_timelast = now;
-            topic_level1_timeouts++;
-        }
-        if (seconds_since_last < monitor->warning_seconds)
-            monitor->warned = monitor->restarted = false;
-    }
-    return true;
-}
-bool topic_stats_to_string(char *buffer, size_t size) {
-    size_t offset = (size_t)snprintf(buffer, size, "L1=%lu, L2=%lu: ", topic_level1_timeouts, topic_level2_timeouts);
-    for (int i = 0; i < topic_monitor_count; i++) {
-        TopicMonitor *monitor = &topic_monitors[i];
-        offset += (size_t)snprintf(buffer + offset, size - offset, "%s%s", (i == 0 ? "" : ", "), monitor->topic);
-        if (monitor->level1_timeouts > 0 || monitor->level2_timeouts > 0) {
-            offset += (size_t)snprintf(buffer + offset, size - offset, " (");
-            if (monitor->level1_timeouts > 0) {
-                offset += (size_t)snprintf(buffer + offset, size - offset, "L1=%lu/", monitor->level1_timeouts);
-                offset += (size_t)strftime(buffer + offset, size - offset, "%Y-%m-%dT%H:%M:%S", localtime(&monitor->level1_timelast));
-            }
-            if (monitor->level2_timeouts > 0) {
-                if (monitor->level1_timeouts > 0)
-                    offset += (size_t)snprintf(buffer + offset, size - offset, ", ");
-                offset += (size_t)snprintf(buffer + offset, size - offset, "L2=%lu/", monitor->level2_timeouts);
-                offset += (size_t)strftime(buffer + offset, size - offset, "%Y-%m-%dT%H:%M:%S", localtime(&monitor->level2_timelast));
-            }
-            offset += (size_t)snprintf(buffer + offset, size - offset, ")");
-        }
-        if (offset >= size - 1) {
-            buffer[size - 1] = '\0';
-            return false;
+ActionBackend *action_backend_find(const char *name, const size_t length) {
+    for (size_t i = 0; i < action_backend_count; i++)
+        if (strlen(action_backends[i].name) == length && strncmp(action_backends[i].name, name, length) == 0)
+            return &action_backends[i];
+    return NULL;
+}
+bool action_backend_run(ActionBackend *backend, const char *subject, const char *content) { return dispatch_submit(&backend->target, subject, content); }
+DispatchTarget *action_backend_target(const size_t index) { return index == 0 ? &action_email_target : &action_backends[index - 1].target; }
+// Email alerts are included, as the built in action; names are checked at load to need no escaping
+bool action_backend_metrics_render(StringBuffer *buffer) {
+    bool result = string_buffer_printf(buffer, "# TYPE mqtt_watchdog_action_runs counter\n");
+    for (size_t index = 0; index <= action_backend_count && result; index++) {
+        const DispatchTarget *target = action_backend_target(index);
+        const DispatchTargetStats stats = dispatch_target_stats_get(target);
+        result = string_buffer_printf(buffer, "mqtt_watchdog_action_runs_total{action=\"%s\",result=\"done\"} %lu\n", target->name, stats.completed) &&
+                 string_buffer_printf(buffer, "mqtt_watchdog_action_runs_total{action=\"%s\",result=\"failed\"} %lu\n", target->name, stats.failed);
+    }
+    result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_action_duration_seconds histogram\n");
+    for (size_t index = 0; index <= action_backend_count && result; index++) {
+        const DispatchTarget *target = action_backend_target(index);
+        const DispatchTargetStats stats = dispatch_target_stats_get(target);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < POW2_HISTOGRAM_BUCKETS && result; i++) {
+            cumulative += atomic_load_explicit(&stats.latency.counts[i], memory_order_relaxed);
+            if (i + 1 < POW2_HISTOGRAM_BUCKETS)
+                result = string_buffer_printf(buffer, "mqtt_watchdog_action_duration_seconds_bucket{action=\"%s\",le=\"%.3f\"} %" PRIu64 "\n", target->name,
+                                              (double)(UINT64_C(1) << i) / 1000.0, cumulative);
+            else
+                result = string_buffer_printf(buffer, "mqtt_watchdog_action_duration_seconds_bucket{action=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", target->name, cumulative);
         }
+        result = result && string_buffer_printf(buffer, "mqtt_watchdog_action_duration_seconds_count{action=\"%s\"} %" PRIu64 "\n", target->name, cumulative) &&
+                 string_buffer_printf(buffer, "mqtt_watchdog_action_duration_seconds_sum{action=\"%s\"} %.3f\n", target->name,
+                                      (double)atomic_load_explicit(&stats.latency.sum, memory_order_relaxed) / 1000.0);
     }
-    return true;
+    return result;
 }
-bool topic_config(void) {
-    char buffer[64];
-    topic_monitor_count = 0;
-    topic_debug = config_get_bool("debug", false);
-    const time_t now = time(NULL);
-    for (size_t i = 0; i < MAX_TOPICS; i++) {
-        snprintf(buffer, sizeof(buffer), "topic.%d.name", (int)i);
-        const char *topic = config_get_string(buffer, NULL);
-        if (topic == NULL)
-            continue;
-        TopicMonitor *monitor = &topic_monitors[topic_monitor_count];
-        monitor->topic = topic;
-        snprintf(buffer, sizeof(buffer), "topic.%d.service", (int)i);
-        monitor->service_name = config_get_string(buffer, SERVICE_NAME_DEFAULT);
-        snprintf(buffer, sizeof(buffer), "topic.%d.warning", (int)i);
-        monitor->warning_seconds = (time_t)config_get_integer(buffer, TOPIC_TIMEOUT_LEVEL1_DEFAULT);
-        snprintf(buffer, sizeof(buffer), "topic.%d.restart", (int)i);
-        monitor->restart_seconds = (time_t)config_get_integer(buffer, TOPIC_TIMEOUT_LEVEL2_DEFAULT);
-        monitor->last_message = now;
-        monitor->warned = false;
-        monitor->restarted = false;
-        monitor->level1_timeouts = 0;
-        monitor->level2_timeouts = 0;
-        monitor->level1_timelast = 0;
-        monitor->level2_timelast = 0;
-        printf("topic: monitoring '%s' (warning=%lds, restart=%lds, service=%s)\n", monitor->topic, monitor->warning_seconds, monitor->restart_seconds,
-               monitor->service_name ? monitor->service_name : "n/a");
-        if (++topic_monitor_count >= MAX_TOPICS) {
-            printf("watchdog: maximum number of topics (%d) reached\n", MAX_TOPICS);
-            return false;
-        }
-    }
-    if (topic_monitor_count == 0) {
-        fprintf(stderr, "topic: none configured for monitoring\n");
-        return false;
+bool action_backend_stats_to_string(StringBuffer *buffer) {
+    bool result = true;
+    for (size_t index = 0; index <= action_backend_count && result; index++) {
+        const DispatchTarget *target = action_backend_target(index);
+        const DispatchTargetStats stats = dispatch_target_stats_get(target);
+        const unsigned long runs = stats.completed + stats.failed;
+        result = string_buffer_printf(buffer, "%s%s done=%lu, failed=%lu, mean=%gs", index > 0 ? "; " : "", target->name, stats.completed, stats.failed,
+                                      runs > 0 ? (double)atomic_load_explicit(&stats.latency.sum, memory_order_relaxed) / (double)runs / 1000.0 : 0.0);
     }
-    return true;
+    return result;
 }
-bool topic_begin(void) {
-    if (!action_email_notification("Startup", "")) {
-        fprintf(stderr, "topic: failed send startup email\n");
+bool action_backend_config(void) {
+    config_section_t section;
+    const int *indices;
+    const size_t count = config_get_array("action", "name", &indices);
+    action_backend_count = 0;
+    if (count > 0 && (action_backends = calloc(count, sizeof(ActionBackend))) == NULL) {
+        fprintf(stderr, "action: failed to allocate memory for %zu backends\n", count);
         return false;
     }
-    if (!mqtt_message_callback_register(topic_receive_message))
-        return false;
-    for (int i = 0; i < topic_monitor_count; i++) {
-        TopicMonitor *monitor = &topic_monitors[i];
-        if (!mqtt_subscribe(monitor->topic)) {
-            fprintf(stderr, "topic: failed to subscribe to '%s'\n", monitor->topic);
+    for (size_t n = 0; n < count; n++) {
+        const int i = indices[n];
+        config_section(&section, NULL, "action", i);
+        const char *name = config_section_get_string(&section, "name", "");
+        if (name[0] == '\0' || strcspn(name, "+,:\"\\ \t\n") != strlen(name) || strcmp(name, "notify") == 0 || strcmp(name, "restart") == 0 ||
+            action_backend_find(name, strlen(name)) != NULL) {
+            fprintf(stderr, "action: invalid or duplicate name '%s' (action.%d)\n", name, i);
+            return false;
+        }
+        ActionBackend *backend = &action_backends[action_backend_count];
+        const char *type = config_section_get_string(&section, "type", "");
+        for (backend->type = 0; backend->type < ACTION_BACKEND_TYPES && strcmp(type, action_backend_type_names[backend->type]) != 0; backend->type++)
+            ;
+        if (backend->type == ACTION_BACKEND_TYPES) {
+            fprintf(stderr, "action: invalid type '%s', of exec, publish or webhook (action.%d)\n", type, i);
             return false;
         }
+        if ((backend->argument = config_section_get_string(&section, action_backend_arguments[backend->type], NULL)) == NULL || backend->argument[0] == '\0') {
+            fprintf(stderr, "action: %s needs '%s' (action.%d)\n", type, section.key, i);
+            return false;
+        }
+        backend->retain = config_section_get_bool(&section, "retain", false);
+        const int broker = mqtt_broker_find(config_section_get_string(&section, "broker", NULL));
+        if (broker < 0) {
+            fprintf(stderr, "action: unknown broker '%s' (action.%d)\n", config_section_get_string(&section, "broker", ""), i);
+            return false;
+        }
+        backend->mqtt = mqtt_broker_client(broker);
+        const int concurrency = config_section_get_integer(&section, "concurrency", ACTION_CONCURRENCY_DEFAULT);
+        const int64_t timeout_ms = config_section_get_duration_ms(&section, "timeout", 0);
+        if (concurrency < 1 || timeout_ms < 0) {
+            fprintf(stderr, "action: invalid concurrency or timeout (action.%d)\n", i);
+            return false;
+        }
+        backend->name = name;
+        backend->target = (DispatchTarget){.name = name, .handler = action_backend_handler, .context = backend, .concurrency = (size_t)concurrency, .timeout_ms = timeout_ms};
+        action_backend_count++;
+        printf("action: %s '%s' (%s=%s, concurrency=%d, timeout=%gs)\n", type, name, action_backend_arguments[backend->type], backend->argument, concurrency,
+               (double)timeout_ms / 1000.0);
     }
     return true;
 }
-void topic_end(void) {
-    mqtt_message_callback_cancel();
-    for (int i = 0; i < topic_monitor_count; i++) {
-        TopicMonitor *monitor = &topic_monitors[i];
-        mqtt_unsubscribe(monitor->topic);
-    }
+void action_backend_end(void) {
+    free(action_backends);
+    action_backends = NULL;
+    action_backend_count = 0;
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------
 // -----------------------------------------------------------------------------------------------------------------------------------------
 
-time_t report_period, report_last = 0;
+// Payload predicates ("topic.N.require"), all of which a message must satisfy to count as a sign of life, for example
+//   topic.0.require=status == "ok"; ts within 30s
+// Clauses are '<field> <op> <value>' separated by ';', where field is a dotted path into a JSON payload and op is one of
+// == != < <= > >= (against a number, string, or true/false/null) or 'within' (the field is a timestamp, epoch seconds or
+// milliseconds or ISO 8601, that must be within the given duration of now). They are checked on the network thread for
+// every message, so evaluation works directly on the payload without allocating.
+#define TOPIC_REQUIRE_MAX 8
 
-const struct option config_options[] = {{"config", required_argument, 0, 0},      // config
-                                        {"mqtt-client", required_argument, 0, 0}, // mqtt
-                                        {"mqtt-server", required_argument, 0, 0},
-                                        {"email-name", required_argument, 0, 0}, // email
-                                        {"email-from", required_argument, 0, 0},
-                                        {"email-to", required_argument, 0, 0},
-                                        {"email-subject", required_argument, 0, 0},
-                                        {"email-smtp", required_argument, 0, 0},
-                                        {"email-username", required_argument, 0, 0},
-                                        {"email-password", required_argument, 0, 0},
-                                        {"email-use-ssl", required_argument, 0, 0},
-                                        {"report-period", required_argument, 0, 0}, // report
-                                        {"debug", required_argument, 0, 0},         // debug
-                                        {0, 0, 0, 0}};
+typedef enum { PREDICATE_EQ, PREDICATE_NE, PREDICATE_LT, PREDICATE_LE, PREDICATE_GT, PREDICATE_GE, PREDICATE_WITHIN } predicate_op_t;
+typedef struct {
+    const char *field; // Dotted path of the field
+    predicate_op_t op;
+    json_type_t type;  // Operand type: JSON_STRING, JSON_NUMBER, JSON_TRUE, JSON_FALSE or JSON_NULL
+    const char *value; // Operand, for a string
+    size_t length;     // Operand length, for a string
+    double number;     // Operand, for a number
+    int64_t within_ms; // Operand, for 'within'
+} TopicPredicate;
+typedef struct {
+    char *storage; // Copy of the configuration, holding the field and operand strings
+    size_t count;
+    TopicPredicate predicates[TOPIC_REQUIRE_MAX];
+} TopicRequire;
 
-bool config(int argc, char *argv[]) {
-    if (!config_load(CONFIG_FILE_DEFAULT, argc, argv, config_options))
+const char *topic_predicate_ops[] = {"==", "!=", "<=", ">=", "<", ">", "within"};
+const predicate_op_t topic_predicate_op_codes[] = {PREDICATE_EQ, PREDICATE_NE, PREDICATE_LE, PREDICATE_GE, PREDICATE_LT, PREDICATE_GT, PREDICATE_WITHIN};
+
+bool topic_predicate_parse(TopicPredicate *predicate, char *clause) {
+    while (isspace((unsigned char)*clause))
+        clause++;
+    predicate->field = clause;
+    while (*clause != '\0' && !isspace((unsigned char)*clause) && strchr("=!<>", *clause) == NULL)
+        clause++;
+    char *field_end = clause;
+    while (isspace((unsigned char)*clause))
+        clause++;
+    size_t op = 0;
+    while (op < sizeof(topic_predicate_ops) / sizeof(topic_predicate_ops[0]) && strncmp(clause, topic_predicate_ops[op], strlen(topic_predicate_ops[op])) != 0)
+        op++;
+    if (field_end == predicate->field || op == sizeof(topic_predicate_ops) / sizeof(topic_predicate_ops[0]))
         return false;
-    report_period = (time_t)config_get_integer("report-period", REPORT_PERIOD_DEFAULT);
-    printf("report-period=%ld\n", report_period);
-    return mqtt_config() && topic_config() && action_email_config() && action_systemd_config();
+    predicate->op = topic_predicate_op_codes[op];
+    clause += strlen(topic_predicate_ops[op]);
+    *field_end = '\0';
+    while (isspace((unsigned char)*clause))
+        clause++;
+    char *end = clause + strlen(clause);
+    while (end > clause && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    if (predicate->op == PREDICATE_WITHIN)
+        return config_parse_duration_ms(clause, &predicate->within_ms);
+    if (end - clause >= 2 && *clause == '"' && end[-1] == '"') {
+        predicate->type = JSON_STRING;
+        predicate->value = clause + 1;
+        predicate->length = (size_t)(end - clause - 2);
+    } else if (strcmp(clause, "true") == 0 || strcmp(clause, "false") == 0 || strcmp(clause, "null") == 0) {
+        predicate->type = *clause == 't' ? JSON_TRUE : *clause == 'f' ? JSON_FALSE : JSON_NULL;
+        if (predicate->op != PREDICATE_EQ && predicate->op != PREDICATE_NE)
+            return false;
+    } else if (json_number(clause, (size_t)(end - clause), &predicate->number))
+        predicate->type = JSON_NUMBER;
+    else if (end > clause) {
+        predicate->type = JSON_STRING;
+        predicate->value = clause;
+        predicate->length = (size_t)(end - clause);
+    } else
+        return false;
+    return true;
 }
-bool startup(void) {
-    curl_global_init(CURL_GLOBAL_ALL);
-    return mqtt_begin(&mqttConfig) && action_email_begin() && action_systemd_begin() && topic_begin();
+TopicRequire *topic_require_parse(const char *string) {
+    TopicRequire *require = calloc(1, sizeof(TopicRequire));
+    if (require == NULL || (require->storage = strdup(string)) == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for require\n");
+        free(require);
+        return NULL;
+    }
+    char *saveptr = NULL;
+    for (char *clause = strtok_r(require->storage, ";", &saveptr); clause != NULL; clause = strtok_r(NULL, ";", &saveptr)) {
+        if (is_empty_or_comment(clause))
+            continue;
+        if (require->count >= TOPIC_REQUIRE_MAX || !topic_predicate_parse(&require->predicates[require->count], clause)) {
+            fprintf(stderr, "topic: invalid require '%s' (clauses are '<field> <op> <value>', at most %d)\n", string, TOPIC_REQUIRE_MAX);
+            free(require->storage);
+            free(require);
+            return NULL;
+        }
+        require->count++;
+    }
+    return require;
 }
-void cleanup(void) {
-    topic_end();
-    action_systemd_end();
-    action_email_end();
-    mqtt_end();
-    curl_global_cleanup();
+void topic_require_free(TopicRequire *require) {
+    if (require == NULL)
+        return;
+    free(require->storage);
+    free(require);
 }
-bool process(void) {
-    mqtt_poll();
-    const bool result = topic_process();
-    if (intervalable(report_period, &report_last)) {
-        char string[1024];
-        if (topic_stats_to_string(string, sizeof(string)))
-            printf("report: %s\n", string);
+
+// Epoch seconds or milliseconds (told apart by magnitude), or ISO 8601 as 'YYYY-MM-DDTHH:MM:SS[.fff][Z|+hh:mm|-hh:mm]'
+bool topic_predicate_timestamp(const JsonField *field, int64_t *timestamp_ms) {
+    if (field->type == JSON_NUMBER) {
+        double number;
+        if (!json_number(field->value, field->length, &number))
+            return false;
+        *timestamp_ms = (int64_t)(number > 1e11 ? number : number * 1000.0);
+        return true;
     }
-    return result;
+    char buffer[48];
+    if (field->type != JSON_STRING || field->length >= sizeof(buffer))
+        return false;
+    memcpy(buffer, field->value, field->length);
+    buffer[field->length] = '\0';
+    int year, month, day, hour, minute, second, consumed = 0;
+    if (sscanf(buffer, "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month, &day, &hour, &minute, &second, &consumed) != 6 || consumed == 0)
+        return false;
+    struct tm tm = {.tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day, .tm_hour = hour, .tm_min = minute, .tm_sec = second};
+    const char *rest = buffer + consumed;
+    int64_t fraction_ms = 0, scale = 100;
+    if (*rest == '.')
+        for (rest++; isdigit((unsigned char)*rest); rest++, scale /= 10)
+            fraction_ms += (*rest - '0') * scale;
+    int64_t offset_ms = 0;
+    if (*rest == '+' || *rest == '-') {
+        int hours, minutes;
+        if (sscanf(rest + 1, "%2d:%2d", &hours, &minutes) != 2)
+            return false;
+        offset_ms = ((int64_t)hours * 60 + minutes) * 60 * 1000 * (*rest == '+' ? 1 : -1);
+    } else if (*rest != 'Z' && *rest != '\0')
+        return false;
+    *timestamp_ms = (int64_t)timegm(&tm) * 1000 + fraction_ms - offset_ms;
+    return true;
+}
+bool topic_predicate_check(const TopicPredicate *predicate, const JsonField *field) {
+    if (field->type == JSON_NONE)
+        return false;
+    if (predicate->op == PREDICATE_WITHIN) {
+        int64_t timestamp_ms;
+        return topic_predicate_timestamp(field, &timestamp_ms) && llabs(time_realtime_ms() - timestamp_ms) <= predicate->within_ms;
+    }
+    int compare;
+    if (predicate->type == JSON_NUMBER) {
+        double number;
+        if (field->type != JSON_NUMBER || !json_number(field->value, field->length, &number))
+            return predicate->op == PREDICATE_NE;
+        compare = (number > predicate->number) - (number < predicate->number);
+    } else if (predicate->type == JSON_STRING) {
+        if (field->type != JSON_STRING)
+            return predicate->op == PREDICATE_NE;
+        const int common = memcmp(field->value, predicate->value, field->length < predicate->length ? field->length : predicate->length);
+        compare = common != 0 ? common : (field->length > predicate->length) - (field->length < predicate->length);
+    } else
+        compare = field->type == predicate->type ? 0 : 1;
+    switch (predicate->op) {
+    case PREDICATE_EQ:
+        return compare == 0;
+    case PREDICATE_NE:
+        return compare != 0;
+    case PREDICATE_LT:
+        return compare < 0;
+    case PREDICATE_LE:
+        return compare <= 0;
+    case PREDICATE_GT:
+        return compare > 0;
+    case PREDICATE_GE:
+        return compare >= 0;
+    default:
+        return false;
+    }
+}
+bool topic_require_check(const TopicRequire *require, const char *payload, const size_t length) {
+    JsonField fields[TOPIC_REQUIRE_MAX];
+    for (size_t i = 0; i < require->count; i++)
+        fields[i].path = require->predicates[i].field;
+    if (!json_scan_fields(payload, length, fields, require->count))
+        return false;
+    for (size_t i = 0; i < require->count; i++)
+        if (!topic_predicate_check(&require->predicates[i], &fields[i]))
+            return false;
+    return true;
 }
 
-// -----------------------------------------------------------------------------------------------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------------------------
+// Message rate bounds ("topic.N.min-rate", "topic.N.max-rate", in messages per second) over a time-decayed estimate with a
+// time constant of "topic.N.rate-window"; a rate out of bounds for the warning or restart threshold escalates as silence does
+typedef struct {
+    double min;        // Minimum messages per second (0 = none)
+    double max;        // Maximum messages per second (0 = none)
+    int64_t window_ms; // Estimate time constant (0 = rate not monitored)
+} TopicRateLimits;
 
-#define PROCESS_INTERVAL 5
-volatile bool running = true;
+// Adaptive thresholds ("topic.N.adaptive"): after a warm-up, the first level's threshold becomes a quantile of the topic's
+// recent inter-arrival times scaled by a factor, no lower than a floor, and the other levels keep their configured ratio
+// to it. The configured thresholds apply during the warm-up and remain the ceilings, so adapting only ever tightens them.
+typedef struct {
+    double quantile;  // Inter-arrival quantile (0 = not adaptive)
+    double factor;    // Multiplier from quantile to warning
+    int64_t floor_ms; // Minimum warning threshold
+    uint32_t warmup;  // Inter-arrival samples needed before adapting
+} TopicAdaptive;
 
-void signal_handler(const int sig __attribute__((unused))) {
-    if (running) {
-        printf("stopping\n");
-        running = false;
+// Escalation ladder ("topic.N.level.K.after", ".actions" and ".repeat", K from 1): level K is reached once the topic has
+// been silent (or its rate out of bounds) for 'after', when its actions run, and for silence they run again every 'repeat'
+// while the topic stays there. Without levels the ladder is "warning" (notify) then "restart" (notify+restart). A ladder
+// is compiled once at load and shared by every topic configured or discovered from that entry, so moving up one is a
+// table lookup.
+#define TOPIC_LEVELS_MAX 8
+#define TOPIC_ACTIONS_MAX 8
+
+typedef enum { TOPIC_ACTION_NOTIFY, TOPIC_ACTION_RESTART, TOPIC_ACTION_BACKEND } topic_action_t;
+typedef struct {
+    topic_action_t type;
+    char *unit;             // For restart, the unit (NULL = the topic's service)
+    ActionBackend *backend; // For an action backend
+} TopicAction;
+typedef struct {
+    int64_t after_ms;  // Threshold, from the last message (or the start of a rate violation)
+    int64_t repeat_ms; // Interval to run the actions again while at this level (0 = once)
+    size_t action_count;
+    TopicAction actions[TOPIC_ACTIONS_MAX];
+    char name[64];  // Actions as written in alerts, e.g. "notify+restart"
+    bool restarted; // This or a lower level restarts, for the published state
+} TopicLevel;
+typedef struct {
+    size_t count;
+    TopicLevel levels[TOPIC_LEVELS_MAX];
+} TopicLadder;
+
+// Everything configured per topic, and inherited by topics discovered under a pattern
+typedef struct {
+    const char *service_name; // Systemd service name (can be NULL)
+    TopicRequire *require;    // Payload predicates a message must satisfy (can be NULL)
+    TopicRateLimits rate;     // Message rate bounds
+    TopicAdaptive adaptive;   // Adaptive thresholds
+    TopicLadder *ladder;      // Escalation levels
+} TopicSettings;
+
+typedef struct {
+    const char *topic;                           // MQTT topic to monitor
+    size_t topic_length;                         // Length of topic (precomputed)
+    uint32_t topic_hash;                         // Hash of topic (precomputed)
+    int pattern;                                 // Wildcard pattern it was discovered under (owns topic), -1 if configured
+    int broker;                                  // Broker it is monitored on (mqtt_brokers)
+    uint32_t subscription;                       // Identifier it is subscribed with, if configured (0 for none)
+    const char *service_name;                    // Systemd service name (can be NULL)
+    TopicRequire *require;                       // Payload predicates a message must satisfy (can be NULL)
+    _Atomic(unsigned long) messages;             // Messages accepted
+    _Atomic(unsigned long) rejected;             // Messages not satisfying the predicates
+    int64_t escalated_last;                      // Last message timestamp as of the last escalation
+    int64_t repeat_at;                           // When the current level's actions run again (0 = not repeating)
+    TopicRateLimits rate;                        // Message rate bounds
+    int64_t rate_started;                        // Start of the rate estimate
+    int64_t rate_violated;                       // Since when the rate has been out of bounds (0 = in bounds)
+    uint8_t rate_level;                          // Level reached for the current rate violation
+    TopicAdaptive adaptive;                      // Adaptive thresholds
+    const TopicLadder *ladder;                   // Escalation levels (owned by the configuration entry)
+    bool adapted;                                // Thresholds have been adapted at least once
+    _Atomic(bool) seen;                          // A message has been accepted, so the next one gives an interval
+    uint8_t status;                              // State last published (TOPIC_STATUS_UNKNOWN before the first)
+    bool status_dirty;                           // Queued in topic_status_dirty for publishing
+                                                 //
+    unsigned long escalations[TOPIC_LEVELS_MAX]; // Escalation count by level
+    time_t escalated_time[TOPIC_LEVELS_MAX];     // Escalation timestamp last by level
+} TopicMonitor;
+TopicMonitor *topic_monitors = NULL;
+size_t topic_monitor_count = 0, topic_monitor_capacity = 0;
+
+// Hot state is kept out of TopicMonitor (which holds the cold names, service and counters) in parallel cache line aligned
+// arrays indexed as topic_monitors: the timestamp is the only thing the receiving threads write per message, and deadline
+// processing reads only these. A timestamp publishes nothing else with it, so relaxed atomics make the handoff race-free.
+// Times are CLOCK_MONOTONIC milliseconds.
+_Atomic(int64_t) *topic_last_message = NULL; // Timestamp of last received message
+double *topic_scale = NULL;                  // Scale of the ladder's thresholds, 1 unless adapted, read on every deadline
+uint8_t *topic_level = NULL;                 // Level reached since the last message (0 = none)
+_Atomic(double) *topic_rate = NULL;          // Decayed message rate sum as of the last message, see rate_ewma_event
+LogHistogram *topic_intervals = NULL;        // Inter-arrival times, for adaptive thresholds (NULL if none are adaptive)
+Pow2Histogram *topic_histograms = NULL;      // Inter-arrival times, for metrics (NULL unless topic_histograms_enabled)
+bool topic_histograms_enabled = false;
+
+// Health published back to MQTT under "status-prefix" (if set), all retained: "<prefix>/status" is "online" or "offline"
+// (the Last Will), "<prefix>/topic/<topic>" the state and counters of each topic, and "<prefix>/summary" the totals. Topic
+// state is published only when it changes, queued as it does and sent once per processing pass followed by one summary, so
+// broker load follows the rate of change rather than the number of topics.
+#define TOPIC_STATUS_UNKNOWN 0xFF
+const char *topic_status_prefix = NULL;
+uint32_t *topic_status_dirty = NULL;
+size_t topic_status_dirty_count = 0, topic_status_counts[3] = {0};
+bool topic_status_summary_dirty = false;
+StringBuffer topic_status_name = {0}, topic_status_payload = {0};
+
+// Each topic has one deadline: when it next needs looking at. Messages do not move deadlines, which keeps the receive path
+// to a single store; a deadline found stale on expiry is instead pushed out to the one recomputed from the latest message.
+// Both the queue and the wake condition are under topic_lock; the network thread signals after adding a discovered topic.
+// Rate-monitored topics have a second deadline, for sampling the estimate a few times per window.
+#define TOPIC_RATE_CHECKS_PER_WINDOW 8
+DeadlineQueue topic_deadlines, topic_rate_deadlines;
+pthread_cond_t topic_wake;
+
+// A broker outage silences every topic on it at once, so rather than escalate each one (and restart services that are
+// fine), their deadlines are frozen while disconnected and one broker alert is raised once that has lasted broker_alert_ms.
+// On reconnect, topic ages are credited with the outage, and escalation resumes only after broker_grace_ms, for
+// subscriptions and publishers to settle. Startup counts as disconnected until the first connect. Topics on other brokers
+// carry on regardless: a frozen topic's deadline is dropped while its broker is down and put back at the resumption.
+#define TOPIC_PROBE_WINDOW 64    // Probes whose send times are kept
+#define TOPIC_PROBE_LEVELS_MAX 4
+typedef struct {
+    bool up, alerted;
+    unsigned long generation, outages;
+    int64_t lost;                    // When the connection was (last) found lost
+    int64_t resume;                  // When escalation resumes after reconnecting
+    unsigned long status_generation; // Connect generation last republished to
+    // Round trip probe (see topic_probe_check): answers are taken by the receiving threads, the rest is the main thread's
+    _Atomic(uint32_t) probe_sequence;        // Of the last probe sent
+    _Atomic(uint32_t) probe_answered;        // Latest received back
+    int64_t probe_sent[TOPIC_PROBE_WINDOW];  // Send times, by sequence
+    int64_t probe_next;                      // When the next is due
+    int64_t probe_delay;                     // As of the last check
+    size_t probe_level;                      // Alert level reached
+    _Atomic(int64_t) probe_rtt;              // Of the latest received back
+    _Atomic(unsigned long) probe_received;   // Received back
+    Pow2Histogram probe_histogram;           // Round trip times, for export
+    LogHistogram probe_quantiles;            // Round trip times, for reporting
+} TopicBroker;
+int64_t topic_broker_alert_ms, topic_broker_grace_ms;
+TopicBroker *topic_brokers = NULL; // As mqtt_brokers
+unsigned long topic_broker_outages = 0; // Total, kept across restarts in the state file
+pthread_mutex_t topic_lock = PTHREAD_MUTEX_INITIALIZER;
+bool topic_debug = false;
+unsigned long topic_escalations[TOPIC_LEVELS_MAX] = {0};
+size_t topic_levels = 0; // Most levels in any ladder
+
+// Actions are separated by ',' or '+', each 'notify', 'restart' (the topic's service), 'restart:<unit>' or the name of an
+// action backend
+bool topic_level_parse(TopicLevel *level, const char *actions) {
+    level->action_count = 0;
+    level->name[0] = '\0';
+    while (*actions != '\0') {
+        while (*actions == ',' || *actions == '+' || isspace((unsigned char)*actions))
+            actions++;
+        size_t length = strcspn(actions, ",+");
+        const char *next = actions + length;
+        while (length > 0 && isspace((unsigned char)actions[length - 1]))
+            length--;
+        if (length == 0) {
+            actions = next;
+            continue;
+        }
+        if (level->action_count == TOPIC_ACTIONS_MAX)
+            return false;
+        TopicAction *action = &level->actions[level->action_count];
+        action->unit = NULL;
+        action->backend = NULL;
+        if (length == 6 && strncmp(actions, "notify", 6) == 0)
+            action->type = TOPIC_ACTION_NOTIFY;
+        else if (length == 7 && strncmp(actions, "restart", 7) == 0)
+            action->type = TOPIC_ACTION_RESTART;
+        else if (length > 8 && strncmp(actions, "restart:", 8) == 0) {
+            action->type = TOPIC_ACTION_RESTART;
+            if ((action->unit = strndup(actions + 8, length - 8)) == NULL)
+                return false;
+        } else if ((action->backend = action_backend_find(actions, length)) != NULL)
+            action->type = TOPIC_ACTION_BACKEND;
+        else
+            return false;
+        level->action_count++;
+        const size_t used = strlen(level->name);
+        snprintf(level->name + used, sizeof(level->name) - used, "%s%.*s", used > 0 ? "+" : "", (int)length, actions);
+        actions = next;
     }
+    return level->action_count > 0;
 }
-
-int main(int argc, char *argv[]) {
-    setbuf(stdout, NULL);
-    printf("starting\n");
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    if (!config(argc, argv))
-        return EXIT_FAILURE;
-    if (!startup()) {
-        cleanup();
-        return EXIT_FAILURE;
+void topic_ladder_free(TopicLadder *ladder) {
+    if (ladder == NULL)
+        return;
+    for (size_t i = 0; i < ladder->count; i++)
+        for (size_t j = 0; j < ladder->levels[i].action_count; j++)
+            free(ladder->levels[i].actions[j].unit);
+    free(ladder);
+}
+// Compiles the ladder of topic.N (the section), from its levels if it has any, otherwise from its warning and restart thresholds
+TopicLadder *topic_ladder_config(config_section_t *topic, const int i) {
+    config_section_t section;
+    TopicLadder *ladder = calloc(1, sizeof(TopicLadder));
+    if (ladder == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for ladder\n");
+        return NULL;
     }
-    while (running) {
-        if (!process()) {
-            cleanup();
-            return EXIT_FAILURE;
+    const int *indices;
+    const size_t levels = config_section_get_array(topic, "level", "after", &indices);
+    const int count = levels > 0 ? indices[levels - 1] + 1 : 0;
+    if (count > TOPIC_LEVELS_MAX + 1 || (levels > 0 && indices[0] == 0)) {
+        fprintf(stderr, "topic: levels must be numbered from 1 to at most %d (topic.%d)\n", TOPIC_LEVELS_MAX, i);
+        free(ladder);
+        return NULL;
+    }
+    if (count == 0) {
+        ladder->levels[0].after_ms = config_section_get_duration_ms(topic, "warning", TOPIC_TIMEOUT_LEVEL1_DEFAULT * 1000);
+        ladder->levels[1].after_ms = config_section_get_duration_ms(topic, "restart", TOPIC_TIMEOUT_LEVEL2_DEFAULT * 1000);
+        ladder->count = 2;
+        topic_level_parse(&ladder->levels[0], "notify");
+        topic_level_parse(&ladder->levels[1], "notify+restart");
+        if (ladder->levels[0].after_ms <= 0 || ladder->levels[1].after_ms <= ladder->levels[0].after_ms) {
+            fprintf(stderr, "topic: invalid warning or restart, which must follow it (topic.%d)\n", i);
+            topic_ladder_free(ladder);
+            return NULL;
         }
-        for (int i = 0; i < PROCESS_INTERVAL && running; i++)
-            sleep(1);
     }
+    for (int k = 1; k < count; k++) {
+        TopicLevel *level = &ladder->levels[ladder->count];
+        config_section(&section, topic, "level", k);
+        level->after_ms = config_section_get_duration_ms(&section, "after", 0);
+        level->repeat_ms = config_section_get_duration_ms(&section, "repeat", 0);
+        const char *actions = config_section_get_string(&section, "actions", "notify");
+        const bool parsed = topic_level_parse(level, actions);
+        ladder->count++; // so that whatever was parsed is freed
+        if (!parsed || level->after_ms <= (k > 1 ? level[-1].after_ms : 0) || level->repeat_ms < 0) {
+            fprintf(stderr, "topic: invalid level %d, needs a threshold above the previous level's and valid actions (topic.%d)\n", k, i);
+            topic_ladder_free(ladder);
+            return NULL;
+        }
+    }
+    for (size_t k = 0; k < ladder->count; k++) {
+        TopicLevel *level = &ladder->levels[k];
+        level->restarted = k > 0 && level[-1].restarted;
+        for (size_t j = 0; j < level->action_count; j++)
+            level->restarted |= level->actions[j].type == TOPIC_ACTION_RESTART;
+    }
+    return ladder;
+}
+bool topic_ladder_to_string(StringBuffer *buffer, const TopicLadder *ladder) {
+    bool result = true;
+    for (size_t k = 0; k < ladder->count && result; k++) {
+        const TopicLevel *level = &ladder->levels[k];
+        result = string_buffer_printf(buffer, "%s%gs %s", k > 0 ? ", " : "", (double)level->after_ms / 1000.0, level->name);
+        if (level->repeat_ms > 0)
+            result = result && string_buffer_printf(buffer, " every %gs", (double)level->repeat_ms / 1000.0);
+    }
+    return result;
+}
+
+// Open addressing (linear probe) index from topic to monitor, sized to a power of two at least twice the number of
+// topics to keep probe runs short. Slots carry the hash so that collisions are mostly rejected without touching the string.
+// A topic is the same only on the same broker, so its hash is salted with the broker's number (unchanged on the first).
+typedef struct {
+    uint32_t hash;
+    uint32_t index; // monitor index + 1, 0 when the slot is empty
+} TopicIndexSlot;
+TopicIndexSlot *topic_index = NULL;
+size_t topic_index_mask = 0;
+
+bool topic_index_begin(const size_t count) {
+    size_t capacity = 2;
+    while (capacity < count * 2)
+        capacity <<= 1;
+    topic_index = calloc(capacity, sizeof(TopicIndexSlot));
+    if (topic_index == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for index\n");
+        return false;
+    }
+    topic_index_mask = capacity - 1;
+    return true;
+}
+uint32_t topic_hash(const uint32_t hash, const int broker) { return hash ^ ((uint32_t)broker * 0x9E3779B1u); }
+TopicMonitor *topic_index_find(const int broker, const char *topic, const uint32_t hash, const size_t length) {
+    for (size_t slot = hash & topic_index_mask; topic_index[slot].index != 0; slot = (slot + 1) & topic_index_mask)
+        if (topic_index[slot].hash == hash) {
+            TopicMonitor *monitor = &topic_monitors[topic_index[slot].index - 1];
+            if (monitor->topic_length == length && monitor->broker == broker && memcmp(monitor->topic, topic, length) == 0)
+                return monitor;
+        }
+    return NULL;
+}
+void topic_index_insert(const uint32_t hash, const size_t index) {
+    size_t slot = hash & topic_index_mask;
+    while (topic_index[slot].index != 0)
+        slot = (slot + 1) & topic_index_mask;
+    topic_index[slot].hash = hash;
+    topic_index[slot].index = (uint32_t)index + 1;
+}
+void topic_index_remove(const TopicMonitor *monitor) {
+    const uint32_t index = (uint32_t)(monitor - topic_monitors) + 1;
+    size_t slot = monitor->topic_hash & topic_index_mask;
+    while (topic_index[slot].index != index)
+        slot = (slot + 1) & topic_index_mask;
+    // Backward shift deletion: pull later members of the probe run into the hole so lookups never need tombstones
+    for (size_t next = (slot + 1) & topic_index_mask; topic_index[next].index != 0; next = (next + 1) & topic_index_mask) {
+        const size_t home = topic_index[next].hash & topic_index_mask;
+        const bool stays = (slot < next) ? (home > slot && home <= next) : (home > slot || home <= next);
+        if (!stays) {
+            topic_index[slot] = topic_index[next];
+            slot = next;
+        }
+    }
+    topic_index[slot].hash = 0;
+    topic_index[slot].index = 0;
+}
+void topic_index_end(void) {
+    free(topic_index);
+    topic_index = NULL;
+    topic_index_mask = 0;
+}
+
+// Wildcard patterns ('+' and '#') do not map to a monitor directly: each concrete topic that arrives under one is given
+// its own monitor on first sight, inheriting the pattern's thresholds and service, up to a cap per pattern and overall.
+typedef struct {
+    const char *pattern;       // MQTT wildcard subscription
+    int broker;                // Broker it is subscribed on
+    uint32_t subscription;     // Identifier it is subscribed with (0 for none)
+    TopicSettings settings;    // Settings inherited by discovered topics
+    size_t discover_max;       // Maximum concurrently discovered topics
+    size_t discovered;         // Currently discovered topics
+    unsigned long evicted;     // Discovered topics evicted to make room
+    unsigned long dropped;     // Topics not monitored because no room could be made
+} TopicPattern;
+TopicPattern *topic_patterns = NULL;
+size_t topic_pattern_count = 0;
+
+bool topic_is_pattern(const char *topic) { return strpbrk(topic, "+#") != NULL; }
+
+// Topic-level trie of the patterns: one node per level, with '+' and '#' held on the node and literal levels held in an
+// open addressing edge table keyed by (parent, level), so that wide fan-out costs no more to traverse than narrow. Each
+// broker's patterns have their own root, node N for broker N.
+typedef struct {
+    int plus;    // Child node for a '+' level, -1 if none
+    int pattern; // Pattern ending at this node, -1 if none
+    int multi;   // Pattern ending with a '#' level beneath this node, -1 if none
+} TopicTrieNode;
+typedef struct {
+    uint32_t hash;
+    int parent;
+    int child; // 0 when the slot is empty (roots are never children)
+    const char *level;
+    size_t length;
+} TopicTrieEdge;
+TopicTrieNode *topic_trie_nodes = NULL;
+size_t topic_trie_node_count = 0;
+TopicTrieEdge *topic_trie_edges = NULL;
+size_t topic_trie_edge_mask = 0;
+
+size_t topic_trie_levels(const char *pattern) {
+    size_t levels = 1;
+    while ((pattern = strchr(pattern, '/')) != NULL)
+        levels++, pattern++;
+    return levels;
+}
+int topic_trie_node_new(void) {
+    TopicTrieNode *node = &topic_trie_nodes[topic_trie_node_count];
+    node->plus = node->pattern = node->multi = -1;
+    return (int)topic_trie_node_count++;
+}
+bool topic_trie_begin(const size_t levels, const size_t roots) {
+    size_t capacity = 2;
+    while (capacity < levels * 2)
+        capacity <<= 1;
+    topic_trie_nodes = malloc((levels + roots) * sizeof(TopicTrieNode));
+    topic_trie_edges = calloc(capacity, sizeof(TopicTrieEdge));
+    if (topic_trie_nodes == NULL || topic_trie_edges == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for pattern trie\n");
+        return false;
+    }
+    topic_trie_edge_mask = capacity - 1;
+    topic_trie_node_count = 0;
+    for (size_t i = 0; i < roots; i++)
+        topic_trie_node_new();
+    return true;
+}
+int topic_trie_child(const int parent, const char *level, const size_t length, const bool create) {
+    const uint32_t hash = hash_bytes(level, length) ^ ((uint32_t)parent * 0x9E3779B1u);
+    size_t slot = hash & topic_trie_edge_mask;
+    for (; topic_trie_edges[slot].child != 0; slot = (slot + 1) & topic_trie_edge_mask) {
+        const TopicTrieEdge *edge = &topic_trie_edges[slot];
+        if (edge->hash == hash && edge->parent == parent && edge->length == length && memcmp(edge->level, level, length) == 0)
+            return edge->child;
+    }
+    if (!create)
+        return -1;
+    const int child = topic_trie_node_new();
+    topic_trie_edges[slot] = (TopicTrieEdge){.hash = hash, .parent = parent, .child = child, .level = level, .length = length};
+    return child;
+}
+// Fails for a malformed pattern (a wildcard sharing a level, '#' other than last) or one already present
+bool topic_trie_insert(const int root, const char *pattern, const int index) {
+    int node = root;
+    for (const char *level = pattern;;) {
+        const char *slash = strchr(level, '/');
+        const size_t length = slash ? (size_t)(slash - level) : strlen(level);
+        if (length == 1 && *level == '#') {
+            if (slash != NULL || topic_trie_nodes[node].multi >= 0)
+                return false;
+            topic_trie_nodes[node].multi = index;
+            return true;
+        }
+        if (length == 1 && *level == '+') {
+            if (topic_trie_nodes[node].plus < 0) {
+                const int child = topic_trie_node_new();
+                topic_trie_nodes[node].plus = child;
+            }
+            node = topic_trie_nodes[node].plus;
+        } else if (memchr(level, '+', length) != NULL || memchr(level, '#', length) != NULL)
+            return false;
+        else
+            node = topic_trie_child(node, level, length, true);
+        if (slash == NULL)
+            break;
+        level = slash + 1;
+    }
+    if (topic_trie_nodes[node].pattern >= 0)
+        return false;
+    topic_trie_nodes[node].pattern = index;
+    return true;
+}
+// Literal levels are preferred over '+', and '+' over '#', so the most specific pattern wins; per MQTT, wildcards in the
+// first level do not match topics starting with '$'
+int topic_trie_match(const int node, const char *level, const bool first) {
+    if (level == NULL)
+        return topic_trie_nodes[node].pattern >= 0 ? topic_trie_nodes[node].pattern : topic_trie_nodes[node].multi;
+    const char *slash = strchr(level, '/');
+    const size_t length = slash ? (size_t)(slash - level) : strlen(level);
+    const char *next = slash ? slash + 1 : NULL;
+    int index;
+    const int child = topic_trie_child(node, level, length, false);
+    if (child >= 0 && (index = topic_trie_match(child, next, false)) >= 0)
+        return index;
+    if (first && *level == '$')
+        return -1;
+    if (topic_trie_nodes[node].plus >= 0 && (index = topic_trie_match(topic_trie_nodes[node].plus, next, false)) >= 0)
+        return index;
+    return topic_trie_nodes[node].multi;
+}
+void topic_trie_end(void) {
+    free(topic_trie_nodes);
+    topic_trie_nodes = NULL;
+    topic_trie_node_count = 0;
+    free(topic_trie_edges);
+    topic_trie_edges = NULL;
+    topic_trie_edge_mask = 0;
+}
+
+// With MQTT v5, each configured topic and pattern is subscribed with an identifier that the broker returns on the messages
+// matching it, mapped here to the monitor (from 0) or pattern (from -2, as -2 - index), so that a configured topic's
+// message is found by indexing rather than by hashing and comparing its topic, and a pattern's goes to discovery without
+// walking the trie. A pattern that some other on its broker overlaps is not mapped, as the most specific must win. A
+// subscription carried over a reload is not made again, so keeps its identifier, and identifiers are never reused: one
+// since removed (or given by a 3.1.1 broker, 0) maps to nothing, and its message is matched by topic. The map changes only
+// while messages are held off.
+int32_t *topic_subscriptions = NULL;
+size_t topic_subscription_count = 0;
+uint32_t topic_subscription_next = 1;
+
+uint32_t topic_subscription_assign(const int broker) {
+    return mqtt_brokers[broker].v5 && topic_subscription_next <= MQTT_SUBSCRIPTION_IDENTIFIER_MAX ? topic_subscription_next++ : 0;
+}
+// Whether any topic matches both patterns; '#' also matches its parent level
+bool topic_patterns_overlap(const char *a, const char *b) {
+    for (;;) {
+        if (*a == '#' || *b == '#')
+            return true;
+        const size_t la = strcspn(a, "/"), lb = strcspn(b, "/");
+        if (!(la == 1 && *a == '+') && !(lb == 1 && *b == '+') && (la != lb || memcmp(a, b, la) != 0))
+            return false;
+        a += la, b += lb;
+        if (*a == '\0' || *b == '\0')
+            return *a == *b || strcmp(*a != '\0' ? a : b, "/#") == 0;
+        a++, b++;
+    }
+}
+void topic_subscriptions_build(void) {
+    int32_t *subscriptions = realloc(topic_subscriptions, topic_subscription_next * sizeof(int32_t));
+    if (subscriptions == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for subscription identifiers, matching by topic\n");
+        topic_subscription_count = 0;
+        return;
+    }
+    topic_subscriptions = subscriptions;
+    topic_subscription_count = topic_subscription_next;
+    for (size_t i = 0; i < topic_subscription_count; i++)
+        topic_subscriptions[i] = -1;
+    for (size_t i = 0; i < topic_monitor_count; i++)
+        if (topic_monitors[i].pattern < 0 && topic_monitors[i].subscription != 0)
+            topic_subscriptions[topic_monitors[i].subscription] = (int32_t)i;
+    for (size_t i = 0; i < topic_pattern_count; i++) {
+        bool overlapped = false;
+        for (size_t j = 0; j < topic_pattern_count && !overlapped; j++)
+            overlapped = j != i && topic_patterns[j].broker == topic_patterns[i].broker && topic_patterns_overlap(topic_patterns[i].pattern, topic_patterns[j].pattern);
+        if (topic_patterns[i].subscription != 0 && !overlapped)
+            topic_subscriptions[topic_patterns[i].subscription] = -2 - (int32_t)i;
+    }
+}
+void topic_subscriptions_end(void) {
+    free(topic_subscriptions);
+    topic_subscriptions = NULL;
+    topic_subscription_count = 0;
+}
+
+// A level's threshold as currently scaled
+int64_t topic_threshold(const size_t index, const size_t level) { return (int64_t)((double)topic_monitors[index].ladder->levels[level].after_ms * topic_scale[index]); }
+uint8_t topic_state(const size_t index) { return topic_level[index] > topic_monitors[index].rate_level ? topic_level[index] : topic_monitors[index].rate_level; }
+// The published state is the class of the level reached: ok, warning, or restarted once a level restarting the service is reached
+uint8_t topic_state_class(const size_t index, const uint8_t state) {
+    return state == 0 ? 0 : topic_monitors[index].ladder->levels[state - 1].restarted ? 2 : 1;
+}
+const char *topic_state_name(const uint8_t state) { return state == 2 ? "restarted" : state == 1 ? "warning" : "ok"; }
+// These run under topic_lock, which also covers the buffers
+void topic_status_check(const size_t index) {
+    TopicMonitor *monitor = &topic_monitors[index];
+    if (topic_status_prefix == NULL || monitor->status_dirty || monitor->status == topic_state(index))
+        return;
+    monitor->status_dirty = true;
+    topic_status_dirty[topic_status_dirty_count++] = (uint32_t)index;
+}
+bool topic_status_topic(const char *suffix, const char *topic) {
+    string_buffer_reset(&topic_status_name);
+    return string_buffer_printf(&topic_status_name, "%s/%s%s", topic_status_prefix, suffix, topic != NULL ? topic : "");
+}
+void topic_status_clear(const size_t index) {
+    TopicMonitor *monitor = &topic_monitors[index];
+    if (topic_status_prefix == NULL)
+        return;
+    if (monitor->status != TOPIC_STATUS_UNKNOWN) {
+        topic_status_counts[topic_state_class(index, monitor->status)]--;
+        topic_status_summary_dirty = true;
+    }
+    monitor->status = TOPIC_STATUS_UNKNOWN;
+    if (topic_status_topic("topic/", monitor->topic))
+        mqtt_publish(mqtt_broker_client(monitor->broker), topic_status_name.data, "", 0, true); // an empty retained message deletes it
+}
+// Everything on a broker is republished after each (re)connect to it, as publishes while disconnected are lost
+void topic_status_republish(const int broker) {
+    for (size_t index = 0; index < topic_monitor_count; index++) {
+        TopicMonitor *monitor = &topic_monitors[index];
+        if (monitor->broker != broker)
+            continue;
+        if (monitor->status != TOPIC_STATUS_UNKNOWN)
+            topic_status_counts[topic_state_class(index, monitor->status)]--;
+        monitor->status = TOPIC_STATUS_UNKNOWN;
+        topic_status_check(index);
+    }
+    topic_status_summary_dirty = true;
+}
+void topic_status_publish(const int64_t now) {
+    for (size_t i = 0; i < topic_status_dirty_count; i++) {
+        const uint32_t index = topic_status_dirty[i];
+        TopicMonitor *monitor = &topic_monitors[index];
+        const uint8_t state = topic_state(index);
+        monitor->status_dirty = false;
+        if (state == monitor->status)
+            continue;
+        if (monitor->status != TOPIC_STATUS_UNKNOWN)
+            topic_status_counts[topic_state_class(index, monitor->status)]--;
+        topic_status_counts[topic_state_class(index, state)]++;
+        monitor->status = state;
+        topic_status_summary_dirty = true;
+        string_buffer_reset(&topic_status_payload);
+        bool result = topic_status_topic("topic/", monitor->topic) &&
+                      string_buffer_printf(&topic_status_payload, "{\"state\":\"%s\",\"level\":%u,\"age\":%.3f,\"messages\":%lu,\"rejected\":%lu",
+                                           topic_state_name(topic_state_class(index, state)), state,
+                                           (double)(now - atomic_load_explicit(&topic_last_message[index], memory_order_relaxed)) / 1000.0,
+                                           atomic_load_explicit(&monitor->messages, memory_order_relaxed), atomic_load_explicit(&monitor->rejected, memory_order_relaxed));
+        for (size_t k = 0; k < monitor->ladder->count && result; k++)
+            result = string_buffer_printf(&topic_status_payload, ",\"l%zu\":%lu", k + 1, monitor->escalations[k]);
+        if (result && string_buffer_printf(&topic_status_payload, "}"))
+            mqtt_publish(mqtt_broker_client(monitor->broker), topic_status_name.data, topic_status_payload.data, topic_status_payload.length, true);
+    }
+    topic_status_dirty_count = 0;
+    if (topic_status_summary_dirty) {
+        topic_status_summary_dirty = false;
+        string_buffer_reset(&topic_status_payload);
+        bool result = topic_status_topic("summary", NULL) &&
+                      string_buffer_printf(&topic_status_payload, "{\"topics\":%zu,\"ok\":%zu,\"warning\":%zu,\"restarted\":%zu", topic_monitor_count,
+                                           topic_status_counts[0], topic_status_counts[1], topic_status_counts[2]);
+        for (size_t k = 0; k < topic_levels && result; k++)
+            result = string_buffer_printf(&topic_status_payload, ",\"l%zu\":%lu", k + 1, topic_escalations[k]);
+        // The summary covers every broker's topics, and is published to each
+        if (result && string_buffer_printf(&topic_status_payload, "}"))
+            for (size_t b = 0; b < mqtt_broker_count; b++)
+                mqtt_publish(mqtt_broker_client((int)b), topic_status_name.data, topic_status_payload.data, topic_status_payload.length, true);
+    }
+}
+
+// Monitor state is kept in a snapshot file ("state-file", if set) so that a restart resumes each topic where it left off:
+// its age, level, pending repeat, counters and escalation times. Message timestamps are the topic_last_message array itself,
+// mapped from the file, so the receive path is unchanged; the rest is written through to a record as it changes, and the
+// header's clock reference and totals once a second. Times are stored as CLOCK_MONOTONIC, and restored relative to when
+// the snapshot was last synced, so the time the watchdog was down counts towards no topic's age, as with a broker outage.
+// A snapshot is restored only if its version and layout match, and each record only to a topic still configured on the
+// same broker (or matching a pattern still configured there), with its level kept within the topic's current ladder.
+#include "include/snapshot_linux.h"
+
+#define TOPIC_SNAPSHOT_MAGIC 0x534D5754 // "TWMS"
+#define TOPIC_SNAPSHOT_VERSION 2
+#define TOPIC_SNAPSHOT_TOPIC_MAX 256
+#define TOPIC_SNAPSHOT_BROKER_MAX 64
+#define TOPIC_SNAPSHOT_SYNC_MS 1000
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t record_size, levels_max;
+    uint64_t capacity, count;                // Records (and timestamps) in the file, and in use
+    int64_t saved;                           // When last synced, which stored times are relative to
+    uint64_t escalations[TOPIC_LEVELS_MAX]; // Totals, as topic_escalations
+    uint64_t broker_outages;
+} TopicSnapshotHeader;
+typedef struct {
+    char topic[TOPIC_SNAPSHOT_TOPIC_MAX];   // Empty if not kept (the topic or broker name is too long)
+    char broker[TOPIC_SNAPSHOT_BROKER_MAX]; // Broker name
+    uint8_t discovered;
+    uint8_t level;
+    int64_t escalated_last;
+    int64_t repeat_at;
+    uint64_t messages, rejected;
+    uint64_t escalations[TOPIC_LEVELS_MAX];
+    int64_t escalated_time[TOPIC_LEVELS_MAX];
+} TopicSnapshotRecord;
+
+const char *topic_snapshot_path = NULL;
+Snapshot topic_snapshot = {0};
+TopicSnapshotHeader *topic_snapshot_header = NULL;
+TopicSnapshotRecord *topic_snapshot_records = NULL;
+int64_t topic_snapshot_synced = 0;
+
+// Header, then records, then the timestamps from a page boundary
+size_t topic_snapshot_layout(const size_t capacity, size_t *records, size_t *timestamps) {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    *records = (sizeof(TopicSnapshotHeader) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    *timestamps = (*records + capacity * sizeof(TopicSnapshotRecord) + page - 1) & ~(page - 1);
+    return *timestamps + ((capacity * sizeof(int64_t) + page - 1) & ~(page - 1));
+}
+// Under topic_lock, after any change to the monitor's level or counters
+void topic_snapshot_store(const size_t index) {
+    if (topic_snapshot_records == NULL)
+        return;
+    const TopicMonitor *monitor = &topic_monitors[index];
+    TopicSnapshotRecord *record = &topic_snapshot_records[index];
+    record->level = topic_level[index];
+    record->escalated_last = monitor->escalated_last;
+    record->repeat_at = monitor->repeat_at;
+    record->messages = atomic_load_explicit(&monitor->messages, memory_order_relaxed);
+    record->rejected = atomic_load_explicit(&monitor->rejected, memory_order_relaxed);
+    for (size_t k = 0; k < TOPIC_LEVELS_MAX; k++) {
+        record->escalations[k] = monitor->escalations[k];
+        record->escalated_time[k] = (int64_t)monitor->escalated_time[k];
+    }
+}
+void topic_snapshot_init(const size_t index) {
+    if (topic_snapshot_records == NULL)
+        return;
+    const TopicMonitor *monitor = &topic_monitors[index];
+    TopicSnapshotRecord *record = &topic_snapshot_records[index];
+    const char *broker = mqtt_brokers[monitor->broker].name;
+    if (monitor->topic_length < sizeof(record->topic) && strlen(broker) < sizeof(record->broker)) {
+        memcpy(record->topic, monitor->topic, monitor->topic_length + 1);
+        strcpy(record->broker, broker);
+    } else
+        record->topic[0] = record->broker[0] = '\0';
+    record->discovered = monitor->pattern >= 0;
+    if (topic_snapshot_header->count < index + 1)
+        topic_snapshot_header->count = index + 1;
+    topic_snapshot_store(index);
+}
+
+void topic_monitor_init(const size_t index, const int broker, const char *topic, const size_t length, const uint32_t hash, const int pattern,
+                        const TopicSettings *settings, const int64_t now) {
+    TopicMonitor *monitor = &topic_monitors[index];
+    monitor->topic = topic;
+    monitor->topic_length = length;
+    monitor->topic_hash = hash;
+    monitor->pattern = pattern;
+    monitor->broker = broker;
+    monitor->subscription = 0;
+    monitor->service_name = settings->service_name;
+    monitor->require = settings->require;
+    atomic_store_explicit(&monitor->messages, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->rejected, 0, memory_order_relaxed);
+    monitor->escalated_last = 0;
+    monitor->repeat_at = 0;
+    monitor->rate = settings->rate;
+    monitor->rate_started = now;
+    monitor->rate_violated = 0;
+    monitor->rate_level = 0;
+    monitor->adaptive = settings->adaptive;
+    monitor->ladder = settings->ladder;
+    monitor->adapted = false;
+    atomic_store_explicit(&monitor->seen, false, memory_order_relaxed);
+    monitor->status = TOPIC_STATUS_UNKNOWN;
+    memset(monitor->escalations, 0, sizeof(monitor->escalations));
+    memset(monitor->escalated_time, 0, sizeof(monitor->escalated_time));
+    topic_scale[index] = 1.0;
+    topic_level[index] = 0;
+    atomic_store_explicit(&topic_last_message[index], now, memory_order_relaxed);
+    atomic_store_explicit(&topic_rate[index], 0.0, memory_order_relaxed);
+    if (topic_intervals != NULL)
+        log_histogram_reset(&topic_intervals[index]);
+    if (topic_histograms != NULL)
+        pow2_histogram_reset(&topic_histograms[index]);
+    deadline_queue_set(&topic_deadlines, (uint32_t)index, now + settings->ladder->levels[0].after_ms);
+    // The first estimate is not sampled until a full window has passed, to let it settle
+    if (settings->rate.window_ms > 0)
+        deadline_queue_set(&topic_rate_deadlines, (uint32_t)index, now + settings->rate.window_ms);
+    else
+        deadline_queue_remove(&topic_rate_deadlines, (uint32_t)index);
+    topic_snapshot_init(index);
+    topic_status_check(index);
+}
+
+// A broker can be connected yet lagging, queueing messages for seconds so that every topic on it looks late at once. So
+// each connected broker is sent a heartbeat every probe_interval_ms, on the configured topic suffixed with the process's
+// own nonce (so that watchdogs sharing a broker do not hear each other), carrying its sequence number and send time; its
+// round trip back through our own subscription is the broker's delay. A probe not yet back counts for as long as it has
+// been out, so a broker that has stopped delivering shows a growing delay rather than the last good one, and one lost
+// outright is forgotten once a later one is back. Delay reaching a level alerts, once per level until it recovers below
+// the first, and with probe_stretch is added to the deadlines of the broker's topics.
+int64_t topic_probe_interval_ms = 0; // 0 if not probing
+int64_t topic_probe_levels[TOPIC_PROBE_LEVELS_MAX];
+size_t topic_probe_level_count = 0;
+bool topic_probe_stretch = false;
+char topic_probe_topic[CONFIG_MAX_STRING + 32];
+
+bool topic_probe_config(void) {
+    topic_probe_interval_ms = config_get_duration_ms("probe-interval", PROBE_INTERVAL_DEFAULT * 1000);
+    if (topic_probe_interval_ms <= 0) {
+        topic_probe_interval_ms = 0;
+        return true;
+    }
+    snprintf(topic_probe_topic, sizeof(topic_probe_topic), "%s/%x.%llx", config_get_string("probe-topic", PROBE_TOPIC_DEFAULT), (unsigned)getpid(),
+             (unsigned long long)time(NULL));
+    const char *levels = config_get_string("probe-levels", PROBE_LEVELS_DEFAULT);
+    char level[32];
+    for (const char *p = levels; *p != '\0';) {
+        const size_t length = strcspn(p, ",");
+        snprintf(level, sizeof(level), "%.*s", (int)length, p);
+        if (topic_probe_level_count == TOPIC_PROBE_LEVELS_MAX || !config_parse_duration_ms(level, &topic_probe_levels[topic_probe_level_count]) ||
+            (topic_probe_level_count > 0 && topic_probe_levels[topic_probe_level_count] <= topic_probe_levels[topic_probe_level_count - 1])) {
+            fprintf(stderr, "topic: invalid probe-levels '%s' (at most %d ascending durations)\n", levels, TOPIC_PROBE_LEVELS_MAX);
+            return false;
+        }
+        topic_probe_level_count++;
+        p += length + (p[length] == ',');
+    }
+    topic_probe_stretch = config_get_bool("probe-stretch", PROBE_STRETCH_DEFAULT);
+    printf("topic: probe every %gs on '%s' (levels=%s, stretch=%s)\n", (double)topic_probe_interval_ms / 1000.0, topic_probe_topic,
+           levels[0] != '\0' ? levels : "none", topic_probe_stretch ? "true" : "false");
+    return true;
+}
+// On a receiving thread, for a topic no monitor has: whether it is our probe topic, taking the answer if so
+bool topic_probe_receive(const int b, const char *topic, const char *payload, const size_t length) {
+    char text[64];
+    uint32_t sequence;
+    int64_t sent;
+    if (topic_probe_interval_ms == 0 || strcmp(topic, topic_probe_topic) != 0)
+        return false;
+    TopicBroker *broker = &topic_brokers[b];
+    const int64_t now = time_monotonic_ms();
+    snprintf(text, sizeof(text), "%.*s", (int)(length < sizeof(text) ? length : sizeof(text) - 1), payload);
+    if (sscanf(text, "%" SCNu32 " %" SCNd64, &sequence, &sent) != 2 || sent > now || sequence > atomic_load_explicit(&broker->probe_sequence, memory_order_relaxed))
+        return true;
+    const int64_t rtt = now - sent;
+    uint32_t answered = atomic_load_explicit(&broker->probe_answered, memory_order_relaxed);
+    while (answered < sequence &&
+           !atomic_compare_exchange_weak_explicit(&broker->probe_answered, &answered, sequence, memory_order_relaxed, memory_order_relaxed))
+        ;
+    atomic_store_explicit(&broker->probe_rtt, rtt, memory_order_relaxed);
+    atomic_fetch_add_explicit(&broker->probe_received, 1, memory_order_relaxed);
+    pow2_histogram_add(&broker->probe_histogram, (uint64_t)rtt);
+    log_histogram_add(&broker->probe_quantiles, (uint64_t)rtt);
+    if (topic_debug)
+        printf("topic: probe %" PRIu32 " back from '%s' in %" PRId64 "ms\n", sequence, mqtt_brokers[b].name, rtt);
+    return true;
+}
+// The latest round trip, or longer if the oldest probe not yet back (of those whose send times are kept) has been out longer
+int64_t topic_probe_delay(const TopicBroker *broker, const int64_t now) {
+    const uint32_t sequence = atomic_load_explicit(&broker->probe_sequence, memory_order_relaxed);
+    const uint32_t answered = atomic_load_explicit(&broker->probe_answered, memory_order_relaxed);
+    int64_t delay = atomic_load_explicit(&broker->probe_rtt, memory_order_relaxed);
+    if (answered < sequence) {
+        const uint32_t oldest = sequence - answered > TOPIC_PROBE_WINDOW ? sequence - TOPIC_PROBE_WINDOW + 1 : answered + 1;
+        if (now - broker->probe_sent[oldest % TOPIC_PROBE_WINDOW] > delay)
+            delay = now - broker->probe_sent[oldest % TOPIC_PROBE_WINDOW];
+    }
+    return delay;
+}
+// Under topic_lock: sends the broker's probe when due, and alerts on its delay reaching a level, or recovering
+void topic_probe_check(const int b, const int64_t now) {
+    char subject[192], label[96] = "", payload[64];
+    TopicBroker *broker = &topic_brokers[b];
+    if (topic_probe_interval_ms == 0 || !broker->up) {
+        broker->probe_delay = 0;
+        return;
+    }
+    if (now >= broker->probe_next) {
+        const uint32_t sequence = atomic_load_explicit(&broker->probe_sequence, memory_order_relaxed) + 1;
+        broker->probe_sent[sequence % TOPIC_PROBE_WINDOW] = now;
+        atomic_store_explicit(&broker->probe_sequence, sequence, memory_order_relaxed);
+        mqtt_send(mqtt_broker_client(b), topic_probe_topic, payload, snprintf(payload, sizeof(payload), "%" PRIu32 " %" PRId64, sequence, now));
+        broker->probe_next = now + topic_probe_interval_ms;
+    }
+    broker->probe_delay = topic_probe_delay(broker, now);
+    size_t level = 0;
+    while (level < topic_probe_level_count && broker->probe_delay >= topic_probe_levels[level])
+        level++;
+    if (mqtt_broker_count > 1)
+        snprintf(label, sizeof(label), " '%s'", mqtt_brokers[b].name);
+    if (level > broker->probe_level) {
+        snprintf(subject, sizeof(subject), "Alert broker%s round trip %g seconds (level %zu)", label, (double)broker->probe_delay / 1000.0, level);
+        printf("topic: broker%s round trip %gs, level %zu reached, alerting\n", label, (double)broker->probe_delay / 1000.0, level);
+        action_email_digest(subject, subject, now);
+        broker->probe_level = level;
+    } else if (level == 0 && broker->probe_level > 0) {
+        snprintf(subject, sizeof(subject), "Broker%s round trip recovered (%g seconds)", label, (double)broker->probe_delay / 1000.0);
+        printf("topic: broker%s round trip recovered (%gs)\n", label, (double)broker->probe_delay / 1000.0);
+        action_email_digest(subject, subject, now);
+        broker->probe_level = 0;
+    }
+}
+// How much later than configured a topic's deadlines fall, by its broker's delay
+int64_t topic_probe_stretch_ms(const int b) { return topic_probe_stretch ? topic_brokers[b].probe_delay : 0; }
+
+// Evict only discovered topics that have already escalated fully (so their alerts were delivered), stalest first; a
+// pattern of -1 considers the discovered topics of every pattern
+TopicMonitor *topic_discover_victim(const int pattern) {
+    TopicMonitor *victim = NULL;
+    int64_t victim_last_message = 0;
+    for (size_t i = 0; i < topic_monitor_count; i++) {
+        TopicMonitor *monitor = &topic_monitors[i];
+        if (monitor->pattern < 0 || (pattern >= 0 && monitor->pattern != pattern) || topic_level[i] < monitor->ladder->count)
+            continue;
+        const int64_t last_message = atomic_load_explicit(&topic_last_message[i], memory_order_relaxed);
+        if (victim == NULL || last_message < victim_last_message)
+            victim = monitor, victim_last_message = last_message;
+    }
+    return victim;
+}
+// Under topic_lock: the monitor a topic newly seen under the pattern would take, a free one or one to evict, NULL if none
+TopicMonitor *topic_discover_room(const int index) {
+    const TopicPattern *pattern = &topic_patterns[index];
+    if (pattern->discovered >= pattern->discover_max || topic_monitor_count >= topic_monitor_capacity)
+        return topic_discover_victim(pattern->discovered >= pattern->discover_max ? index : -1);
+    return &topic_monitors[topic_monitor_count];
+}
+// Under topic_lock: a topic seen under the pattern that there is no room for, taking ownership of its name
+void topic_discover_drop(const int index, char *name) {
+    TopicPattern *pattern = &topic_patterns[index];
+    if (pattern->dropped++ == 0 || topic_debug)
+        fprintf(stderr, "topic: discovery limit reached for '%s', not monitoring '%s'\n", pattern->pattern, name);
+    free(name);
+}
+// Under topic_lock, and (as it changes the monitor set) with the receive path held off: monitors a topic seen under the
+// pattern, taking ownership of its name
+TopicMonitor *__topic_discover(const int index, char *name, const uint32_t hash, const size_t length, const int64_t now) {
+    TopicPattern *pattern = &topic_patterns[index];
+    TopicMonitor *monitor = topic_discover_room(index);
+    if (monitor == NULL) {
+        topic_discover_drop(index, name);
+        return NULL;
+    }
+    if (monitor == &topic_monitors[topic_monitor_count])
+        topic_monitor_count++;
+    else {
+        if (topic_debug)
+            printf("topic: evicting '%s' for '%s'\n", monitor->topic, name);
+        topic_index_remove(monitor);
+        deadline_queue_remove(&topic_deadlines, (uint32_t)(monitor - topic_monitors));
+        topic_status_clear((size_t)(monitor - topic_monitors));
+        topic_patterns[monitor->pattern].discovered--;
+        topic_patterns[monitor->pattern].evicted++;
+        free((void *)(uintptr_t)monitor->topic);
+    }
+    topic_monitor_init((size_t)(monitor - topic_monitors), pattern->broker, name, length, hash, index, &pattern->settings, now);
+    topic_index_insert(hash, (size_t)(monitor - topic_monitors));
+    pattern->discovered++;
+    printf("topic: discovered '%s' under '%s'\n", name, pattern->pattern);
+    return monitor;
+}
+// Messages are received on as many threads as there are clients (see MqttWorker), each reading the index and monitors in
+// its own slot of topic_readers, so that lookups take no lock that another receiving thread writes to; the monitor set
+// and index change only here (but for a reload, during which messages are held off), with every reader held off. A topic
+// there is no room for holds off nobody, as it changes nothing. topic_lock keeps the main thread from sweeping a monitor
+// while it is being created or evicted.
+ReaderSlotLock topic_readers = {0};
+
+// Outside the caller's reader slot; the pattern is that the topic was received under, if known, else -1
+TopicMonitor *topic_discover(const int broker, const char *topic, const uint32_t hash, const size_t length, const int pattern) {
+    if (topic_pattern_count == 0)
+        return NULL;
+    const int index = pattern >= 0 ? pattern : topic_trie_match(broker, topic, true);
+    if (index < 0)
+        return NULL;
+    char *name = strdup(topic);
+    if (name == NULL)
+        return NULL;
+    pthread_mutex_lock(&topic_lock);
+    const int64_t now = time_monotonic_ms();
+    if (topic_discover_room(index) == NULL) {
+        topic_discover_drop(index, name);
+        pthread_mutex_unlock(&topic_lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&topic_lock);
+    reader_slot_write_enter(&topic_readers);
+    pthread_mutex_lock(&topic_lock);
+    // Another receiving thread may have got there first
+    TopicMonitor *monitor = topic_index_find(broker, topic, hash, length);
+    if (monitor != NULL)
+        free(name);
+    else if ((monitor = __topic_discover(index, name, hash, length, now)) != NULL)
+        pthread_cond_signal(&topic_wake);
+    pthread_mutex_unlock(&topic_lock);
+    reader_slot_write_leave(&topic_readers);
+    return monitor;
+}
+
+// In the receiving thread's reader slot. The same topic's messages may be taken by several receiving threads at once, so
+// every update is an atomic read-modify-write; the timestamp only ever moves forward, and is written at most once per
+// millisecond however high the rate, so a busy topic's line is mostly only read.
+void __topic_receive_message(TopicMonitor *monitor, const char *topic, const char *payload, const size_t payload_length) {
+    if (monitor->require != NULL && !topic_require_check(monitor->require, payload, payload_length)) {
+        atomic_fetch_add_explicit(&monitor->rejected, 1, memory_order_relaxed);
+        if (topic_debug)
+            printf("topic: message rejected for '%s' (require not satisfied)\n", topic);
+        return;
+    }
+    const size_t index = (size_t)(monitor - topic_monitors);
+    const int64_t now = time_monotonic_ms();
+    int64_t last_message = atomic_load_explicit(&topic_last_message[index], memory_order_relaxed);
+    const int64_t elapsed = now > last_message ? now - last_message : 0;
+    atomic_fetch_add_explicit(&monitor->messages, 1, memory_order_relaxed);
+    if (atomic_load_explicit(&monitor->seen, memory_order_relaxed)) {
+        if (monitor->adaptive.quantile > 0.0)
+            log_histogram_add(&topic_intervals[index], (uint64_t)elapsed);
+        if (topic_histograms != NULL)
+            pow2_histogram_add(&topic_histograms[index], (uint64_t)elapsed);
+    } else
+        atomic_store_explicit(&monitor->seen, true, memory_order_relaxed);
+    if (monitor->rate.window_ms > 0) {
+        double rate = atomic_load_explicit(&topic_rate[index], memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&topic_rate[index], &rate, rate_ewma_event(rate, elapsed, monitor->rate.window_ms), memory_order_relaxed,
+                                                      memory_order_relaxed))
+            ;
+    }
+    while (last_message < now &&
+           !atomic_compare_exchange_weak_explicit(&topic_last_message[index], &last_message, now, memory_order_relaxed, memory_order_relaxed))
+        ;
+    if (topic_debug)
+        printf("topic: message received for '%s'\n", topic);
+}
+// The context is the worker (client) the message arrived on
+void topic_receive_message(void *context, const char *topic, const char *payload, const size_t payload_length, const uint32_t subscription) {
+    const MqttWorker *worker = (const MqttWorker *)context;
+    const size_t slot = (size_t)(worker - mqtt_workers);
+    reader_slot_enter(&topic_readers, slot);
+    const int32_t mapped = subscription < topic_subscription_count ? topic_subscriptions[subscription] : -1;
+    if (mapped >= 0) {
+        __topic_receive_message(&topic_monitors[mapped], topic, payload, payload_length);
+        reader_slot_leave(&topic_readers, slot);
+        return;
+    }
+    size_t length;
+    const uint32_t hash = topic_hash(hash_string(topic, &length), worker->broker);
+    TopicMonitor *monitor = topic_index_find(worker->broker, topic, hash, length);
+    if (monitor == NULL) {
+        reader_slot_leave(&topic_readers, slot);
+        if (topic_probe_receive(worker->broker, topic, payload, payload_length) ||
+            topic_discover(worker->broker, topic, hash, length, mapped <= -2 ? -2 - mapped : -1) == NULL)
+            return;
+        // Found again, as it may have been evicted as soon as it was discovered
+        reader_slot_enter(&topic_readers, slot);
+        monitor = topic_index_find(worker->broker, topic, hash, length);
+    }
+    if (monitor != NULL)
+        __topic_receive_message(monitor, topic, payload, payload_length);
+    reader_slot_leave(&topic_readers, slot);
+}
+// Runs the actions of a level (numbered from 1): notify, and restart the topic's service or a named unit
+void topic_escalate(TopicMonitor *monitor, const size_t level, const char *reason, const time_t now_time) {
+    char subject[256], line[384];
+    const TopicLevel *step = &monitor->ladder->levels[level - 1];
+    const int64_t now = time_monotonic_ms();
+    const int64_t since_last = now - atomic_load_explicit(&topic_last_message[monitor - topic_monitors], memory_order_relaxed);
+    snprintf(subject, sizeof(subject), "Alert '%s' level-%zu %s [%s]", monitor->topic, level, reason, step->name);
+    snprintf(line, sizeof(line), "'%s' level-%zu %s [%s], last message %gs ago", monitor->topic, level, reason, step->name, (double)since_last / 1000.0);
+    for (size_t j = 0; j < step->action_count; j++) {
+        const TopicAction *action = &step->actions[j];
+        switch (action->type) {
+        case TOPIC_ACTION_NOTIFY:
+            action_email_digest(subject, line, now);
+            break;
+        case TOPIC_ACTION_RESTART:
+            if (action->unit != NULL || monitor->service_name != NULL)
+                action_systemd_service_restart(action->unit != NULL ? action->unit : monitor->service_name);
+            break;
+        case TOPIC_ACTION_BACKEND:
+            action_backend_run(action->backend, subject, line);
+            break;
+        default:
+            break;
+        }
+    }
+    monitor->escalations[level - 1]++;
+    monitor->escalated_time[level - 1] = now_time;
+    topic_escalations[level - 1]++;
+}
+// The message timestamp and rate sum are stored separately, so a message landing between the two loads skews one sample
+// by at most one message's worth, which the estimate absorbs
+double topic_rate_estimate(const size_t index, const int64_t now) {
+    const TopicMonitor *monitor = &topic_monitors[index];
+    const int64_t last_message = atomic_load_explicit(&topic_last_message[index], memory_order_relaxed);
+    return rate_ewma_read(atomic_load_explicit(&topic_rate[index], memory_order_relaxed), now - last_message, now - monitor->rate_started, monitor->rate.window_ms);
+}
+// Silence is left to the timeout levels, so a rate violation only counts while messages are still arriving
+void topic_process_rate(const uint32_t i, const int64_t now, const time_t now_time) {
+    char reason[128];
+    TopicMonitor *monitor = &topic_monitors[i];
+    const TopicLadder *ladder = monitor->ladder;
+    const double rate = topic_rate_estimate(i, now);
+    const bool low = monitor->rate.min > 0.0 && rate < monitor->rate.min, high = monitor->rate.max > 0.0 && rate > monitor->rate.max;
+    int64_t next = now + monitor->rate.window_ms / TOPIC_RATE_CHECKS_PER_WINDOW;
+    if ((!low && !high) || topic_level[i] > 0) {
+        if (monitor->rate_level > 0 && topic_level[i] == 0)
+            printf("topic: rate back within bounds for '%s' (%.3g/s)\n", monitor->topic, rate);
+        monitor->rate_violated = 0;
+        monitor->rate_level = 0;
+        deadline_queue_set(&topic_rate_deadlines, i, next);
+        return;
+    }
+    if (monitor->rate_violated == 0)
+        monitor->rate_violated = now;
+    const int64_t since_violated = now - monitor->rate_violated;
+    snprintf(reason, sizeof(reason), "rate %.3g/s %s %s %g/s", rate, low ? "below" : "above", low ? "minimum" : "maximum", low ? monitor->rate.min : monitor->rate.max);
+    size_t reached = 0;
+    while (reached < ladder->count && since_violated >= topic_threshold(i, reached))
+        reached++;
+    if (reached > monitor->rate_level) {
+        printf("topic: level %zu threshold exceeded for '%s' (%s)\n", reached, monitor->topic, reason);
+        topic_escalate(monitor, reached, reason, now_time);
+        monitor->rate_level = (uint8_t)reached;
+    }
+    if (monitor->rate_level < ladder->count && monitor->rate_violated + topic_threshold(i, monitor->rate_level) < next)
+        next = monitor->rate_violated + topic_threshold(i, monitor->rate_level);
+    deadline_queue_set(&topic_rate_deadlines, i, next);
+}
+// Only adapts between escalations, so that a topic's thresholds never shift under an alert in progress
+void topic_adapt(const uint32_t i) {
+    TopicMonitor *monitor = &topic_monitors[i];
+    const TopicAdaptive *adaptive = &monitor->adaptive;
+    if (log_histogram_count(&topic_intervals[i]) < adaptive->warmup)
+        return;
+    const int64_t configured_ms = monitor->ladder->levels[0].after_ms;
+    int64_t warning_ms = (int64_t)((double)log_histogram_quantile(&topic_intervals[i], adaptive->quantile) * adaptive->factor);
+    if (warning_ms < adaptive->floor_ms)
+        warning_ms = adaptive->floor_ms;
+    if (warning_ms > configured_ms)
+        warning_ms = configured_ms;
+    const double scale = (double)warning_ms / (double)configured_ms;
+    if (!monitor->adapted || (topic_debug && warning_ms != topic_threshold(i, 0)))
+        printf("topic: adapted thresholds for '%s' (scale=%.3g, first level=%gs)\n", monitor->topic, scale, (double)warning_ms / 1000.0);
+    topic_scale[i] = scale;
+    monitor->adapted = true;
+}
+// Ages exclude the outage: a message received since reconnecting is left alone, as is a topic already restarted for
+// silence, for which the shift is applied to the escalation's timestamp too. The broker's topics are looked at again
+// (their deadlines having been dropped while it was down) once escalation resumes.
+void topic_broker_thaw(const int b, const int64_t outage) {
+    const TopicBroker *broker = &topic_brokers[b];
+    for (size_t i = 0; i < topic_monitor_count; i++) {
+        TopicMonitor *monitor = &topic_monitors[i];
+        if (monitor->broker != b)
+            continue;
+        int64_t last_message = atomic_load_explicit(&topic_last_message[i], memory_order_relaxed);
+        if (last_message <= broker->lost &&
+            atomic_compare_exchange_strong_explicit(&topic_last_message[i], &last_message, last_message + outage, memory_order_relaxed, memory_order_relaxed) &&
+            monitor->escalated_last == last_message) {
+            monitor->escalated_last = last_message + outage;
+            if (monitor->repeat_at > 0)
+                monitor->repeat_at += outage;
+            topic_snapshot_store(i);
+        }
+        monitor->rate_violated = 0;
+        deadline_queue_set(&topic_deadlines, (uint32_t)i, broker->resume);
+        if (monitor->rate.window_ms > 0)
+            deadline_queue_set(&topic_rate_deadlines, (uint32_t)i, broker->resume);
+    }
+}
+void topic_broker_check(const int b, const int64_t now) {
+    char subject[192], label[96] = "";
+    TopicBroker *broker = &topic_brokers[b];
+    const bool connected = mqtt_is_connected(mqtt_broker_client(b));
+    const unsigned long generation = mqtt_connect_generation(mqtt_broker_client(b));
+    if (mqtt_broker_count > 1)
+        snprintf(label, sizeof(label), " '%s'", mqtt_brokers[b].name);
+    // A change of generation while connected means a reconnect went unseen in between
+    if (broker->up && (!connected || generation != broker->generation)) {
+        broker->up = false;
+        broker->lost = now;
+        broker->outages++;
+        topic_broker_outages++;
+        printf("topic: broker%s disconnected, deadlines frozen\n", label);
+    }
+    if (!broker->up && connected) {
+        const int64_t outage = now - broker->lost;
+        broker->up = true;
+        broker->generation = generation;
+        broker->resume = now + topic_broker_grace_ms;
+        // Probes out across the outage are not the broker's delay; the next goes now
+        atomic_store_explicit(&broker->probe_answered, atomic_load_explicit(&broker->probe_sequence, memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit(&broker->probe_rtt, 0, memory_order_relaxed);
+        broker->probe_next = now;
+        broker->probe_level = 0;
+        topic_broker_thaw(b, outage);
+        printf("topic: broker%s connected after %gs, escalation resumes in %gs\n", label, (double)outage / 1000.0, (double)topic_broker_grace_ms / 1000.0);
+        if (broker->alerted) {
+            snprintf(subject, sizeof(subject), "Broker%s reconnected after %g seconds", label, (double)outage / 1000.0);
+            action_email_digest(subject, subject, now);
+            broker->alerted = false;
+        }
+    }
+    if (!broker->up && !broker->alerted && now - broker->lost >= topic_broker_alert_ms) {
+        snprintf(subject, sizeof(subject), "Alert broker%s disconnected (%g seconds)", label, (double)(now - broker->lost) / 1000.0);
+        printf("topic: broker%s disconnected for %gs, alerting\n", label, (double)(now - broker->lost) / 1000.0);
+        action_email_digest(subject, subject, now);
+        broker->alerted = true;
+    }
+}
+// Whether a topic's escalation is held off by its broker: dropping its deadline while the broker is down, or putting it
+// off to the resumption while within the grace period
+bool topic_broker_paused(const uint32_t i, DeadlineQueue *queue, const int64_t now) {
+    const TopicBroker *broker = &topic_brokers[topic_monitors[i].broker];
+    if (!broker->up)
+        deadline_queue_remove(queue, i);
+    else if (now < broker->resume)
+        deadline_queue_set(queue, i, broker->resume);
+    else
+        return false;
+    return true;
+}
+// The timestamps array for capacity monitors, mapped from a new snapshot if one is configured (and can be created)
+_Atomic(int64_t) *topic_snapshot_begin(const size_t capacity) {
+    size_t records, timestamps;
+    const size_t size = topic_snapshot_layout(capacity, &records, &timestamps);
+    if (topic_snapshot_path == NULL || !snapshot_create(&topic_snapshot, topic_snapshot_path, size))
+        return cache_aligned_calloc(capacity, sizeof(_Atomic(int64_t)));
+    topic_snapshot_header = (TopicSnapshotHeader *)topic_snapshot.data;
+    topic_snapshot_records = (TopicSnapshotRecord *)((char *)topic_snapshot.data + records);
+    *topic_snapshot_header = (TopicSnapshotHeader){.magic = TOPIC_SNAPSHOT_MAGIC,
+                                                   .version = TOPIC_SNAPSHOT_VERSION,
+                                                   .record_size = sizeof(TopicSnapshotRecord),
+                                                   .levels_max = TOPIC_LEVELS_MAX,
+                                                   .capacity = capacity,
+                                                   .saved = time_monotonic_ms()};
+    return (_Atomic(int64_t) *)(void *)((char *)topic_snapshot.data + timestamps);
+}
+// Under topic_lock
+void topic_snapshot_sync(const int64_t now, const bool force) {
+    if (topic_snapshot_header == NULL || (now - topic_snapshot_synced < TOPIC_SNAPSHOT_SYNC_MS && !force))
+        return;
+    topic_snapshot_synced = now;
+    for (size_t i = 0; i < topic_monitor_count; i++) {
+        topic_snapshot_records[i].messages = atomic_load_explicit(&topic_monitors[i].messages, memory_order_relaxed);
+        topic_snapshot_records[i].rejected = atomic_load_explicit(&topic_monitors[i].rejected, memory_order_relaxed);
+    }
+    for (size_t k = 0; k < TOPIC_LEVELS_MAX; k++)
+        topic_snapshot_header->escalations[k] = topic_escalations[k];
+    topic_snapshot_header->broker_outages = topic_broker_outages;
+    topic_snapshot_header->saved = now;
+}
+bool topic_snapshot_valid(const Snapshot *snapshot) {
+    const TopicSnapshotHeader *header = (const TopicSnapshotHeader *)snapshot->data;
+    size_t records, timestamps;
+    return snapshot->size >= sizeof(TopicSnapshotHeader) && header->magic == TOPIC_SNAPSHOT_MAGIC && header->version == TOPIC_SNAPSHOT_VERSION &&
+           header->record_size == sizeof(TopicSnapshotRecord) && header->levels_max == TOPIC_LEVELS_MAX && header->count <= header->capacity &&
+           header->capacity < SIZE_MAX / sizeof(TopicSnapshotRecord) && snapshot->size == topic_snapshot_layout((size_t)header->capacity, &records, &timestamps);
+}
+void topic_snapshot_restore_record(const size_t index, const TopicSnapshotRecord *record, const int64_t last_message, const int64_t shift, const int64_t now) {
+    TopicMonitor *monitor = &topic_monitors[index];
+    const size_t levels = monitor->ladder->count;
+    topic_level[index] = record->level < levels ? record->level : (uint8_t)levels;
+    atomic_store_explicit(&topic_last_message[index], last_message + shift < now ? last_message + shift : now, memory_order_relaxed);
+    monitor->escalated_last = topic_level[index] > 0 ? record->escalated_last + shift : 0;
+    monitor->repeat_at = topic_level[index] > 0 && record->repeat_at > 0 ? record->repeat_at + shift : 0;
+    atomic_store_explicit(&monitor->messages, record->messages, memory_order_relaxed);
+    atomic_store_explicit(&monitor->rejected, record->rejected, memory_order_relaxed);
+    for (size_t k = 0; k < levels; k++) {
+        monitor->escalations[k] = record->escalations[k];
+        monitor->escalated_time[k] = (time_t)record->escalated_time[k];
+    }
+    deadline_queue_set(&topic_deadlines, (uint32_t)index, now); // to be looked at afresh
+    topic_snapshot_store(index);
+}
+// Puts the new snapshot, once filled in, in place of the previous one
+void topic_snapshot_commit(const int64_t now) {
+    if (topic_snapshot_header == NULL)
+        return;
+    topic_snapshot_sync(now, true);
+    // Failing that, the mapping still holds the timestamps, so is kept, but is no longer saved to
+    if (!snapshot_commit(topic_snapshot_path)) {
+        topic_snapshot_header = NULL;
+        topic_snapshot_records = NULL;
+    }
+}
+// Once the configured topics are set up: restores from the previous snapshot, if any, then puts the new one in its place
+void topic_snapshot_restore(const int64_t now) {
+    if (topic_snapshot_header == NULL)
+        return;
+    Snapshot previous;
+    if (snapshot_open(&previous, topic_snapshot_path)) {
+        const TopicSnapshotHeader *header = (const TopicSnapshotHeader *)previous.data;
+        if (!topic_snapshot_valid(&previous))
+            fprintf(stderr, "topic: snapshot '%s' is not compatible, starting afresh\n", topic_snapshot_path);
+        else {
+            size_t records, timestamps, restored = 0, kept = 0;
+            topic_snapshot_layout((size_t)header->capacity, &records, &timestamps);
+            const TopicSnapshotRecord *record = (const TopicSnapshotRecord *)(const void *)((const char *)previous.data + records);
+            const int64_t *last_messages = (const int64_t *)(const void *)((const char *)previous.data + timestamps);
+            const int64_t shift = now - header->saved;
+            for (size_t i = 0; i < header->count; i++, record++) {
+                const size_t length = strnlen(record->topic, sizeof(record->topic));
+                if (length == 0 || length == sizeof(record->topic))
+                    continue;
+                kept++;
+                const int broker = mqtt_broker_find(record->broker);
+                if (broker < 0)
+                    continue;
+                const uint32_t hash = topic_hash(hash_string(record->topic, NULL), broker);
+                TopicMonitor *monitor = topic_index_find(broker, record->topic, hash, length);
+                if (monitor == NULL && record->discovered)
+                    monitor = topic_discover(broker, record->topic, hash, length, -1);
+                if (monitor == NULL)
+                    continue;
+                topic_snapshot_restore_record((size_t)(monitor - topic_monitors), record, last_messages[i], shift, now);
+                restored++;
+            }
+            for (size_t k = 0; k < TOPIC_LEVELS_MAX; k++)
+                topic_escalations[k] = header->escalations[k];
+            topic_broker_outages = header->broker_outages;
+            printf("topic: restored %zu of %zu topics from snapshot '%s' (saved %gs ago)\n", restored, kept, topic_snapshot_path, (double)shift / 1000.0);
+        }
+        snapshot_close(&previous);
+    }
+    topic_snapshot_commit(now);
+}
+// Under topic_lock: the earliest time topic_process has something to do
+bool topic_deadline_next(int64_t *deadline) {
+    uint32_t i;
+    int64_t next;
+    bool result = deadline_queue_peek(&topic_deadlines, &i, deadline);
+    if (deadline_queue_peek(&topic_rate_deadlines, &i, &next) && (!result || next < *deadline))
+        *deadline = next, result = true;
+    for (size_t b = 0; b < mqtt_broker_count; b++) {
+        const TopicBroker *broker = &topic_brokers[b];
+        if (!broker->up && !broker->alerted && (!result || broker->lost + topic_broker_alert_ms < *deadline))
+            *deadline = broker->lost + topic_broker_alert_ms, result = true;
+        if (broker->up && topic_probe_interval_ms > 0 && (!result || broker->probe_next < *deadline))
+            *deadline = broker->probe_next, result = true;
+    }
+    if (action_email_digest_deadline(&next) && (!result || next < *deadline))
+        *deadline = next, result = true;
+    return result;
+}
+bool topic_process(void) {
+    char reason[64];
+    const time_t now_time = time(NULL);
+    pthread_mutex_lock(&topic_lock);
+    const int64_t now = time_monotonic_ms();
+    for (size_t b = 0; b < mqtt_broker_count; b++) {
+        topic_broker_check((int)b, now);
+        topic_probe_check((int)b, now);
+    }
+    uint32_t i;
+    int64_t deadline;
+    while (deadline_queue_peek(&topic_deadlines, &i, &deadline) && deadline <= now) {
+        if (topic_broker_paused(i, &topic_deadlines, now))
+            continue;
+        TopicMonitor *monitor = &topic_monitors[i];
+        if (monitor->adaptive.quantile > 0.0 && topic_level[i] == 0)
+            topic_adapt(i);
+        const TopicLadder *ladder = monitor->ladder;
+        const int64_t last_message = atomic_load_explicit(&topic_last_message[i], memory_order_relaxed);
+        const int64_t since_last = now - last_message, stretch = topic_probe_stretch_ms(monitor->broker);
+        // A message arrived since the last escalation
+        if (topic_level[i] > 0 && last_message != monitor->escalated_last) {
+            topic_level[i] = 0;
+            monitor->repeat_at = 0;
+        }
+        size_t reached = 0;
+        while (reached < ladder->count && since_last - stretch >= topic_threshold(i, reached))
+            reached++;
+        // Only the highest level reached runs, so levels passed over while processing was held up are not run late
+        if (reached > topic_level[i]) {
+            const int64_t repeat_ms = ladder->levels[reached - 1].repeat_ms;
+            printf("topic: level %zu threshold exceeded for '%s' (%g seconds)\n", reached, monitor->topic, (double)since_last / 1000.0);
+            snprintf(reason, sizeof(reason), "timeout (%g seconds)", (double)since_last / 1000.0);
+            topic_escalate(monitor, reached, reason, now_time);
+            topic_level[i] = (uint8_t)reached;
+            monitor->escalated_last = last_message;
+            monitor->repeat_at = repeat_ms > 0 ? now + repeat_ms : 0;
+        } else if (monitor->repeat_at > 0 && monitor->repeat_at <= now) {
+            printf("topic: level %u repeated for '%s' (%g seconds)\n", topic_level[i], monitor->topic, (double)since_last / 1000.0);
+            snprintf(reason, sizeof(reason), "timeout (%g seconds)", (double)since_last / 1000.0);
+            topic_escalate(monitor, topic_level[i], reason, now_time);
+            monitor->repeat_at = now + ladder->levels[topic_level[i] - 1].repeat_ms;
+        }
+        // Past the last level there is nothing more to do until a message arrives, which is checked for once per first level period
+        int64_t next = reached < ladder->count ? last_message + stretch + topic_threshold(i, reached) : now + topic_threshold(i, 0);
+        if (monitor->repeat_at > 0 && monitor->repeat_at < next)
+            next = monitor->repeat_at;
+        deadline_queue_set(&topic_deadlines, i, next);
+        topic_snapshot_store(i);
+        topic_status_check(i);
+    }
+    while (deadline_queue_peek(&topic_rate_deadlines, &i, &deadline) && deadline <= now) {
+        if (topic_broker_paused(i, &topic_rate_deadlines, now))
+            continue;
+        topic_process_rate(i, now, now_time);
+        topic_snapshot_store(i);
+        topic_status_check(i);
+    }
+    for (size_t b = 0; b < mqtt_broker_count && topic_status_prefix != NULL; b++)
+        if (topic_brokers[b].status_generation != mqtt_connect_generation(mqtt_broker_client((int)b))) {
+            topic_brokers[b].status_generation = mqtt_connect_generation(mqtt_broker_client((int)b));
+            topic_status_republish((int)b);
+        }
+    if (topic_status_dirty_count > 0 || topic_status_summary_dirty)
+        topic_status_publish(now);
+    action_email_digest_flush(now, false);
+    topic_snapshot_sync(now, false);
+    pthread_mutex_unlock(&topic_lock);
+    return true;
+}
+bool topic_next_deadline(int64_t *deadline) {
+    pthread_mutex_lock(&topic_lock);
+    const bool result = topic_deadline_next(deadline);
+    pthread_mutex_unlock(&topic_lock);
+    return result;
+}
+// Sleeps until the earliest topic deadline, a newly discovered topic, or timeout_ms, whichever comes first
+void topic_wait(const int64_t timeout_ms) {
+    pthread_mutex_lock(&topic_lock);
+    const int64_t now = time_monotonic_ms();
+    int64_t until = now + timeout_ms, deadline;
+    if (topic_deadline_next(&deadline) && deadline < until)
+        until = deadline;
+    if (until > now) {
+        const struct timespec ts = {.tv_sec = (time_t)(until / 1000), .tv_nsec = (long)(until % 1000) * 1000000};
+        pthread_cond_timedwait(&topic_wake, &topic_lock, &ts);
+    }
+    pthread_mutex_unlock(&topic_lock);
+}
+// Round trips by broker: the latest, and quantiles of recent ones (to within the histogram's buckets)
+bool topic_probe_stats_to_string(StringBuffer *buffer) {
+    bool result = true;
+    for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+        const TopicBroker *broker = &topic_brokers[b];
+        result = string_buffer_printf(buffer, "%s%s=%" PRId64 "ms (p50<%" PRIu64 "ms, p99<%" PRIu64 "ms, delay=%" PRId64 "ms, received=%lu/%" PRIu32 ")", b > 0 ? ", " : "",
+                                      mqtt_brokers[b].name, atomic_load_explicit(&broker->probe_rtt, memory_order_relaxed),
+                                      log_histogram_quantile(&broker->probe_quantiles, 0.5), log_histogram_quantile(&broker->probe_quantiles, 0.99), broker->probe_delay,
+                                      atomic_load_explicit(&broker->probe_received, memory_order_relaxed),
+                                      atomic_load_explicit(&broker->probe_sequence, memory_order_relaxed));
+    }
+    return result;
+}
+bool topic_stats_to_string(StringBuffer *buffer) {
+    char timestamp[32];
+    struct tm tm;
+    bool result = true;
+    for (size_t k = 0; k < topic_levels && result; k++)
+        result = string_buffer_printf(buffer, "L%zu=%lu, ", k + 1, topic_escalations[k]);
+    result = result && string_buffer_printf(buffer, "broker outages=%lu", topic_broker_outages);
+    for (size_t b = 0; b < mqtt_broker_count && mqtt_broker_count > 1 && result; b++)
+        result = string_buffer_printf(buffer, ", %s=%s/%lu", mqtt_brokers[b].name, topic_brokers[b].up ? "up" : "down", topic_brokers[b].outages);
+    result = result && string_buffer_printf(buffer, ": ");
+    pthread_mutex_lock(&topic_lock);
+    const int64_t now = time_monotonic_ms();
+    for (size_t i = 0; i < topic_monitor_count && result; i++) {
+        const TopicMonitor *monitor = &topic_monitors[i];
+        result = string_buffer_printf(buffer, "%s%s", (i == 0 ? "" : ", "), monitor->topic);
+        if (mqtt_broker_count > 1)
+            result = result && string_buffer_printf(buffer, "@%s", mqtt_brokers[monitor->broker].name);
+        const unsigned long rejected = atomic_load_explicit(&monitor->rejected, memory_order_relaxed);
+        if (rejected > 0)
+            result = result && string_buffer_printf(buffer, " [rejected=%lu]", rejected);
+        if (monitor->rate.window_ms > 0)
+            result = result && string_buffer_printf(buffer, " [rate=%.3g/s]", topic_rate_estimate(i, now));
+        if (monitor->adapted) {
+            result = result && string_buffer_printf(buffer, " [thresholds=");
+            for (size_t k = 0; k < monitor->ladder->count && result; k++)
+                result = string_buffer_printf(buffer, "%s%gs", k > 0 ? "/" : "", (double)topic_threshold(i, k) / 1000.0);
+            result = result && string_buffer_printf(buffer, "]");
+        }
+        const char *separator = " (";
+        for (size_t k = 0; k < monitor->ladder->count && result; k++)
+            if (monitor->escalations[k] > 0) {
+                strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&monitor->escalated_time[k], &tm));
+                result = string_buffer_printf(buffer, "%sL%zu=%lu/%s", separator, k + 1, monitor->escalations[k], timestamp);
+                separator = ", ";
+            }
+        if (*separator == ',')
+            result = result && string_buffer_printf(buffer, ")");
+    }
+    for (size_t i = 0; i < topic_pattern_count && result; i++) {
+        const TopicPattern *pattern = &topic_patterns[i];
+        result = string_buffer_printf(buffer, ", %s", pattern->pattern);
+        if (mqtt_broker_count > 1)
+            result = result && string_buffer_printf(buffer, "@%s", mqtt_brokers[pattern->broker].name);
+        result = result && string_buffer_printf(buffer, " [discovered=%zu", pattern->discovered);
+        if (pattern->evicted > 0 || pattern->dropped > 0)
+            result = result && string_buffer_printf(buffer, ", evicted=%lu, dropped=%lu", pattern->evicted, pattern->dropped);
+        result = result && string_buffer_printf(buffer, "]");
+    }
+    pthread_mutex_unlock(&topic_lock);
+    return result;
+}
+// OpenMetrics exposition. Each family is rendered a chunk of topics at a time under the lock, so however many topics there
+// are, a scrape holds up deadline processing for no longer than one chunk takes.
+#define TOPIC_METRICS_CHUNK 256
+typedef bool (*topic_metric_t)(StringBuffer *buffer, const char *name, const size_t index, const int64_t now);
+bool topic_metrics_label(StringBuffer *buffer, const char *name, const char *suffix, const char *label, const char *value) {
+    if (!string_buffer_printf(buffer, "%s%s{%s=\"", name, suffix, label))
+        return false;
+    for (const char *p = value; *p != '\0'; p++) {
+        const size_t length = strcspn(p, "\\\"\n");
+        if (!string_buffer_append(buffer, p, length))
+            return false;
+        if (p[length] == '\0')
+            break;
+        if (!string_buffer_append(buffer, p[length] == '\n' ? "\\n" : p[length] == '"' ? "\\\"" : "\\\\", 2))
+            return false;
+        p += length;
+    }
+    return string_buffer_append(buffer, "\"", 1);
+}
+// Topics and patterns are labelled with their broker too if there is more than one (broker names need no escaping)
+bool topic_metrics_topic(StringBuffer *buffer, const char *name, const char *suffix, const size_t index) {
+    return topic_metrics_label(buffer, name, suffix, "topic", topic_monitors[index].topic) &&
+           (mqtt_broker_count == 1 || string_buffer_printf(buffer, ",broker=\"%s\"", mqtt_brokers[topic_monitors[index].broker].name));
+}
+bool topic_metrics_pattern(StringBuffer *buffer, const char *name, const char *suffix, const size_t index) {
+    return topic_metrics_label(buffer, name, suffix, "pattern", topic_patterns[index].pattern) &&
+           (mqtt_broker_count == 1 || string_buffer_printf(buffer, ",broker=\"%s\"", mqtt_brokers[topic_patterns[index].broker].name));
+}
+bool topic_metric_age(StringBuffer *buffer, const char *name, const size_t index, const int64_t now) {
+    const int64_t last_message = atomic_load_explicit(&topic_last_message[index], memory_order_relaxed);
+    return topic_metrics_topic(buffer, name, "", index) && string_buffer_printf(buffer, "} %.3f\n", (double)(now - last_message) / 1000.0);
+}
+bool topic_metric_warning(StringBuffer *buffer, const char *name, const size_t index, const int64_t now __attribute__((unused))) {
+    return topic_metrics_topic(buffer, name, "", index) && string_buffer_printf(buffer, "} %.3f\n", (double)topic_threshold(index, 0) / 1000.0);
+}
+bool topic_metric_level(StringBuffer *buffer, const char *name, const size_t index, const int64_t now __attribute__((unused))) {
+    return topic_metrics_topic(buffer, name, "", index) && string_buffer_printf(buffer, "} %u\n", topic_level[index]);
+}
+bool topic_metric_messages(StringBuffer *buffer, const char *name, const size_t index, const int64_t now __attribute__((unused))) {
+    return topic_metrics_topic(buffer, name, "_total", index) &&
+           string_buffer_printf(buffer, "} %lu\n", atomic_load_explicit(&topic_monitors[index].messages, memory_order_relaxed));
+}
+bool topic_metric_rejected(StringBuffer *buffer, const char *name, const size_t index, const int64_t now __attribute__((unused))) {
+    return topic_metrics_topic(buffer, name, "_total", index) &&
+           string_buffer_printf(buffer, "} %lu\n", atomic_load_explicit(&topic_monitors[index].rejected, memory_order_relaxed));
+}
+bool topic_metric_alerts(StringBuffer *buffer, const char *name, const size_t index, const int64_t now __attribute__((unused))) {
+    const TopicMonitor *monitor = &topic_monitors[index];
+    bool result = true;
+    for (size_t k = 0; k < monitor->ladder->count && result; k++)
+        result = topic_metrics_topic(buffer, name, "_total", index) && string_buffer_printf(buffer, ",level=\"%zu\"} %lu\n", k + 1, monitor->escalations[k]);
+    return result;
+}
+bool topic_metric_intervals(StringBuffer *buffer, const char *name, const size_t index, const int64_t now __attribute__((unused))) {
+    const Pow2Histogram *histogram = &topic_histograms[index];
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < POW2_HISTOGRAM_BUCKETS; i++) {
+        cumulative += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (!topic_metrics_topic(buffer, name, "_bucket", index))
+            return false;
+        if (!(i + 1 < POW2_HISTOGRAM_BUCKETS ? string_buffer_printf(buffer, ",le=\"%.3f\"} %" PRIu64 "\n", (double)(UINT64_C(1) << i) / 1000.0, cumulative)
+                                             : string_buffer_printf(buffer, ",le=\"+Inf\"} %" PRIu64 "\n", cumulative)))
+            return false;
+    }
+    return topic_metrics_topic(buffer, name, "_count", index) && string_buffer_printf(buffer, "} %" PRIu64 "\n", cumulative) &&
+           topic_metrics_topic(buffer, name, "_sum", index) &&
+           string_buffer_printf(buffer, "} %.3f\n", (double)atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1000.0);
+}
+bool topic_metrics_family(StringBuffer *buffer, const char *name, const char *type, const char *help, const topic_metric_t metric) {
+    if (!string_buffer_printf(buffer, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help))
+        return false;
+    bool result = true;
+    for (size_t start = 0; result; start += TOPIC_METRICS_CHUNK) {
+        pthread_mutex_lock(&topic_lock);
+        const int64_t now = time_monotonic_ms();
+        const size_t end = start + TOPIC_METRICS_CHUNK < topic_monitor_count ? start + TOPIC_METRICS_CHUNK : topic_monitor_count;
+        for (size_t i = start; i < end && result; i++)
+            result = metric(buffer, name, i, now);
+        const bool last = end == topic_monitor_count;
+        pthread_mutex_unlock(&topic_lock);
+        if (last)
+            break;
+    }
+    return result;
+}
+// A broker's sample: labelled by broker if there are several, and by bucket bound (a number of seconds, or "+Inf") if given
+bool topic_metrics_broker(StringBuffer *buffer, const char *name, const char *suffix, const size_t b, const char *le, const char *value) {
+    const char *broker = mqtt_broker_count > 1 ? mqtt_brokers[b].name : NULL;
+    if (broker == NULL && le == NULL)
+        return string_buffer_printf(buffer, "%s%s %s\n", name, suffix, value);
+    if (le == NULL)
+        return string_buffer_printf(buffer, "%s%s{broker=\"%s\"} %s\n", name, suffix, broker, value);
+    if (broker == NULL)
+        return string_buffer_printf(buffer, "%s%s{le=\"%s\"} %s\n", name, suffix, le, value);
+    return string_buffer_printf(buffer, "%s%s{broker=\"%s\",le=\"%s\"} %s\n", name, suffix, broker, le, value);
+}
+bool topic_metrics_probe(StringBuffer *buffer) {
+    char value[32], le[32];
+    bool result = string_buffer_printf(buffer, "# TYPE mqtt_watchdog_broker_probe_delay_seconds gauge\n");
+    for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+        snprintf(value, sizeof(value), "%.3f", (double)topic_brokers[b].probe_delay / 1000.0);
+        result = topic_metrics_broker(buffer, "mqtt_watchdog_broker_probe_delay_seconds", "", b, NULL, value);
+    }
+    result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_broker_probe_rtt_seconds histogram\n");
+    for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+        const Pow2Histogram *histogram = &topic_brokers[b].probe_histogram;
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < POW2_HISTOGRAM_BUCKETS && result; i++) {
+            cumulative += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+            if (i + 1 < POW2_HISTOGRAM_BUCKETS)
+                snprintf(le, sizeof(le), "%.3f", (double)(UINT64_C(1) << i) / 1000.0);
+            else
+                snprintf(le, sizeof(le), "+Inf");
+            snprintf(value, sizeof(value), "%" PRIu64, cumulative);
+            result = topic_metrics_broker(buffer, "mqtt_watchdog_broker_probe_rtt_seconds", "_bucket", b, le, value);
+        }
+        char count[32], sum[32];
+        snprintf(count, sizeof(count), "%" PRIu64, cumulative);
+        snprintf(sum, sizeof(sum), "%.3f", (double)atomic_load_explicit(&histogram->sum, memory_order_relaxed) / 1000.0);
+        result = result && topic_metrics_broker(buffer, "mqtt_watchdog_broker_probe_rtt_seconds", "_count", b, NULL, count) &&
+                 topic_metrics_broker(buffer, "mqtt_watchdog_broker_probe_rtt_seconds", "_sum", b, NULL, sum);
+    }
+    result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_broker_probes_sent counter\n");
+    for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+        snprintf(value, sizeof(value), "%" PRIu32, atomic_load_explicit(&topic_brokers[b].probe_sequence, memory_order_relaxed));
+        result = topic_metrics_broker(buffer, "mqtt_watchdog_broker_probes_sent", "_total", b, NULL, value);
+    }
+    result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_broker_probes_received counter\n");
+    for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+        snprintf(value, sizeof(value), "%lu", atomic_load_explicit(&topic_brokers[b].probe_received, memory_order_relaxed));
+        result = topic_metrics_broker(buffer, "mqtt_watchdog_broker_probes_received", "_total", b, NULL, value);
+    }
+    return result;
+}
+// Broker state is read unlocked: each value is a single word, and a scrape may be a pass out of date
+bool topic_metrics_brokers(StringBuffer *buffer) {
+    static const struct {
+        const char *name, *type, *suffix;
+    } families[] = {{"mqtt_watchdog_broker_connected", "gauge", ""},
+                    {"mqtt_watchdog_broker_outages", "counter", "_total"},
+                    {"mqtt_watchdog_broker_connects", "counter", "_total"},
+                    {"mqtt_watchdog_broker_messages", "counter", "_total"},
+                    {"mqtt_watchdog_broker_bytes", "counter", "_total"}};
+    bool result = true;
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]) && result; f++) {
+        result = string_buffer_printf(buffer, "# TYPE %s %s\n", families[f].name, families[f].type);
+        for (size_t b = 0; b < mqtt_broker_count && result; b++) {
+            const MqttStats stats = mqtt_broker_stats((int)b);
+            const unsigned long values[] = {topic_brokers[b].up ? 1UL : 0UL, topic_brokers[b].outages, stats.connects, stats.messages, stats.bytes};
+            result = (mqtt_broker_count == 1 ? string_buffer_printf(buffer, "%s%s", families[f].name, families[f].suffix)
+                                             : string_buffer_printf(buffer, "%s%s{broker=\"%s\"}", families[f].name, families[f].suffix, mqtt_brokers[b].name)) &&
+                     string_buffer_printf(buffer, " %lu\n", values[f]);
+        }
+    }
+    if (topic_probe_interval_ms > 0 && result)
+        result = topic_metrics_probe(buffer);
+    if (mqtt_ingest_workers > 1 && result) {
+        result = string_buffer_printf(buffer, "# TYPE mqtt_watchdog_worker_messages counter\n");
+        for (size_t w = 0; w < mqtt_worker_count && result; w++)
+            result = string_buffer_printf(buffer, "mqtt_watchdog_worker_messages_total{broker=\"%s\",worker=\"%zu\"} %lu\n", mqtt_brokers[mqtt_workers[w].broker].name,
+                                          w % mqtt_ingest_workers, mqtt_stats_get(&mqtt_workers[w].mqtt).messages);
+    }
+    return result;
+}
+bool topic_metrics_render(StringBuffer *buffer) {
+    bool result = topic_metrics_brokers(buffer) &&
+                  topic_metrics_family(buffer, "mqtt_watchdog_topic_age_seconds", "gauge", "Time since the last accepted message (or since monitoring began)",
+                                       topic_metric_age) &&
+                  topic_metrics_family(buffer, "mqtt_watchdog_topic_warning_seconds", "gauge", "Current warning threshold", topic_metric_warning) &&
+                  topic_metrics_family(buffer, "mqtt_watchdog_topic_level", "gauge", "Escalation level reached since the last message", topic_metric_level) &&
+                  topic_metrics_family(buffer, "mqtt_watchdog_topic_messages", "counter", "Messages accepted", topic_metric_messages) &&
+                  topic_metrics_family(buffer, "mqtt_watchdog_topic_rejected", "counter", "Messages rejected by payload predicates", topic_metric_rejected) &&
+                  topic_metrics_family(buffer, "mqtt_watchdog_topic_alerts", "counter", "Escalations by level", topic_metric_alerts) &&
+                  (topic_histograms == NULL || topic_metrics_family(buffer, "mqtt_watchdog_topic_interarrival_seconds", "histogram",
+                                                                    "Time between accepted messages", topic_metric_intervals));
+    if (topic_pattern_count > 0) {
+        pthread_mutex_lock(&topic_lock);
+        result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_pattern_discovered gauge\n");
+        for (size_t i = 0; i < topic_pattern_count && result; i++)
+            result = topic_metrics_pattern(buffer, "mqtt_watchdog_pattern_discovered", "", i) &&
+                     string_buffer_printf(buffer, "} %zu\n", topic_patterns[i].discovered);
+        result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_pattern_evicted counter\n");
+        for (size_t i = 0; i < topic_pattern_count && result; i++)
+            result = topic_metrics_pattern(buffer, "mqtt_watchdog_pattern_evicted", "_total", i) &&
+                     string_buffer_printf(buffer, "} %lu\n", topic_patterns[i].evicted);
+        result = result && string_buffer_printf(buffer, "# TYPE mqtt_watchdog_pattern_dropped counter\n");
+        for (size_t i = 0; i < topic_pattern_count && result; i++)
+            result = topic_metrics_pattern(buffer, "mqtt_watchdog_pattern_dropped", "_total", i) &&
+                     string_buffer_printf(buffer, "} %lu\n", topic_patterns[i].dropped);
+        pthread_mutex_unlock(&topic_lock);
+    }
+    return result;
+}
+// Reads topic.N's settings other than its name, with the service copied and require and the ladder built (so to be freed
+// by the caller if not kept, as the configuration may be reloaded under them)
+bool topic_settings_config(config_section_t *topic, const int i, TopicSettings *settings, const char **require_string) {
+    TopicRateLimits *rate = &settings->rate;
+    rate->min = config_section_get_double(topic, "min-rate", 0.0);
+    rate->max = config_section_get_double(topic, "max-rate", 0.0);
+    rate->window_ms = 0;
+    if (rate->min > 0.0 || rate->max > 0.0) {
+        rate->window_ms = config_section_get_duration_ms(topic, "rate-window", TOPIC_RATE_WINDOW_DEFAULT * 1000);
+        if (rate->window_ms < TOPIC_RATE_CHECKS_PER_WINDOW || (rate->max > 0.0 && rate->min > rate->max)) {
+            fprintf(stderr, "topic: invalid rate bounds or window (topic.%d)\n", i);
+            return false;
+        }
+    }
+    TopicAdaptive *adaptive = &settings->adaptive;
+    adaptive->quantile = 0.0;
+    if (config_section_get_bool(topic, "adaptive", false)) {
+        adaptive->quantile = config_section_get_double(topic, "adaptive-quantile", TOPIC_ADAPTIVE_QUANTILE_DEFAULT);
+        adaptive->factor = config_section_get_double(topic, "adaptive-factor", TOPIC_ADAPTIVE_FACTOR_DEFAULT);
+        adaptive->floor_ms = config_section_get_duration_ms(topic, "adaptive-floor", TOPIC_ADAPTIVE_FLOOR_DEFAULT * 1000);
+        const int warmup = config_section_get_integer(topic, "adaptive-warmup", TOPIC_ADAPTIVE_WARMUP_DEFAULT);
+        // Halving leaves at least half of LOG_HISTOGRAM_DECAY samples, so a larger warm-up could be lost again once reached
+        adaptive->warmup = warmup < 1 ? 1 : warmup > LOG_HISTOGRAM_DECAY / 2 ? LOG_HISTOGRAM_DECAY / 2 : (uint32_t)warmup;
+        if (adaptive->quantile <= 0.0 || adaptive->quantile > 1.0 || adaptive->factor <= 0.0) {
+            fprintf(stderr, "topic: invalid adaptive quantile or factor (topic.%d)\n", i);
+            return false;
+        }
+    }
+    *require_string = config_section_get_string(topic, "require", NULL);
+    settings->require = NULL;
+    if (*require_string != NULL && (settings->require = topic_require_parse(*require_string)) == NULL)
+        return false;
+    if ((settings->ladder = topic_ladder_config(topic, i)) == NULL) {
+        topic_require_free(settings->require);
+        return false;
+    }
+    if ((settings->service_name = strdup(config_section_get_string(topic, "service", SERVICE_NAME_DEFAULT))) == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for settings (topic.%d)\n", i);
+        topic_require_free(settings->require);
+        topic_ladder_free(settings->ladder);
+        return false;
+    }
+    return true;
+}
+void topic_settings_free(const TopicSettings *settings) {
+    free((void *)(uintptr_t)settings->service_name);
+    topic_require_free(settings->require);
+    topic_ladder_free(settings->ladder);
+}
+void topic_settings_print(const char *topic, const TopicSettings *settings) {
+    StringBuffer ladder = {0};
+    if (topic_ladder_to_string(&ladder, settings->ladder))
+        printf("topic: escalating '%s' (%s)\n", topic, ladder.data);
+    string_buffer_free(&ladder);
+    if (settings->rate.window_ms > 0)
+        printf("topic: monitoring rate of '%s' (min=%g/s, max=%g/s, window=%gs)\n", topic, settings->rate.min, settings->rate.max,
+               (double)settings->rate.window_ms / 1000.0);
+    if (settings->adaptive.quantile > 0.0)
+        printf("topic: adapting thresholds of '%s' (quantile=%g, factor=%g, floor=%gs, warmup=%u)\n", topic, settings->adaptive.quantile, settings->adaptive.factor,
+               (double)settings->adaptive.floor_ms / 1000.0, settings->adaptive.warmup);
+}
+// The broker topic.N is monitored on, -1 (reported) if there is no such broker
+int topic_broker_config(config_section_t *topic, const int i) {
+    const char *name = config_section_get_string(topic, "broker", NULL);
+    const int broker = mqtt_broker_find(name);
+    if (broker < 0)
+        fprintf(stderr, "topic: unknown broker '%s' (topic.%d)\n", name ? name : "", i);
+    return broker;
+}
+// Reads the topics and what is configured for them into a new monitor set, at startup and again on reload
+bool topic_config_topics(const int64_t now) {
+    config_section_t section;
+    topic_monitor_count = topic_pattern_count = 0;
+    topic_debug = config_get_bool("debug", false);
+    const int *indices;
+    const size_t topic_count = config_get_array("topic", "name", &indices);
+    const int discover_max = config_get_integer("topic-discover-max", TOPIC_DISCOVER_MAX_DEFAULT);
+    size_t literals = 0, patterns = 0, levels = 0;
+    bool adaptive = false;
+    for (size_t n = 0; n < topic_count; n++) {
+        config_section(&section, NULL, "topic", indices[n]);
+        const char *topic = config_section_get_string(&section, "name", "");
+        if (topic_is_pattern(topic))
+            patterns++, levels += topic_trie_levels(topic);
+        else
+            literals++;
+        adaptive |= config_section_get_bool(&section, "adaptive", false);
+    }
+    topic_monitor_capacity = literals + (patterns > 0 && discover_max > 0 ? (size_t)discover_max : 0);
+    if (topic_monitor_capacity > 0 &&
+        ((topic_monitors = calloc(topic_monitor_capacity, sizeof(TopicMonitor))) == NULL ||
+         (topic_last_message = topic_snapshot_begin(topic_monitor_capacity)) == NULL ||
+         (topic_scale = cache_aligned_calloc(topic_monitor_capacity, sizeof(double))) == NULL ||
+         (topic_level = cache_aligned_calloc(topic_monitor_capacity, sizeof(uint8_t))) == NULL ||
+         (topic_rate = cache_aligned_calloc(topic_monitor_capacity, sizeof(_Atomic(double)))) == NULL ||
+         (adaptive && (topic_intervals = cache_aligned_calloc(topic_monitor_capacity, sizeof(LogHistogram))) == NULL) ||
+         (topic_histograms_enabled && (topic_histograms = cache_aligned_calloc(topic_monitor_capacity, sizeof(Pow2Histogram))) == NULL) ||
+         (topic_status_prefix != NULL && (topic_status_dirty = calloc(topic_monitor_capacity, sizeof(uint32_t))) == NULL))) {
+        fprintf(stderr, "topic: failed to allocate memory for %zu monitors\n", topic_monitor_capacity);
+        return false;
+    }
+    if (patterns > 0 && (topic_patterns = calloc(patterns, sizeof(TopicPattern))) == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for %zu patterns\n", patterns);
+        return false;
+    }
+    if (!deadline_queue_begin(&topic_deadlines, topic_monitor_capacity) || !deadline_queue_begin(&topic_rate_deadlines, topic_monitor_capacity)) {
+        fprintf(stderr, "topic: failed to allocate memory for deadlines\n");
+        return false;
+    }
+    if (!topic_index_begin(topic_monitor_capacity) || !topic_trie_begin(levels, mqtt_broker_count))
+        return false;
+    for (size_t n = 0; n < topic_count; n++) {
+        const int i = indices[n];
+        config_section(&section, NULL, "topic", i);
+        const char *topic = config_section_get_string(&section, "name", "");
+        TopicSettings settings;
+        const char *require_string;
+        const int broker = topic_broker_config(&section, i);
+        if (broker < 0 || !topic_settings_config(&section, i, &settings, &require_string))
+            return false;
+        char *name = strdup(topic);
+        if (name == NULL) {
+            fprintf(stderr, "topic: failed to allocate memory for '%s'\n", topic);
+            topic_settings_free(&settings);
+            return false;
+        }
+        if (settings.ladder->count > topic_levels)
+            topic_levels = settings.ladder->count;
+        if (topic_is_pattern(topic)) {
+            if (!topic_trie_insert(broker, topic, (int)topic_pattern_count)) {
+                fprintf(stderr, "topic: invalid or duplicate pattern '%s' ignored (topic.%d)\n", topic, i);
+                topic_settings_free(&settings);
+                free(name);
+                continue;
+            }
+            const int pattern_discover_max = config_section_get_integer(&section, "discover-max", discover_max);
+            TopicPattern *pattern = &topic_patterns[topic_pattern_count++];
+            pattern->pattern = name;
+            pattern->broker = broker;
+            pattern->subscription = 0;
+            pattern->settings = settings;
+            pattern->discover_max = pattern_discover_max > 0 ? (size_t)pattern_discover_max : 0;
+            printf("topic: monitoring pattern '%s' (broker=%s, service=%s, require=%s, discover-max=%zu)\n", pattern->pattern, mqtt_brokers[broker].name,
+                   settings.service_name ? settings.service_name : "n/a", require_string ? require_string : "n/a", pattern->discover_max);
+            topic_settings_print(topic, &settings);
+            continue;
+        }
+        size_t length;
+        const uint32_t hash = topic_hash(hash_string(topic, &length), broker);
+        if (topic_index_find(broker, topic, hash, length) != NULL) {
+            fprintf(stderr, "topic: duplicate '%s' ignored (topic.%d)\n", topic, i);
+            topic_settings_free(&settings);
+            free(name);
+            continue;
+        }
+        topic_monitor_init(topic_monitor_count, broker, name, length, hash, -1, &settings, now);
+        printf("topic: monitoring '%s' (broker=%s, service=%s, require=%s)\n", topic, mqtt_brokers[broker].name, settings.service_name ? settings.service_name : "n/a",
+               require_string ? require_string : "n/a");
+        topic_settings_print(topic, &settings);
+        topic_index_insert(hash, topic_monitor_count++);
+    }
+    if (topic_monitor_count == 0 && topic_pattern_count == 0) {
+        fprintf(stderr, "topic: none configured for monitoring\n");
+        return false;
+    }
+    topic_broker_alert_ms = config_get_duration_ms("broker-alert", BROKER_ALERT_DEFAULT * 1000);
+    topic_broker_grace_ms = config_get_duration_ms("broker-grace", BROKER_GRACE_DEFAULT * 1000);
+    printf("topic: broker alert=%gs, grace=%gs\n", (double)topic_broker_alert_ms / 1000.0, (double)topic_broker_grace_ms / 1000.0);
+    return true;
+}
+// Whether topic_config_topics would accept the topics as configured, short of running out of memory, so that a reload can
+// be refused before the current set is given up
+bool topic_config_check(void) {
+    config_section_t section;
+    const int *indices;
+    const size_t topic_count = config_get_array("topic", "name", &indices);
+    for (size_t n = 0; n < topic_count; n++) {
+        TopicSettings settings;
+        const char *require_string;
+        config_section(&section, NULL, "topic", indices[n]);
+        if (topic_broker_config(&section, indices[n]) < 0 || !topic_settings_config(&section, indices[n], &settings, &require_string))
+            return false;
+        topic_settings_free(&settings);
+    }
+    if (topic_count == 0)
+        fprintf(stderr, "topic: none configured for monitoring\n");
+    return topic_count > 0;
+}
+// Status publishing and the state file are set up once, and keep their startup configuration across reloads
+bool topic_config(void) {
+    topic_status_prefix = config_get_string("status-prefix", STATUS_PREFIX_DEFAULT);
+    if (topic_status_prefix != NULL && topic_status_prefix[0] == '\0')
+        topic_status_prefix = NULL;
+    topic_snapshot_path = config_get_string("state-file", STATE_FILE_DEFAULT);
+    if (topic_snapshot_path != NULL && topic_snapshot_path[0] == '\0')
+        topic_snapshot_path = NULL;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&topic_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    const int64_t now = time_monotonic_ms();
+    if (!reader_slot_lock_begin(&topic_readers, mqtt_worker_count))
+        return false;
+    if ((topic_brokers = calloc(mqtt_broker_count, sizeof(TopicBroker))) == NULL) {
+        fprintf(stderr, "topic: failed to allocate memory for %zu brokers\n", mqtt_broker_count);
+        return false;
+    }
+    for (size_t b = 0; b < mqtt_broker_count; b++)
+        topic_brokers[b].lost = now;
+    if (!topic_probe_config())
+        return false;
+    if (!topic_config_topics(now))
+        return false;
+    topic_snapshot_restore(now);
+    return true;
+}
+// Each client's messages come with the client's worker (so its broker) as their context
+bool topic_callbacks_register(void) {
+    for (size_t w = 0; w < mqtt_worker_count; w++)
+        if (!mqtt_message_callback_register(&mqtt_workers[w].mqtt, topic_receive_message, &mqtt_workers[w]))
+            return false;
+    return true;
+}
+void topic_callbacks_cancel(void) {
+    for (size_t w = 0; w < mqtt_worker_count; w++)
+        mqtt_message_callback_cancel(&mqtt_workers[w].mqtt);
+}
+bool topic_begin(void) {
+    if (!action_email_notification("Startup", "")) {
+        fprintf(stderr, "topic: failed send startup email\n");
+        return false;
+    }
+    for (size_t i = 0; i < topic_monitor_count; i++)
+        if (topic_monitors[i].pattern < 0)
+            topic_monitors[i].subscription = topic_subscription_assign(topic_monitors[i].broker);
+    for (size_t i = 0; i < topic_pattern_count; i++)
+        topic_patterns[i].subscription = topic_subscription_assign(topic_patterns[i].broker);
+    topic_subscriptions_build();
+    if (!topic_callbacks_register())
+        return false;
+    for (size_t i = 0; i < topic_monitor_count; i++) {
+        TopicMonitor *monitor = &topic_monitors[i];
+        if (!mqtt_broker_subscribe(monitor->broker, monitor->topic, monitor->subscription)) {
+            fprintf(stderr, "topic: failed to subscribe to '%s'\n", monitor->topic);
+            return false;
+        }
+    }
+    for (size_t i = 0; i < topic_pattern_count; i++) {
+        TopicPattern *pattern = &topic_patterns[i];
+        if (!mqtt_broker_subscribe(pattern->broker, pattern->pattern, pattern->subscription)) {
+            fprintf(stderr, "topic: failed to subscribe to '%s'\n", pattern->pattern);
+            return false;
+        }
+    }
+    for (size_t b = 0; b < mqtt_broker_count && topic_probe_interval_ms > 0; b++)
+        if (!mqtt_broker_subscribe((int)b, topic_probe_topic, 0)) {
+            fprintf(stderr, "topic: failed to subscribe to '%s'\n", topic_probe_topic);
+            return false;
+        }
+    return true;
+}
+// A monitor set taken out of service, its storage kept until the set replacing it (if any) has taken over what it can
+typedef struct {
+    TopicMonitor *monitors;
+    size_t monitor_count;
+    _Atomic(int64_t) *last_message;
+    double *scale;
+    uint8_t *level;
+    _Atomic(double) *rate;
+    LogHistogram *intervals;
+    Pow2Histogram *histograms;
+    TopicPattern *patterns;
+    size_t pattern_count;
+    Snapshot snapshot; // Mapping last_message, if it is mapped
+} TopicRetired;
+
+void topic_retire(TopicRetired *retired) {
+    *retired = (TopicRetired){.monitors = topic_monitors,
+                              .monitor_count = topic_monitor_count,
+                              .last_message = topic_last_message,
+                              .scale = topic_scale,
+                              .level = topic_level,
+                              .rate = topic_rate,
+                              .intervals = topic_intervals,
+                              .histograms = topic_histograms,
+                              .patterns = topic_patterns,
+                              .pattern_count = topic_pattern_count,
+                              .snapshot = topic_snapshot};
+    topic_trie_end();
+    topic_index_end();
+    deadline_queue_end(&topic_deadlines);
+    deadline_queue_end(&topic_rate_deadlines);
+    free(topic_status_dirty);
+    topic_status_dirty = NULL;
+    topic_status_dirty_count = 0;
+    topic_monitors = NULL;
+    topic_last_message = NULL;
+    topic_scale = NULL;
+    topic_level = NULL;
+    topic_rate = NULL;
+    topic_intervals = NULL;
+    topic_histograms = NULL;
+    topic_patterns = NULL;
+    topic_snapshot = (Snapshot){0};
+    topic_snapshot_header = NULL;
+    topic_snapshot_records = NULL;
+    topic_monitor_count = topic_monitor_capacity = topic_pattern_count = topic_levels = 0;
+}
+void topic_retired_free(TopicRetired *retired) {
+    for (size_t i = 0; i < retired->monitor_count; i++) {
+        TopicMonitor *monitor = &retired->monitors[i];
+        free((void *)(uintptr_t)monitor->topic);
+        if (monitor->pattern < 0) {
+            free((void *)(uintptr_t)monitor->service_name);
+            topic_require_free(monitor->require);
+            topic_ladder_free((TopicLadder *)(uintptr_t)monitor->ladder);
+        }
+    }
+    for (size_t i = 0; i < retired->pattern_count; i++) {
+        free((void *)(uintptr_t)retired->patterns[i].pattern);
+        topic_settings_free(&retired->patterns[i].settings);
+    }
+    free(retired->patterns);
+    free(retired->monitors);
+    if (retired->snapshot.data != NULL)
+        snapshot_close(&retired->snapshot);
+    else
+        free(retired->last_message);
+    free(retired->scale);
+    free(retired->level);
+    free(retired->rate);
+    free(retired->intervals);
+    free(retired->histograms);
+}
+void topic_end(void) {
+    topic_callbacks_cancel();
+    if (topic_snapshot_header != NULL) {
+        topic_snapshot_sync(time_monotonic_ms(), true);
+        snapshot_sync(&topic_snapshot);
+    }
+    for (size_t i = 0; i < topic_monitor_count; i++)
+        if (topic_monitors[i].pattern < 0)
+            mqtt_broker_unsubscribe(topic_monitors[i].broker, topic_monitors[i].topic);
+    for (size_t i = 0; i < topic_pattern_count; i++)
+        mqtt_broker_unsubscribe(topic_patterns[i].broker, topic_patterns[i].pattern);
+    for (size_t b = 0; b < mqtt_broker_count && topic_probe_interval_ms > 0; b++)
+        mqtt_broker_unsubscribe((int)b, topic_probe_topic);
+    TopicRetired retired;
+    topic_retire(&retired);
+    topic_retired_free(&retired);
+    free(topic_brokers);
+    topic_brokers = NULL;
+    reader_slot_lock_end(&topic_readers);
+    topic_subscriptions_end();
+    string_buffer_free(&topic_status_name);
+    string_buffer_free(&topic_status_payload);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// A reload builds the new monitor set afresh, as at startup, then the monitor of each topic still configured (or still
+// matching a pattern), on the same broker, takes over the live state of the one it replaces: age, level, counters, rate
+// estimate and histograms, as far as its new settings allow. Only the subscriptions that changed are made or dropped,
+// so the work the broker sees is in proportion to the change; messages are held off only while the sets are swapped
+// (those arriving meanwhile are lost).
+
+// Under topic_lock
+void topic_carry_monitor(const size_t index, const TopicRetired *retired, const size_t from, const int64_t now) {
+    TopicMonitor *monitor = &topic_monitors[index];
+    const TopicMonitor *previous = &retired->monitors[from];
+    const size_t levels = monitor->ladder->count;
+    const uint8_t level = retired->level[from] < levels ? retired->level[from] : (uint8_t)levels;
+    atomic_store_explicit(&topic_last_message[index], atomic_load_explicit(&retired->last_message[from], memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&monitor->messages, atomic_load_explicit(&previous->messages, memory_order_relaxed), memory_order_relaxed);
+    atomic_store_explicit(&monitor->rejected, atomic_load_explicit(&previous->rejected, memory_order_relaxed), memory_order_relaxed);
+    topic_level[index] = level;
+    monitor->escalated_last = level > 0 ? previous->escalated_last : 0;
+    const int64_t repeat_ms = level > 0 ? monitor->ladder->levels[level - 1].repeat_ms : 0;
+    monitor->repeat_at = repeat_ms > 0 ? (previous->repeat_at > 0 ? previous->repeat_at : now + repeat_ms) : 0;
+    for (size_t k = 0; k < levels; k++) {
+        monitor->escalations[k] = previous->escalations[k];
+        monitor->escalated_time[k] = previous->escalated_time[k];
+    }
+    atomic_store_explicit(&monitor->seen, atomic_load_explicit(&previous->seen, memory_order_relaxed), memory_order_relaxed);
+    monitor->status = previous->status == TOPIC_STATUS_UNKNOWN || previous->status <= levels ? previous->status : TOPIC_STATUS_UNKNOWN;
+    if (monitor->adaptive.quantile > 0.0 && previous->adaptive.quantile > 0.0) {
+        memcpy(&topic_intervals[index], &retired->intervals[from], sizeof(LogHistogram));
+        topic_scale[index] = retired->scale[from];
+        monitor->adapted = previous->adapted;
+    }
+    if (topic_histograms != NULL && retired->histograms != NULL)
+        memcpy(&topic_histograms[index], &retired->histograms[from], sizeof(Pow2Histogram));
+    // The estimate is only comparable over the same window
+    if (monitor->rate.window_ms > 0 && monitor->rate.window_ms == previous->rate.window_ms) {
+        atomic_store_explicit(&topic_rate[index], atomic_load_explicit(&retired->rate[from], memory_order_relaxed), memory_order_relaxed);
+        monitor->rate_started = previous->rate_started;
+        monitor->rate_violated = previous->rate_violated;
+        monitor->rate_level = previous->rate_level < levels ? previous->rate_level : (uint8_t)levels;
+        deadline_queue_set(&topic_rate_deadlines, (uint32_t)index, now);
+    }
+    deadline_queue_set(&topic_deadlines, (uint32_t)index, now); // to be looked at afresh
+    topic_snapshot_store(index);
+}
+// Under topic_lock: returns how many monitors were carried over, marking in subscribed the configured topics that already were
+size_t topic_carry(const TopicRetired *retired, bool *subscribed, const int64_t now) {
+    size_t carried = 0;
+    for (size_t i = 0; i < retired->monitor_count; i++) {
+        const TopicMonitor *previous = &retired->monitors[i];
+        TopicMonitor *monitor = topic_index_find(previous->broker, previous->topic, previous->topic_hash, previous->topic_length);
+        int pattern;
+        char *name;
+        if (monitor == NULL && topic_pattern_count > 0 && (pattern = topic_trie_match(previous->broker, previous->topic, true)) >= 0 &&
+            (name = strdup(previous->topic)) != NULL)
+            monitor = __topic_discover(pattern, name, previous->topic_hash, previous->topic_length, now);
+        if (monitor == NULL) {
+            if (topic_status_prefix != NULL && previous->status != TOPIC_STATUS_UNKNOWN && topic_status_topic("topic/", previous->topic))
+                mqtt_publish(mqtt_broker_client(previous->broker), topic_status_name.data, "", 0, true); // an empty retained message deletes it
+            continue;
+        }
+        if (previous->pattern < 0 && monitor->pattern < 0) {
+            subscribed[monitor - topic_monitors] = true;
+            monitor->subscription = previous->subscription;
+        }
+        topic_carry_monitor((size_t)(monitor - topic_monitors), retired, i, now);
+        carried++;
+    }
+    return carried;
+}
+bool topic_pattern_same(const TopicPattern *a, const TopicPattern *b) { return a->broker == b->broker && strcmp(a->pattern, b->pattern) == 0; }
+// Under topic_lock: subscribes to what is newly configured and unsubscribes from what no longer is; there are few enough
+// patterns to compare them pairwise
+void topic_carry_subscriptions(const TopicRetired *retired, const bool *subscribed, size_t *subscribes, size_t *unsubscribes) {
+    for (size_t i = 0; i < retired->monitor_count; i++) {
+        const TopicMonitor *previous = &retired->monitors[i];
+        const TopicMonitor *monitor = topic_index_find(previous->broker, previous->topic, previous->topic_hash, previous->topic_length);
+        if (previous->pattern < 0 && (monitor == NULL || monitor->pattern >= 0) && mqtt_broker_unsubscribe(previous->broker, previous->topic))
+            (*unsubscribes)++;
+    }
+    for (size_t i = 0; i < topic_monitor_count; i++)
+        if (topic_monitors[i].pattern < 0 && !subscribed[i]) {
+            topic_monitors[i].subscription = topic_subscription_assign(topic_monitors[i].broker);
+            if (mqtt_broker_subscribe(topic_monitors[i].broker, topic_monitors[i].topic, topic_monitors[i].subscription))
+                (*subscribes)++;
+            else
+                fprintf(stderr, "topic: failed to subscribe to '%s'\n", topic_monitors[i].topic);
+        }
+    for (size_t i = 0; i < retired->pattern_count; i++) {
+        size_t j = 0;
+        while (j < topic_pattern_count && !topic_pattern_same(&topic_patterns[j], &retired->patterns[i]))
+            j++;
+        if (j < topic_pattern_count) {
+            topic_patterns[j].subscription = retired->patterns[i].subscription;
+            topic_patterns[j].evicted += retired->patterns[i].evicted;
+            topic_patterns[j].dropped += retired->patterns[i].dropped;
+        } else if (mqtt_broker_unsubscribe(retired->patterns[i].broker, retired->patterns[i].pattern))
+            (*unsubscribes)++;
+    }
+    for (size_t j = 0; j < topic_pattern_count; j++) {
+        size_t i = 0;
+        while (i < retired->pattern_count && !topic_pattern_same(&retired->patterns[i], &topic_patterns[j]))
+            i++;
+        if (i < retired->pattern_count)
+            continue;
+        topic_patterns[j].subscription = topic_subscription_assign(topic_patterns[j].broker);
+        if (mqtt_broker_subscribe(topic_patterns[j].broker, topic_patterns[j].pattern, topic_patterns[j].subscription))
+            (*subscribes)++;
+        else
+            fprintf(stderr, "topic: failed to subscribe to '%s'\n", topic_patterns[j].pattern);
+    }
+}
+// Under topic_lock: the published states carried over are counted afresh, by the classes of their new ladders
+void topic_status_recount(void) {
+    topic_status_counts[0] = topic_status_counts[1] = topic_status_counts[2] = 0;
+    for (size_t i = 0; i < topic_monitor_count; i++) {
+        if (topic_monitors[i].status != TOPIC_STATUS_UNKNOWN)
+            topic_status_counts[topic_state_class(i, topic_monitors[i].status)]++;
+        topic_status_check(i);
+    }
+    topic_status_summary_dirty = true;
+}
+// Applies the topics as configured now (after config_reload), keeping the current set if they are not valid; false only
+// if the new set could not be set up, which leaves nothing to monitor with
+bool topic_reload(void) {
+    if (!topic_config_check()) {
+        fprintf(stderr, "topic: reload refused, topics unchanged\n");
+        return true;
+    }
+    topic_callbacks_cancel();
+    pthread_mutex_lock(&topic_lock);
+    const int64_t now = time_monotonic_ms();
+    size_t carried = 0, subscribes = 0, unsubscribes = 0;
+    TopicRetired retired;
+    topic_retire(&retired);
+    bool *subscribed = NULL;
+    const bool result = topic_config_topics(now) && (subscribed = calloc(topic_monitor_capacity + 1, sizeof(bool))) != NULL;
+    if (result) {
+        carried = topic_carry(&retired, subscribed, now);
+        topic_carry_subscriptions(&retired, subscribed, &subscribes, &unsubscribes);
+        topic_subscriptions_build();
+        topic_status_recount();
+        topic_snapshot_commit(now);
+    } else
+        fprintf(stderr, "topic: failed to reload\n");
+    free(subscribed);
+    topic_retired_free(&retired);
+    const size_t monitors = topic_monitor_count, patterns = topic_pattern_count;
+    pthread_mutex_unlock(&topic_lock);
+    if (!result || !topic_callbacks_register())
+        return false;
+    printf("topic: reloaded %zu topics and %zu patterns in %gs (%zu carried over, %zu subscribed, %zu unsubscribed)\n", monitors, patterns,
+           (double)(time_monotonic_ms() - now) / 1000.0, carried, subscribes, unsubscribes);
+    return true;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+#include "include/http_linux.h"
+
+// Served from the HTTP server's own thread, in either loop mode
+HttpConfig metricsConfig;
+
+int metrics_handler(const char *path, StringBuffer *body, const char **content_type) {
+    if (strcmp(path, "/metrics") != 0)
+        return 404;
+    size_t queued;
+    const DispatchStats alerts = dispatch_stats_get(&queued);
+    const EmailStats emails = email_stats_get();
+    if (!topic_metrics_render(body) || !action_backend_metrics_render(body) ||
+        !string_buffer_printf(body,
+                              "# TYPE mqtt_watchdog_alerts_queued gauge\nmqtt_watchdog_alerts_queued %zu\n"
+                              "# TYPE mqtt_watchdog_alerts_submitted counter\nmqtt_watchdog_alerts_submitted_total %lu\n"
+                              "# TYPE mqtt_watchdog_alerts_completed counter\nmqtt_watchdog_alerts_completed_total %lu\n"
+                              "# TYPE mqtt_watchdog_alerts_retried counter\nmqtt_watchdog_alerts_retried_total %lu\n"
+                              "# TYPE mqtt_watchdog_alerts_dropped counter\nmqtt_watchdog_alerts_dropped_total{reason=\"full\"} %lu\n"
+                              "mqtt_watchdog_alerts_dropped_total{reason=\"failed\"} %lu\nmqtt_watchdog_alerts_dropped_total{reason=\"stopped\"} %lu\n"
+                              "# TYPE mqtt_watchdog_emails counter\nmqtt_watchdog_emails_total{result=\"sent\"} %lu\nmqtt_watchdog_emails_total{result=\"failed\"} %lu\n"
+                              "# TYPE mqtt_watchdog_email_withheld counter\nmqtt_watchdog_email_withheld_total %lu\n"
+                              "# TYPE mqtt_watchdog_email_connections counter\nmqtt_watchdog_email_connections_total{connection=\"new\"} %lu\n"
+                              "mqtt_watchdog_email_connections_total{connection=\"reused\"} %lu\n"
+                              "# TYPE mqtt_watchdog_restarts counter\nmqtt_watchdog_restarts_total{result=\"done\"} %lu\nmqtt_watchdog_restarts_total{result=\"failed\"} %lu\n"
+                              "mqtt_watchdog_restarts_total{result=\"timeout\"} %lu\nmqtt_watchdog_restarts_total{result=\"skipped\"} %lu\n# EOF\n",
+                              queued, alerts.submitted, alerts.completed, alerts.retried, alerts.dropped_full, alerts.dropped_failed, alerts.dropped_stopped, emails.sent, emails.failed,
+                              email_withheld, emails.connects, emails.reused, action_systemd_results[SYSTEMD_RESTART_DONE],
+                              action_systemd_results[SYSTEMD_RESTART_FAILED], action_systemd_results[SYSTEMD_RESTART_TIMEOUT],
+                              action_systemd_results[SYSTEMD_RESTART_SKIPPED]))
+        return 500;
+    *content_type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    return 200;
+}
+
+bool metrics_config(void) {
+    metricsConfig.address = config_get_string("metrics-address", METRICS_ADDRESS_DEFAULT);
+    metricsConfig.port = config_get_integer("metrics-port", METRICS_PORT_DEFAULT);
+    metricsConfig.handler = metrics_handler;
+    metricsConfig.debug = config_get_bool("debug", false);
+    if (metricsConfig.port < 0 || metricsConfig.port > 65535) {
+        fprintf(stderr, "metrics: invalid port %d\n", metricsConfig.port);
+        return false;
+    }
+    topic_histograms_enabled = metricsConfig.port > 0;
+    if (metricsConfig.port > 0)
+        printf("metrics: address=%s, port=%d\n", metricsConfig.address, metricsConfig.port);
+    return true;
+}
+bool metrics_begin(void) { return metricsConfig.port == 0 || http_begin(&metricsConfig); }
+void metrics_end(void) { http_end(); }
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+time_t report_period, report_last = 0;
+StringBuffer report_buffer = {0};
+
+const struct option config_options[] = {{"config", required_argument, 0, 0},      // config
+                                        {"mqtt-client", required_argument, 0, 0}, // mqtt
+                                        {"mqtt-server", required_argument, 0, 0},
+                                        {"mqtt-protocol", required_argument, 0, 0},
+                                        {"ingest-workers", required_argument, 0, 0},
+                                        {"ingest-group", required_argument, 0, 0},
+                                        {"email-name", required_argument, 0, 0}, // email
+                                        {"email-from", required_argument, 0, 0},
+                                        {"email-to", required_argument, 0, 0},
+                                        {"email-subject", required_argument, 0, 0},
+                                        {"email-smtp", required_argument, 0, 0},
+                                        {"email-username", required_argument, 0, 0},
+                                        {"email-password", required_argument, 0, 0},
+                                        {"email-use-ssl", required_argument, 0, 0},
+                                        {"email-rate-limit", required_argument, 0, 0},
+                                        {"email-rate-period", required_argument, 0, 0},
+                                        {"systemd-timeout", required_argument, 0, 0}, // systemd
+                                        {"alert-queue", required_argument, 0, 0},     // alert
+                                        {"alert-workers", required_argument, 0, 0},
+                                        {"alert-attempts", required_argument, 0, 0},
+                                        {"alert-timeout", required_argument, 0, 0},
+                                        {"alert-backoff", required_argument, 0, 0},
+                                        {"alert-digest", required_argument, 0, 0},
+                                        {"topic-discover-max", required_argument, 0, 0}, // topic
+                                        {"status-prefix", required_argument, 0, 0},      // status
+                                        {"broker-alert", required_argument, 0, 0},       // broker
+                                        {"broker-grace", required_argument, 0, 0},
+                                        {"probe-interval", required_argument, 0, 0},
+                                        {"probe-topic", required_argument, 0, 0},
+                                        {"probe-levels", required_argument, 0, 0},
+                                        {"probe-stretch", required_argument, 0, 0},
+                                        {"state-file", required_argument, 0, 0},         // state
+                                        {"metrics-address", required_argument, 0, 0},    // metrics
+                                        {"metrics-port", required_argument, 0, 0},
+                                        {"report-period", required_argument, 0, 0},      // report
+                                        {"event-loop", required_argument, 0, 0},         // loop
+                                        {"config-watch", required_argument, 0, 0},       // reload
+                                        {"debug", required_argument, 0, 0},              // debug
+                                        {0, 0, 0, 0}};
+
+// A reload reads the configuration again and applies the topics from it; everything else keeps its startup configuration.
+// It is asked for by SIGHUP or, with 'config-watch', by the configuration file or a file it includes being written or
+// replaced, or a "*.cfg" file being added to or removed from a directory it includes (files are watched through their
+// directories, as editors often replace them), and carried out by the main loop between processing passes.
+volatile sig_atomic_t reload_requested = false;
+int reload_argc;
+char **reload_argv;
+int reload_watch_fd = -1;
+typedef struct {
+    int wd;
+    char name[NAME_MAX + 1]; // Empty for an included directory
+} ReloadWatch;
+ReloadWatch *reload_watches = NULL;
+size_t reload_watch_count = 0;
+
+bool __reload_watch_add(const char *directory, const char *name, const char *path) {
+    const int wd = inotify_add_watch(reload_watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | (name[0] == '\0' ? IN_DELETE | IN_MOVED_FROM : 0) | IN_MASK_ADD);
+    if (wd < 0) {
+        fprintf(stderr, "reload: failed to watch '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < reload_watch_count; i++)
+        if (reload_watches[i].wd == wd && strcmp(reload_watches[i].name, name) == 0)
+            return true;
+    ReloadWatch *watches = realloc(reload_watches, (reload_watch_count + 1) * sizeof(ReloadWatch));
+    if (watches == NULL) {
+        fprintf(stderr, "reload: failed to allocate memory for watch\n");
+        return false;
+    }
+    reload_watches = watches;
+    reload_watches[reload_watch_count].wd = wd;
+    snprintf(reload_watches[reload_watch_count++].name, sizeof(reload_watches->name), "%s", name);
+    printf("reload: watching '%s'\n", path);
+    return true;
+}
+// Watches what the configuration was loaded from, other than the files of included directories, which are covered by the
+// directories; called again after each reload, for anything newly included
+bool reload_watch_sources(void) {
+    char directory[PATH_MAX];
+    bool result = true;
+    if (reload_watch_fd < 0)
+        return true;
+    for (size_t i = 0; i < config_source_count; i++) {
+        const config_source_t *source = &config_sources[i];
+        if (source->fragment)
+            continue;
+        const char *slash = strrchr(source->path, '/');
+        if (source->directory)
+            snprintf(directory, sizeof(directory), "%s", source->path);
+        else if (slash == NULL)
+            snprintf(directory, sizeof(directory), ".");
+        else
+            snprintf(directory, sizeof(directory), "%.*s", slash == source->path ? 1 : (int)(slash - source->path), source->path);
+        if (!__reload_watch_add(directory, source->directory ? "" : slash == NULL ? source->path : slash + 1, source->path))
+            result = false;
+    }
+    return result;
+}
+bool reload_watch_begin(void) {
+    if (!config_get_bool("config-watch", CONFIG_WATCH_DEFAULT))
+        return true;
+    if ((reload_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "reload: failed to watch '%s': %s\n", config_path, strerror(errno));
+        return false;
+    }
+    return reload_watch_sources();
+}
+bool __reload_watch_match(const struct inotify_event *event) {
+    if (event->len == 0)
+        return false;
+    const size_t length = strlen(event->name);
+    for (size_t i = 0; i < reload_watch_count; i++)
+        if (reload_watches[i].wd == event->wd) {
+            if (reload_watches[i].name[0] == '\0' ? event->name[0] != '.' && length > 4 && strcmp(event->name + length - 4, ".cfg") == 0
+                                                  : (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) != 0 && strcmp(event->name, reload_watches[i].name) == 0)
+                return true;
+        }
+    return false;
+}
+// Drains the events, asking for a reload if any is for the configuration, so that a burst of them makes for one reload
+void reload_watch_check(void) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    if (reload_watch_fd < 0)
+        return;
+    while ((length = read(reload_watch_fd, events, sizeof(events))) > 0)
+        for (const char *next = events; next < events + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)(const void *)next;
+            if (__reload_watch_match(event))
+                reload_requested = true;
+            next += sizeof(struct inotify_event) + event->len;
+        }
+}
+void reload_watch_end(void) {
+    if (reload_watch_fd >= 0)
+        close(reload_watch_fd);
+    reload_watch_fd = -1;
+    free(reload_watches);
+    reload_watches = NULL;
+    reload_watch_count = 0;
+}
+// A configuration that cannot be loaded whole (such as for a missing include) is refused, leaving the topics as they are
+bool reload(void) {
+    reload_requested = false;
+    printf("reload: reloading '%s'\n", config_path);
+    if (!config_reload(CONFIG_FILE_DEFAULT, reload_argc, reload_argv, config_options)) {
+        fprintf(stderr, "reload: configuration not loaded, topics unchanged\n");
+        return true;
+    }
+    reload_watch_sources();
+    return topic_reload();
+}
+
+bool config(int argc, char *argv[]) {
+    if (!config_load(CONFIG_FILE_DEFAULT, argc, argv, config_options))
+        return false;
+    reload_argc = argc;
+    reload_argv = argv;
+    report_period = (time_t)config_get_integer("report-period", REPORT_PERIOD_DEFAULT);
+    printf("report-period=%ld\n", report_period);
+    return mqtt_config() && metrics_config() && action_backend_config() && topic_config() && alert_config() && action_email_config() && action_systemd_config();
+}
+bool startup(void) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    return mqtt_begin_all() && alert_begin() && action_email_begin() && action_systemd_begin() && topic_begin() && metrics_begin() && reload_watch_begin();
+}
+void cleanup(void) {
+    reload_watch_end();
+    metrics_end();
+    topic_end();
+    action_systemd_end(); // restarts still in progress are alerted on, so before the queue
+    action_email_digest_flush(time_monotonic_ms(), true);
+    alert_end();
+    action_email_end();
+    action_backend_end();
+    mqtt_end_all();
+    curl_global_cleanup();
+    string_buffer_free(&report_buffer);
+    config_end();
+}
+bool process(void) {
+    reload_watch_check();
+    if (reload_requested && !reload())
+        return false;
+    mqtt_poll_all();
+    const bool result = topic_process();
+    systemd_process();
+    if (intervalable(report_period, &report_last)) {
+        string_buffer_reset(&report_buffer);
+        if (topic_stats_to_string(&report_buffer))
+            printf("report: %s\n", report_buffer.data);
+        string_buffer_reset(&report_buffer);
+        if (mqtt_ingest_workers > 1 && mqtt_workers_stats_to_string(&report_buffer))
+            printf("report: ingest %s\n", report_buffer.data);
+        string_buffer_reset(&report_buffer);
+        if (topic_probe_interval_ms > 0 && topic_probe_stats_to_string(&report_buffer))
+            printf("report: probe %s\n", report_buffer.data);
+        size_t queued;
+        const DispatchStats alerts = dispatch_stats_get(&queued);
+        printf("report: alerts submitted=%lu, completed=%lu, retried=%lu, dropped=%lu/%lu/%lu (full/failed/stopped), queued=%zu\n", alerts.submitted,
+               alerts.completed, alerts.retried, alerts.dropped_full, alerts.dropped_failed, alerts.dropped_stopped, queued);
+        const EmailStats emails = email_stats_get();
+        printf("report: restarts done=%lu, failed=%lu, timeout=%lu, skipped=%lu, in progress=%zu\n", action_systemd_results[SYSTEMD_RESTART_DONE],
+               action_systemd_results[SYSTEMD_RESTART_FAILED], action_systemd_results[SYSTEMD_RESTART_TIMEOUT], action_systemd_results[SYSTEMD_RESTART_SKIPPED],
+               systemd_restarts_in_progress());
+        printf("report: email sent=%lu, failed=%lu, withheld=%lu, connections=%lu (reused %lu)\n", emails.sent, emails.failed, email_withheld, emails.connects,
+               emails.reused);
+        string_buffer_reset(&report_buffer);
+        if (action_backend_stats_to_string(&report_buffer))
+            printf("report: actions %s\n", report_buffer.data);
+    }
+    return result;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------------------------
+
+// Upper bound on sleeping between topic deadlines, so that signals, reconnects and reports are still serviced
+#define PROCESS_INTERVAL_MAX_MS 1000
+volatile bool running = true;
+
+void signal_handler(const int sig __attribute__((unused))) {
+    if (running) {
+        printf("stopping\n");
+        running = false;
+    }
+}
+void signal_handler_reload(const int sig __attribute__((unused))) { reload_requested = true; }
+
+bool loop_threaded(void) {
+    while (running) {
+        if (!process())
+            return false;
+        if (running)
+            topic_wait(PROCESS_INTERVAL_MAX_MS);
+    }
+    return true;
+}
+
+// Single threaded alternative: the MQTT sockets (one per broker), a timerfd armed for the earliest deadline and a
+// signalfd feed one epoll set, so messages, deadlines and signals are all handled here, and the thread only wakes when
+// one of them needs attention
+bool loop_event_register(const int epoll_fd, const int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        fprintf(stderr, "loop: epoll add failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+// Sockets that change across reconnects (the MQTT and system bus connections) are followed here, along with the events wanted
+void loop_event_watch(const int epoll_fd, const char *name, int *watched_fd, uint32_t *watched_events, const int fd, const uint32_t events) {
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    if (fd != *watched_fd) {
+        if (*watched_fd >= 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *watched_fd, NULL); // already gone if the socket was closed
+        if (fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+            fprintf(stderr, "loop: epoll add failed for %s: %s\n", name, strerror(errno));
+    } else if (fd >= 0 && events != *watched_events)
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    *watched_fd = fd;
+    *watched_events = events;
+}
+bool loop_event_run(const int epoll_fd, const int timer_fd, const int signal_fd) {
+    int *mqtt_fds = malloc(mqtt_worker_count * sizeof(int)), bus_fd = -1;
+    uint32_t *mqtt_events = calloc(mqtt_worker_count, sizeof(uint32_t)), bus_events = 0;
+    if (mqtt_fds == NULL || mqtt_events == NULL) {
+        fprintf(stderr, "loop: failed to allocate memory for %zu clients\n", mqtt_worker_count);
+        free(mqtt_fds);
+        free(mqtt_events);
+        return false;
+    }
+    for (size_t b = 0; b < mqtt_worker_count; b++)
+        mqtt_fds[b] = -1;
+    bool result = true;
+    while (running) {
+        if (!(result = process()))
+            break;
+        int64_t until = INT64_MAX, deadline;
+        // Writability is only of interest while output is queued; poll and epoll share the values of IN and OUT
+        for (size_t b = 0; b < mqtt_worker_count; b++) {
+            MqttClient *client = &mqtt_workers[b].mqtt;
+            loop_event_watch(epoll_fd, client->name, &mqtt_fds[b], &mqtt_events[b], mqtt_socket(client), EPOLLIN | (mqtt_want_write(client) ? EPOLLOUT : 0));
+            if (time_monotonic_ms() + mqtt_loop_timeout_ms(client) < until)
+                until = time_monotonic_ms() + mqtt_loop_timeout_ms(client);
+        }
+        loop_event_watch(epoll_fd, "systemd", &bus_fd, &bus_events, systemd_fd(), (uint32_t)systemd_events());
+        if (topic_next_deadline(&deadline) && deadline < until)
+            until = deadline;
+        if (systemd_next_deadline(&deadline) && deadline < until)
+            until = deadline;
+        const struct itimerspec timer = {.it_value = {.tv_sec = (time_t)(until / 1000), .tv_nsec = (long)(until % 1000) * 1000000}};
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+        struct epoll_event ready[16];
+        const int count = epoll_wait(epoll_fd, ready, sizeof(ready) / sizeof(ready[0]), -1);
+        if (count < 0 && errno != EINTR) {
+            fprintf(stderr, "loop: epoll wait failed: %s\n", strerror(errno));
+            result = false;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+                    if (info.ssi_signo == SIGHUP)
+                        reload_requested = true;
+                    else if (running) {
+                        printf("stopping\n");
+                        running = false;
+                    }
+            } else if (ready[i].data.fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                    fprintf(stderr, "loop: timer read failed: %s\n", strerror(errno));
+            } else
+                for (size_t b = 0; b < mqtt_worker_count; b++)
+                    if (ready[i].data.fd == mqtt_fds[b]) {
+                        if (ready[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                            mqtt_loop_read(&mqtt_workers[b].mqtt);
+                        if (ready[i].events & EPOLLOUT)
+                            mqtt_loop_write(&mqtt_workers[b].mqtt);
+                        break;
+                    } // the system bus and the configuration watch are serviced by process()
+        }
+        for (size_t b = 0; b < mqtt_worker_count; b++)
+            mqtt_loop_misc(&mqtt_workers[b].mqtt);
+    }
+    free(mqtt_fds);
+    free(mqtt_events);
+    return result;
+}
+bool loop_event(const sigset_t *signals) {
+    bool result = false;
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    const int signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epoll_fd < 0 || timer_fd < 0 || signal_fd < 0)
+        fprintf(stderr, "loop: failed to create descriptors: %s\n", strerror(errno));
+    else if (loop_event_register(epoll_fd, timer_fd) && loop_event_register(epoll_fd, signal_fd) &&
+             (reload_watch_fd < 0 || loop_event_register(epoll_fd, reload_watch_fd)))
+        result = loop_event_run(epoll_fd, timer_fd, signal_fd);
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (timer_fd >= 0)
+        close(timer_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    setbuf(stdout, NULL);
+    printf("starting\n");
+    if (!config(argc, argv))
+        return EXIT_FAILURE;
+    // Block the signals before any thread is started, so that in event loop mode they are only ever seen by the signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if (mqttConfig.external_loop)
+        sigprocmask(SIG_BLOCK, &signals, NULL);
+    else {
+        signal(SIGINT, signal_handler);
+        signal(SIGTERM, signal_handler);
+        signal(SIGHUP, signal_handler_reload);
+    }
+    if (!startup()) {
+        cleanup();
+        return EXIT_FAILURE;
+    }
+    const bool result = mqttConfig.external_loop ? loop_event(&signals) : loop_threaded();
     cleanup();
-    return EXIT_SUCCESS;
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 // -----------------------------------------------------------------------------------------------------------------------------------------